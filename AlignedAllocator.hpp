@@ -0,0 +1,51 @@
+/* An allocator for std::vector that starts every array on a cache line,
+ * so arrays of cache line sized records never straddle two lines, and
+ * types declared alignas(CACHE_LINE_SIZE) get the alignment they ask for.
+ */
+#ifndef ALIGNEDALLOCATOR_HPP
+#define ALIGNEDALLOCATOR_HPP
+
+#include <stdlib.h>
+#include <cstddef>
+#include <new>
+
+const std::size_t CACHE_LINE_SIZE = 64;
+
+template <typename T>
+class CacheAlignedAllocator {
+public:
+    typedef T value_type;
+
+    CacheAlignedAllocator() {}
+    template <typename U>
+    CacheAlignedAllocator(const CacheAlignedAllocator<U> &) {}
+
+    T *allocate(std::size_t count);
+    void deallocate(T *pointer, std::size_t count);
+};
+
+template <typename T>
+T *CacheAlignedAllocator<T>::allocate(std::size_t count) {
+    void *memory;
+    if (posix_memalign(&memory, CACHE_LINE_SIZE, count * sizeof(T)) != 0)
+        throw std::bad_alloc();
+    return static_cast<T*>(memory);
+}
+
+template <typename T>
+void CacheAlignedAllocator<T>::deallocate(T *pointer, std::size_t) {
+    free(pointer);
+}
+
+//- Every instance can free memory from every other -//
+template <typename T, typename U>
+bool operator==(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const CacheAlignedAllocator<T> &, const CacheAlignedAllocator<U> &) {
+    return false;
+}
+
+#endif
@@ -0,0 +1,120 @@
+/* Writes images on a background thread, so rendering can go on while the
+ * last frame is encoded. Each image is copied when it is queued, and the
+ * writer has its own thread pool to compress PNGs in parallel.
+ *
+ * Images are written in the order they were queued. If the same path is
+ * queued again before it was written, only the newest image is written,
+ * so a slow disk skips stale snapshots instead of falling behind.
+ */
+#ifndef ASYNCIMAGEWRITER_HPP
+#define ASYNCIMAGEWRITER_HPP
+
+#include "ColorBuffer.hpp"
+#include "ThreadPool.hpp"
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class AsyncImageWriter {
+public:
+    //- numberOfThreads compress each PNG; 0 uses every hardware thread -//
+    AsyncImageWriter(unsigned numberOfThreads = 0);
+    //- Writes everything still queued -//
+    ~AsyncImageWriter();
+
+    //- Queues image to be written as ColorBuffer::writeToFile would -//
+    void write(const ColorBuffer &image, const std::string &fileName, const std::string &fileExtension);
+    //- Blocks until every queued image is written. False if any write since the last wait failed -//
+    bool wait();
+private:
+    struct Job {
+        std::string fileName;
+        std::string fileExtension;
+        std::unique_ptr<ColorBuffer> image;
+    };
+
+    ThreadPool pool;
+    std::deque<Job> jobs;
+    bool writing;
+    bool done;
+    bool failed;
+    std::mutex mutex;
+    std::condition_variable jobQueued;
+    std::condition_variable jobWritten;
+    std::thread thread;
+
+    void run();
+};
+
+AsyncImageWriter::AsyncImageWriter(unsigned numberOfThreads) : pool(numberOfThreads) {
+    writing = false;
+    done = false;
+    failed = false;
+    thread = std::thread(&AsyncImageWriter::run, this);
+}
+
+AsyncImageWriter::~AsyncImageWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    jobQueued.notify_one();
+    thread.join();
+}
+
+void AsyncImageWriter::write(const ColorBuffer &image, const std::string &fileName, const std::string &fileExtension) {
+    std::unique_ptr<ColorBuffer> copy(new ColorBuffer(image));
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < jobs.size(); i++) {
+            if (jobs[i].fileName == fileName && jobs[i].fileExtension == fileExtension) {
+                jobs[i].image = std::move(copy);
+                return;
+            }
+        }
+
+        Job job;
+        job.fileName = fileName;
+        job.fileExtension = fileExtension;
+        job.image = std::move(copy);
+        jobs.push_back(std::move(job));
+    }
+    jobQueued.notify_one();
+}
+
+bool AsyncImageWriter::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    jobWritten.wait(lock, [this] { return jobs.empty() && !writing; });
+    bool written = !failed;
+    failed = false;
+    return written;
+}
+
+void AsyncImageWriter::run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        jobQueued.wait(lock, [this] { return !jobs.empty() || done; });
+        if (jobs.empty())
+            return;
+
+        Job job = std::move(jobs.front());
+        jobs.pop_front();
+        writing = true;
+        lock.unlock();
+
+        bool written = !job.image->writeToFile(job.fileName, job.fileExtension, &pool).empty();
+        if (!written)
+            std::cerr << "Could not write " << job.fileName << job.fileExtension << "\n";
+
+        lock.lock();
+        failed = failed || !written;
+        writing = false;
+        jobWritten.notify_all();
+    }
+}
+
+#endif
@@ -0,0 +1,403 @@
+/* A bounding volume hierarchy over bounded shapes.
+ * Nodes are stored flattened in one array, with the two children of an
+ * interior node next to each other, so a ray only walks an array of
+ * indices instead of chasing pointers. The tree is built by BVHBuilder.
+ *
+ * The spheres and triangles of every leaf are also packed into
+ * SphereBatches and TriangleBatches, so a leaf is tested with a couple of
+ * SIMD kernel calls. Other shapes in a leaf are tested one at a time.
+ *
+ * Coherent rays, like the camera rays of neighbouring pixels, can be
+ * traced together as a RayPacket, which walks the tree once for the whole
+ * packet.
+ */
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include "AlignedAllocator.hpp"
+#include "BoundingBox.hpp"
+#include "PrimitiveBatch.hpp"
+#include "RayPacket.hpp"
+#include "Shape.hpp"
+#include "Vector3.hpp"
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+class BVH {
+public:
+    struct Node {
+        BoundingBox bounds;
+        //- Interior nodes: index of the left child, the right child follows it.
+        //- Leaves: index of the first shape in the primitive list.
+        unsigned firstIndex;
+        //- 0 for interior nodes -//
+        unsigned primitiveCount;
+    };
+
+    BVH();
+    bool intersect(const Ray &ray, Shape::Intersection &closestIntersection, const Shape *&closestShape) const;
+    bool occluded(const Ray &ray, Real maxTime, const Shape *&occluder) const;
+    void intersectPacket(RayPacket &packet) const;
+    bool isEmpty() const;
+    //- Chooses the intersection kernels, the best the CPU supports by default -//
+    void setSimdLevel(SimdLevel level);
+private:
+    friend class BVHBuilder;
+
+    //- Where the packed shapes of a leaf are. A leaf's primitives are its
+    //- spheres, then from firstTriangle its triangles, then from firstOther the rest.
+    struct LeafBatches {
+        unsigned firstSphereBatch;
+        unsigned firstTriangleBatch;
+        unsigned firstTriangle;
+        unsigned firstOther;
+    };
+
+    //- Bookkeeping for refitting, kept apart from the nodes so traversal stays compact -//
+    struct RefitInfo {
+        unsigned parent;
+        unsigned depth;
+        //- The range of primitives under the node -//
+        unsigned begin;
+        unsigned end;
+        //- Surface area when the node was built, to measure how far refits degrade it -//
+        Real builtArea;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Shape*> primitives;
+
+    //- Filled in the first time the tree is refitted -//
+    std::vector<RefitInfo> refitInfo;
+    std::vector<unsigned> primitiveLeaves;
+    std::unordered_map<const Shape*, unsigned> primitiveIndices;
+    //- Nodes orphaned by subtree rebuilds -//
+    unsigned unusedNodes;
+
+    //- Indexed by node, only filled in for leaves -//
+    std::vector<LeafBatches> leafBatches;
+    std::vector<SphereBatch, CacheAlignedAllocator<SphereBatch> > sphereBatches;
+    std::vector<TriangleBatch, CacheAlignedAllocator<TriangleBatch> > triangleBatches;
+    BatchKernels kernels;
+
+    bool intersectLeaf(unsigned nodeIndex, const Ray &ray, const BatchRay &batchRay,
+                       Real &closestTime, const Shape *&closestShape, unsigned &closestPrimitive) const;
+    bool occludedLeaf(unsigned nodeIndex, const Ray &ray, const BatchRay &batchRay,
+                      Real maxTime, const Shape *&occluder) const;
+    void packLeaves(unsigned nodeIndex);
+    void repackLeaf(unsigned nodeIndex);
+
+    static unsigned batchCount(unsigned numberOfShapes);
+    static Vector3 inverse(const Vector3 &direction);
+};
+
+//- Traversal stacks hold at most one entry per level plus one -//
+const unsigned BVH_MAX_DEPTH = 62;
+const unsigned BVH_STACK_SIZE = BVH_MAX_DEPTH + 2;
+
+BVH::BVH() {
+    unusedNodes = 0;
+    kernels = getBatchKernels(detectSimdLevel());
+}
+
+/* Finds the closest shape hit by ray. Returns false if nothing is hit */
+bool BVH::intersect(const Ray &ray, Shape::Intersection &closestIntersection, const Shape *&closestShape) const {
+    if (nodes.empty())
+        return false;
+
+    Vector3 inverseDirection = inverse(ray.direction);
+    BatchRay batchRay(ray);
+    Real closestTime = INFINITY;
+    unsigned closestPrimitive = 0;
+    bool hit = false;
+
+    unsigned stack[BVH_STACK_SIZE];
+    unsigned stackSize = 0;
+    Real entryTime;
+    if (nodes[0].bounds.intersect(ray, inverseDirection, closestTime, entryTime))
+        stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        unsigned nodeIndex = stack[--stackSize];
+        const Node &node = nodes[nodeIndex];
+
+        if (node.primitiveCount > 0) {
+            if (intersectLeaf(nodeIndex, ray, batchRay, closestTime, closestShape, closestPrimitive))
+                hit = true;
+            continue;
+        }
+
+        //- Push the farther child first so the nearer one is visited first -//
+        Real leftTime, rightTime;
+        bool hitLeft = nodes[node.firstIndex].bounds.intersect(ray, inverseDirection, closestTime, leftTime);
+        bool hitRight = nodes[node.firstIndex + 1].bounds.intersect(ray, inverseDirection, closestTime, rightTime);
+        if (hitLeft && hitRight) {
+            if (leftTime < rightTime) {
+                stack[stackSize++] = node.firstIndex + 1;
+                stack[stackSize++] = node.firstIndex;
+            } else {
+                stack[stackSize++] = node.firstIndex;
+                stack[stackSize++] = node.firstIndex + 1;
+            }
+        } else if (hitLeft) {
+            stack[stackSize++] = node.firstIndex;
+        } else if (hitRight) {
+            stack[stackSize++] = node.firstIndex + 1;
+        }
+    }
+
+    if (hit) {
+        closestIntersection.time = closestTime;
+        closestIntersection.intersection = closestTime * ray.direction + ray.position;
+        closestIntersection.hit = true;
+        closestIntersection.primitive = closestPrimitive;
+    }
+    return hit;
+}
+
+/* Returns true as soon as any shape is hit before maxTime, setting occluder to it */
+bool BVH::occluded(const Ray &ray, Real maxTime, const Shape *&occluder) const {
+    if (nodes.empty())
+        return false;
+
+    Vector3 inverseDirection = inverse(ray.direction);
+    BatchRay batchRay(ray);
+
+    unsigned stack[BVH_STACK_SIZE];
+    unsigned stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        unsigned nodeIndex = stack[--stackSize];
+        const Node &node = nodes[nodeIndex];
+        Real entryTime;
+        if (!node.bounds.intersect(ray, inverseDirection, maxTime, entryTime))
+            continue;
+
+        if (node.primitiveCount > 0) {
+            if (occludedLeaf(nodeIndex, ray, batchRay, maxTime, occluder))
+                return true;
+            continue;
+        }
+
+        stack[stackSize++] = node.firstIndex + 1;
+        stack[stackSize++] = node.firstIndex;
+    }
+
+    return false;
+}
+
+/* Finds the closest shape hit by every ray of a prepared packet, filling in
+ * packet.closestTimes, packet.closestShapes and packet.closestPrimitives. Nodes outside the packet's
+ * frustum are skipped whole. Otherwise the rays are tested in order from the
+ * first one that hits the node, and rays before it are not looked at again
+ * anywhere below the node.
+ */
+void BVH::intersectPacket(RayPacket &packet) const {
+    if (nodes.empty() || packet.numberOfRays == 0)
+        return;
+
+    struct StackEntry {
+        unsigned nodeIndex;
+        unsigned firstRay;
+    };
+
+    StackEntry stack[BVH_STACK_SIZE];
+    unsigned stackSize = 0;
+    stack[stackSize].nodeIndex = 0;
+    stack[stackSize].firstRay = 0;
+    stackSize++;
+
+    while (stackSize > 0) {
+        StackEntry entry = stack[--stackSize];
+        const Node &node = nodes[entry.nodeIndex];
+        if (packet.frustumMisses(node.bounds))
+            continue;
+
+        //- Skip ahead to the first ray that hits the node before its closest hit so far -//
+        unsigned firstRay = entry.firstRay;
+        Real entryTime;
+        while (firstRay < packet.numberOfRays
+               && !node.bounds.intersect(packet.rays[firstRay], packet.inverseDirections[firstRay],
+                                         packet.closestTimes[firstRay], entryTime)) {
+            firstRay++;
+        }
+        if (firstRay == packet.numberOfRays)
+            continue;
+
+        if (node.primitiveCount > 0) {
+            for (unsigned i = firstRay; i < packet.numberOfRays; i++) {
+                if (i == firstRay || node.bounds.intersect(packet.rays[i], packet.inverseDirections[i],
+                                                           packet.closestTimes[i], entryTime)) {
+                    intersectLeaf(entry.nodeIndex, packet.rays[i], packet.batchRays[i],
+                                  packet.closestTimes[i], packet.closestShapes[i], packet.closestPrimitives[i]);
+                }
+            }
+            continue;
+        }
+
+        //- Visit first the child the first active ray enters first -//
+        const Ray &ray = packet.rays[firstRay];
+        Real leftTime, rightTime;
+        bool hitLeft = nodes[node.firstIndex].bounds.intersect(ray, packet.inverseDirections[firstRay],
+                                                               packet.closestTimes[firstRay], leftTime);
+        bool hitRight = nodes[node.firstIndex + 1].bounds.intersect(ray, packet.inverseDirections[firstRay],
+                                                                    packet.closestTimes[firstRay], rightTime);
+        unsigned nearChild = node.firstIndex;
+        if (hitRight && (!hitLeft || rightTime < leftTime))
+            nearChild = node.firstIndex + 1;
+
+        stack[stackSize].nodeIndex = nearChild == node.firstIndex ? node.firstIndex + 1 : node.firstIndex;
+        stack[stackSize].firstRay = firstRay;
+        stackSize++;
+        stack[stackSize].nodeIndex = nearChild;
+        stack[stackSize].firstRay = firstRay;
+        stackSize++;
+    }
+}
+
+bool BVH::isEmpty() const {
+    return nodes.empty();
+}
+
+void BVH::setSimdLevel(SimdLevel level) {
+    kernels = getBatchKernels(level);
+}
+
+/* Tests every shape of a leaf, updating closestTime, closestShape and
+ * closestPrimitive if one is hit before closestTime.
+ */
+bool BVH::intersectLeaf(unsigned nodeIndex, const Ray &ray, const BatchRay &batchRay,
+                        Real &closestTime, const Shape *&closestShape, unsigned &closestPrimitive) const {
+    const Node &node = nodes[nodeIndex];
+    const LeafBatches &leaf = leafBatches[nodeIndex];
+    bool hit = false;
+
+    const SphereBatch *spheres = sphereBatches.data() + leaf.firstSphereBatch;
+    int sphere = kernels.intersectSpheres(batchRay, spheres, batchCount(leaf.firstTriangle - node.firstIndex), closestTime);
+    if (sphere >= 0) {
+        closestShape = spheres[sphere / BATCH_WIDTH].shapes[sphere % BATCH_WIDTH];
+        closestPrimitive = 0;
+        hit = true;
+    }
+
+    const TriangleBatch *triangles = triangleBatches.data() + leaf.firstTriangleBatch;
+    int triangle = kernels.intersectTriangles(batchRay, triangles, batchCount(leaf.firstOther - leaf.firstTriangle), closestTime);
+    if (triangle >= 0) {
+        closestShape = triangles[triangle / BATCH_WIDTH].shapes[triangle % BATCH_WIDTH];
+        closestPrimitive = 0;
+        hit = true;
+    }
+
+    //- Only shapes without a built in type tag are left, they need the virtual call -//
+    for (unsigned i = leaf.firstOther; i < node.firstIndex + node.primitiveCount; i++) {
+        Shape::Intersection intersection = primitives[i]->intersect(ray);
+        if (intersection.hit && intersection.time < closestTime) {
+            closestTime = intersection.time;
+            closestShape = primitives[i];
+            closestPrimitive = intersection.primitive;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+/* Like intersectLeaf, but stops at the first batch with a hit before maxTime */
+bool BVH::occludedLeaf(unsigned nodeIndex, const Ray &ray, const BatchRay &batchRay,
+                       Real maxTime, const Shape *&occluder) const {
+    const Node &node = nodes[nodeIndex];
+    const LeafBatches &leaf = leafBatches[nodeIndex];
+
+    const SphereBatch *spheres = sphereBatches.data() + leaf.firstSphereBatch;
+    unsigned numberOfSphereBatches = batchCount(leaf.firstTriangle - node.firstIndex);
+    for (unsigned i = 0; i < numberOfSphereBatches; i++) {
+        Real time = maxTime;
+        int lane = kernels.intersectSpheres(batchRay, spheres + i, 1, time);
+        if (lane >= 0) {
+            occluder = spheres[i].shapes[lane];
+            return true;
+        }
+    }
+
+    const TriangleBatch *triangles = triangleBatches.data() + leaf.firstTriangleBatch;
+    unsigned numberOfTriangleBatches = batchCount(leaf.firstOther - leaf.firstTriangle);
+    for (unsigned i = 0; i < numberOfTriangleBatches; i++) {
+        Real time = maxTime;
+        int lane = kernels.intersectTriangles(batchRay, triangles + i, 1, time);
+        if (lane >= 0) {
+            occluder = triangles[i].shapes[lane];
+            return true;
+        }
+    }
+
+    for (unsigned i = leaf.firstOther; i < node.firstIndex + node.primitiveCount; i++) {
+        if (primitives[i]->occluded(ray, maxTime)) {
+            occluder = primitives[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Packs the leaves under nodeIndex into new batches */
+void BVH::packLeaves(unsigned nodeIndex) {
+    const Node &node = nodes[nodeIndex];
+    if (node.primitiveCount == 0) {
+        packLeaves(node.firstIndex);
+        packLeaves(node.firstIndex + 1);
+        return;
+    }
+
+    std::vector<Shape*>::iterator begin = primitives.begin() + node.firstIndex;
+    std::vector<Shape*>::iterator end = begin + node.primitiveCount;
+    std::vector<Shape*>::iterator firstTriangle = std::stable_partition(begin, end, [](const Shape *shape) {
+        return shape->getType() == SHAPE_SPHERE;
+    });
+    std::vector<Shape*>::iterator firstOther = std::stable_partition(firstTriangle, end, [](const Shape *shape) {
+        return shape->getType() == SHAPE_TRIANGLE;
+    });
+
+    LeafBatches &leaf = leafBatches[nodeIndex];
+    leaf.firstSphereBatch = sphereBatches.size();
+    leaf.firstTriangleBatch = triangleBatches.size();
+    leaf.firstTriangle = firstTriangle - primitives.begin();
+    leaf.firstOther = firstOther - primitives.begin();
+
+    sphereBatches.resize(sphereBatches.size() + batchCount(firstTriangle - begin));
+    triangleBatches.resize(triangleBatches.size() + batchCount(firstOther - firstTriangle));
+    repackLeaf(nodeIndex);
+}
+
+/* Copies the current geometry of a packed leaf's shapes into its batches */
+void BVH::repackLeaf(unsigned nodeIndex) {
+    const LeafBatches &leaf = leafBatches[nodeIndex];
+    unsigned firstSphere = nodes[nodeIndex].firstIndex;
+
+    for (unsigned i = firstSphere; i < leaf.firstTriangle; i += BATCH_WIDTH) {
+        SphereBatch &batch = sphereBatches[leaf.firstSphereBatch + (i - firstSphere) / BATCH_WIDTH];
+        unsigned lanes = std::min(BATCH_WIDTH, leaf.firstTriangle - i);
+        for (unsigned lane = 0; lane < lanes; lane++)
+            packSphere(batch, lane, *static_cast<const Sphere*>(primitives[i + lane]));
+        padSphereBatch(batch, lanes);
+    }
+
+    for (unsigned i = leaf.firstTriangle; i < leaf.firstOther; i += BATCH_WIDTH) {
+        TriangleBatch &batch = triangleBatches[leaf.firstTriangleBatch + (i - leaf.firstTriangle) / BATCH_WIDTH];
+        unsigned lanes = std::min(BATCH_WIDTH, leaf.firstOther - i);
+        for (unsigned lane = 0; lane < lanes; lane++)
+            packTriangle(batch, lane, *static_cast<const Triangle*>(primitives[i + lane]));
+        padTriangleBatch(batch, lanes);
+    }
+}
+
+unsigned BVH::batchCount(unsigned numberOfShapes) {
+    return (numberOfShapes + BATCH_WIDTH - 1) / BATCH_WIDTH;
+}
+
+Vector3 BVH::inverse(const Vector3 &direction) {
+    Vector3 inverseDirection(1 / direction[0], 1 / direction[1], 1 / direction[2]);
+    return inverseDirection;
+}
+
+#endif
@@ -0,0 +1,574 @@
+/* Builds a BVH with the binned surface area heuristic (SAH), in parallel.
+ * At every node the shapes' centroids are dropped into a fixed number of
+ * bins along each axis, and the split between two bins with the lowest
+ * expected intersection cost is taken. Binning costs one pass over the
+ * shapes instead of the sort that an exact sweep needs. The binning and
+ * the search for a split are in BinnedSAH, which TriangleMesh uses too.
+ *
+ * Work is spread over a ThreadPool in two ways. Near the root, where
+ * there are few nodes but each covers many shapes, binning and
+ * partitioning are split into chunks that are processed in parallel.
+ * Further down every large enough subtree becomes a task of its own.
+ *
+ * Two modes trade build time against tree quality:
+ * -FAST_BUILD uses few bins and stops splitting as soon as a node is
+ *  small enough to be a leaf.
+ * -HIGH_QUALITY_BUILD uses more bins, sweeps the exact SAH for small
+ *  nodes and only makes a leaf when that is cheaper than splitting.
+ *
+ * When a few shapes move, refit updates the bounds of the leaves holding
+ * them and of their ancestors instead of building a new tree. Moving
+ * shapes can leave nodes much larger than a fresh build would make them,
+ * so any node whose surface area has grown past refitThreshold times its
+ * built area has its subtree rebuilt.
+ */
+#ifndef BVHBUILDER_HPP
+#define BVHBUILDER_HPP
+
+#include "BinnedSAH.hpp"
+#include "BoundingBox.hpp"
+#include "BVH.hpp"
+#include "Shape.hpp"
+#include "ThreadPool.hpp"
+#include "Vector3.hpp"
+#include <algorithm>
+#include <atomic>
+#include <unordered_map>
+#include <vector>
+
+class BVHBuilder {
+public:
+    enum BuildMode {
+        FAST_BUILD,
+        HIGH_QUALITY_BUILD
+    };
+
+    BVHBuilder();
+    void build(BVH &bvh, Shape **shapes, unsigned numberOfShapes);
+    void refit(BVH &bvh, Shape *const *changedShapes, unsigned numberOfChangedShapes);
+
+    BuildMode mode;
+    unsigned maxLeafSize;
+    //- 0 uses every hardware thread -//
+    unsigned numberOfThreads;
+    double refitThreshold;
+private:
+    struct BuildPrimitive {
+        BoundingBox bounds;
+        Vector3 centroid;
+        Shape *shape;
+    };
+
+    typedef BinnedSAH<BoundingBox, double> SAH;
+    typedef SAH::Bin Bin;
+    typedef SAH::Split Split;
+
+    //- State of the build in progress -//
+    BVH *bvh;
+    ThreadPool *pool;
+    ThreadPool::TaskGroup *subtreeTasks;
+    std::vector<BuildPrimitive> buildPrimitives;
+    std::vector<BuildPrimitive> scratch;
+    std::atomic<unsigned> nodeCount;
+
+    void buildTree(BVH &bvh, Shape **shapes, unsigned numberOfShapes, unsigned rootDepth);
+    void buildNode(unsigned nodeIndex, unsigned begin, unsigned end,
+                   const BoundingBox &bounds, const BoundingBox &centroidBounds, unsigned depth);
+    unsigned numberOfBins() const;
+    bool findBinnedSplit(unsigned begin, unsigned end, const BoundingBox &bounds,
+                         const BoundingBox &centroidBounds, Split &split);
+    bool findSweepSplit(unsigned begin, unsigned end, const BoundingBox &bounds, Split &split);
+    unsigned partition(unsigned begin, unsigned end, const BoundingBox &centroidBounds, const Split &split);
+    void boundRange(unsigned begin, unsigned end, BoundingBox &bounds, BoundingBox &centroidBounds) const;
+    template <typename Function>
+    void parallelChunks(unsigned begin, unsigned end, const Function &function);
+
+    void rebuildSubtree(BVH &bvh, unsigned nodeIndex);
+    void describeSubtree(BVH &bvh, unsigned nodeIndex, unsigned parent, unsigned depth);
+    unsigned countNodes(const BVH &bvh, unsigned nodeIndex) const;
+
+    static bool sameBounds(const BoundingBox &a, const BoundingBox &b);
+};
+
+//- Relative cost of visiting a node, an intersection test costs 1 -//
+const double BVH_TRAVERSAL_COST = 1;
+
+const unsigned BVH_FAST_BINS = 8;
+const unsigned BVH_HIGH_QUALITY_BINS = SAH_MAX_BINS;
+
+//- High quality builds sweep the exact SAH for nodes with at most this many shapes -//
+const unsigned BVH_SWEEP_THRESHOLD = 64;
+
+//- Subtrees with at least this many shapes are built as separate tasks -//
+const unsigned BVH_SUBTREE_TASK_THRESHOLD = 4096;
+
+//- Nodes with at least this many shapes are binned and partitioned in parallel chunks -//
+const unsigned BVH_PARALLEL_THRESHOLD = 65536;
+const unsigned BVH_CHUNK_SIZE = 16384;
+
+BVHBuilder::BVHBuilder() {
+    mode = HIGH_QUALITY_BUILD;
+    maxLeafSize = 4;
+    numberOfThreads = 0;
+    refitThreshold = 2;
+}
+
+void BVHBuilder::build(BVH &bvh, Shape **shapes, unsigned numberOfShapes) {
+    bvh.refitInfo.clear();
+    bvh.primitiveLeaves.clear();
+    bvh.primitiveIndices.clear();
+    bvh.unusedNodes = 0;
+    buildTree(bvh, shapes, numberOfShapes, 0);
+
+    bvh.leafBatches.assign(bvh.nodes.size(), BVH::LeafBatches());
+    bvh.sphereBatches.clear();
+    bvh.triangleBatches.clear();
+    if (!bvh.nodes.empty())
+        bvh.packLeaves(0);
+}
+
+/* Brings the tree up to date after changedShapes have moved. Shapes that
+ * are not in the tree are ignored.
+ */
+void BVHBuilder::refit(BVH &bvh, Shape *const *changedShapes, unsigned numberOfChangedShapes) {
+    if (bvh.nodes.empty() || numberOfChangedShapes == 0)
+        return;
+
+    if (bvh.refitInfo.empty()) {
+        bvh.refitInfo.resize(bvh.nodes.size());
+        bvh.primitiveLeaves.resize(bvh.primitives.size());
+        describeSubtree(bvh, 0, 0, 0);
+    }
+
+    std::vector<unsigned> degradedNodes;
+    for (unsigned i = 0; i < numberOfChangedShapes; i++) {
+        std::unordered_map<const Shape*, unsigned>::const_iterator found = bvh.primitiveIndices.find(changedShapes[i]);
+        if (found == bvh.primitiveIndices.end())
+            continue;
+
+        //- Refit the leaf, then walk up until a node's bounds stop changing -//
+        unsigned nodeIndex = bvh.primitiveLeaves[found->second];
+        BVH::Node &leaf = bvh.nodes[nodeIndex];
+        leaf.bounds = BoundingBox();
+        for (unsigned j = leaf.firstIndex; j < leaf.firstIndex + leaf.primitiveCount; j++)
+            leaf.bounds.expand(bvh.primitives[j]->getBounds());
+        bvh.repackLeaf(nodeIndex);
+
+        //- Remember the highest node that has grown too much -//
+        int degraded = -1;
+        while (true) {
+            if (bvh.nodes[nodeIndex].bounds.surfaceArea() > refitThreshold * bvh.refitInfo[nodeIndex].builtArea)
+                degraded = nodeIndex;
+            if (nodeIndex == 0)
+                break;
+
+            unsigned parentIndex = bvh.refitInfo[nodeIndex].parent;
+            BVH::Node &parent = bvh.nodes[parentIndex];
+            BoundingBox bounds = bvh.nodes[parent.firstIndex].bounds;
+            bounds.expand(bvh.nodes[parent.firstIndex + 1].bounds);
+            if (sameBounds(bounds, parent.bounds))
+                break;
+
+            parent.bounds = bounds;
+            nodeIndex = parentIndex;
+        }
+
+        if (degraded >= 0)
+            degradedNodes.push_back(degraded);
+    }
+
+    //- Rebuild every degraded subtree that is not inside another one being rebuilt.
+    //- If that would be most of the tree, a full build is cheaper and leaves it compact.
+    std::sort(degradedNodes.begin(), degradedNodes.end());
+    degradedNodes.erase(std::unique(degradedNodes.begin(), degradedNodes.end()), degradedNodes.end());
+    std::vector<unsigned> rebuildRoots;
+    unsigned shapesToRebuild = 0;
+    for (unsigned i = 0; i < degradedNodes.size(); i++) {
+        bool insideAnother = false;
+        for (unsigned ancestor = degradedNodes[i]; ancestor != 0 && !insideAnother; ) {
+            ancestor = bvh.refitInfo[ancestor].parent;
+            insideAnother = std::binary_search(degradedNodes.begin(), degradedNodes.end(), ancestor);
+        }
+
+        if (!insideAnother) {
+            rebuildRoots.push_back(degradedNodes[i]);
+            shapesToRebuild += bvh.refitInfo[degradedNodes[i]].end - bvh.refitInfo[degradedNodes[i]].begin;
+        }
+    }
+
+    if (shapesToRebuild <= bvh.primitives.size() / 2) {
+        for (unsigned i = 0; i < rebuildRoots.size(); i++)
+            rebuildSubtree(bvh, rebuildRoots[i]);
+    }
+
+    //- Once most of the node array is orphaned, start over with a compact tree -//
+    if (shapesToRebuild > bvh.primitives.size() / 2 || bvh.unusedNodes > bvh.nodes.size() / 2) {
+        std::vector<Shape*> shapes = bvh.primitives;
+        build(bvh, shapes.data(), shapes.size());
+    }
+}
+
+void BVHBuilder::buildTree(BVH &bvh, Shape **shapes, unsigned numberOfShapes, unsigned rootDepth) {
+    bvh.nodes.clear();
+    bvh.primitives.clear();
+    if (numberOfShapes == 0)
+        return;
+
+    //- Small scenes are not worth starting threads for -//
+    ThreadPool *threadPool = NULL;
+    if (numberOfShapes >= BVH_SUBTREE_TASK_THRESHOLD)
+        threadPool = new ThreadPool(numberOfThreads);
+
+    this->bvh = &bvh;
+    pool = threadPool;
+    buildPrimitives.resize(numberOfShapes);
+    scratch.resize(numberOfShapes >= BVH_PARALLEL_THRESHOLD ? numberOfShapes : 0);
+
+    //- Gather the bounds of every shape, and the bounds of the root -//
+    std::vector<BoundingBox> chunkBounds((numberOfShapes + BVH_CHUNK_SIZE - 1) / BVH_CHUNK_SIZE);
+    std::vector<BoundingBox> chunkCentroidBounds(chunkBounds.size());
+    parallelChunks(0, numberOfShapes, [&](unsigned chunk, unsigned chunkBegin, unsigned chunkEnd) {
+        for (unsigned i = chunkBegin; i < chunkEnd; i++) {
+            buildPrimitives[i].bounds = shapes[i]->getBounds();
+            buildPrimitives[i].centroid = buildPrimitives[i].bounds.centroid();
+            buildPrimitives[i].shape = shapes[i];
+            chunkBounds[chunk].expand(buildPrimitives[i].bounds);
+            chunkCentroidBounds[chunk].expand(buildPrimitives[i].centroid);
+        }
+    });
+
+    BoundingBox bounds;
+    BoundingBox centroidBounds;
+    for (unsigned i = 0; i < chunkBounds.size(); i++) {
+        bounds.expand(chunkBounds[i]);
+        centroidBounds.expand(chunkCentroidBounds[i]);
+    }
+
+    bvh.nodes.resize(2 * numberOfShapes - 1);
+    nodeCount = 1;
+
+    ThreadPool::TaskGroup tasks;
+    subtreeTasks = &tasks;
+    buildNode(0, 0, numberOfShapes, bounds, centroidBounds, rootDepth);
+    if (pool != NULL)
+        pool->wait(tasks);
+
+    bvh.nodes.resize(nodeCount);
+    bvh.primitives.resize(numberOfShapes);
+    for (unsigned i = 0; i < numberOfShapes; i++)
+        bvh.primitives[i] = buildPrimitives[i].shape;
+
+    std::vector<BuildPrimitive>().swap(buildPrimitives);
+    std::vector<BuildPrimitive>().swap(scratch);
+    delete threadPool;
+    pool = NULL;
+}
+
+/* Builds the subtree rooted at nodeIndex over buildPrimitives[begin, end),
+ * reordering that range so every leaf refers to a contiguous run of it.
+ * bounds and centroidBounds are the bounds of the shapes in the range and
+ * of their centroids.
+ */
+void BVHBuilder::buildNode(unsigned nodeIndex, unsigned begin, unsigned end,
+                           const BoundingBox &bounds, const BoundingBox &centroidBounds, unsigned depth) {
+    BVH::Node &node = bvh->nodes[nodeIndex];
+    node.bounds = bounds;
+    node.firstIndex = begin;
+    node.primitiveCount = end - begin;
+
+    unsigned count = end - begin;
+    if (count <= 1 || depth == BVH_MAX_DEPTH)
+        return;
+    if (mode == FAST_BUILD && count <= maxLeafSize)
+        return;
+
+    Split split;
+    bool sweep = mode == HIGH_QUALITY_BUILD && count <= BVH_SWEEP_THRESHOLD;
+    bool found = sweep ? findSweepSplit(begin, end, bounds, split)
+                       : findBinnedSplit(begin, end, bounds, centroidBounds, split);
+
+    double leafCost = count;
+    if (found && count <= maxLeafSize && split.cost >= leafCost)
+        return;
+
+    //- A sweep leaves the range sorted, so it is already partitioned -//
+    unsigned middle = begin;
+    if (found)
+        middle = sweep ? begin + split.position : partition(begin, end, centroidBounds, split);
+
+    //- Every centroid is in the same place, so any split is as good as another -//
+    if (!found || middle == begin || middle == end) {
+        if (count <= maxLeafSize)
+            return;
+
+        middle = begin + count / 2;
+        boundRange(begin, middle, split.leftBounds, split.leftCentroidBounds);
+        boundRange(middle, end, split.rightBounds, split.rightCentroidBounds);
+    }
+
+    unsigned leftIndex = nodeCount.fetch_add(2);
+    node.firstIndex = leftIndex;
+    node.primitiveCount = 0;
+
+    //- The right subtree becomes a task if it is big enough, the left one is built here -//
+    if (pool != NULL && end - middle >= BVH_SUBTREE_TASK_THRESHOLD) {
+        BoundingBox rightBounds = split.rightBounds;
+        BoundingBox rightCentroidBounds = split.rightCentroidBounds;
+        pool->submit(*subtreeTasks, [this, leftIndex, middle, end, rightBounds, rightCentroidBounds, depth] {
+            buildNode(leftIndex + 1, middle, end, rightBounds, rightCentroidBounds, depth + 1);
+        });
+    } else {
+        buildNode(leftIndex + 1, middle, end, split.rightBounds, split.rightCentroidBounds, depth + 1);
+    }
+    buildNode(leftIndex, begin, middle, split.leftBounds, split.leftCentroidBounds, depth + 1);
+}
+
+unsigned BVHBuilder::numberOfBins() const {
+    return mode == FAST_BUILD ? BVH_FAST_BINS : BVH_HIGH_QUALITY_BINS;
+}
+
+/* Bins the centroids along every axis and evaluates the SAH at every
+ * boundary between two bins. Returns false if the centroids do not
+ * spread along any axis.
+ */
+bool BVHBuilder::findBinnedSplit(unsigned begin, unsigned end, const BoundingBox &bounds,
+                                 const BoundingBox &centroidBounds, Split &split) {
+    unsigned bins = numberOfBins();
+    SAH sah(centroidBounds, bins);
+    Bin binned[3 * BVH_HIGH_QUALITY_BINS];
+
+    if (pool != NULL && end - begin >= BVH_PARALLEL_THRESHOLD) {
+        unsigned chunks = (end - begin + BVH_CHUNK_SIZE - 1) / BVH_CHUNK_SIZE;
+        std::vector<Bin> chunkBins(chunks * 3 * bins);
+        parallelChunks(begin, end, [&](unsigned chunk, unsigned chunkBegin, unsigned chunkEnd) {
+            sah.addToBins(&buildPrimitives[chunkBegin], chunkEnd - chunkBegin, &chunkBins[chunk * 3 * bins]);
+        });
+
+        for (unsigned chunk = 0; chunk < chunks; chunk++) {
+            for (unsigned i = 0; i < 3 * bins; i++) {
+                const Bin &local = chunkBins[chunk * 3 * bins + i];
+                binned[i].bounds.expand(local.bounds);
+                binned[i].centroidBounds.expand(local.centroidBounds);
+                binned[i].count += local.count;
+            }
+        }
+    } else {
+        sah.addToBins(&buildPrimitives[begin], end - begin, binned);
+    }
+
+    return sah.findSplit(binned, end - begin, bounds, BVH_TRAVERSAL_COST, INFINITY, split);
+}
+
+/* Sorts the range along every axis and evaluates the SAH between every
+ * pair of neighbouring shapes. The range is left sorted along the axis
+ * of the best split, and split.position is the number of shapes left of it.
+ */
+bool BVHBuilder::findSweepSplit(unsigned begin, unsigned end, const BoundingBox &bounds, Split &split) {
+    unsigned count = end - begin;
+    double area = bounds.surfaceArea();
+    double rightCosts[BVH_SWEEP_THRESHOLD];
+    split.axis = -1;
+    split.cost = INFINITY;
+
+    for (int axis = 0; axis < 3; axis++) {
+        std::sort(buildPrimitives.begin() + begin, buildPrimitives.begin() + end,
+                  [axis](const BuildPrimitive &a, const BuildPrimitive &b) {
+                      return a.centroid[axis] < b.centroid[axis];
+                  });
+
+        BoundingBox rightBounds;
+        for (unsigned i = count - 1; i > 0; i--) {
+            rightBounds.expand(buildPrimitives[begin + i].bounds);
+            rightCosts[i] = rightBounds.surfaceArea() * (count - i);
+        }
+
+        BoundingBox leftBounds;
+        for (unsigned i = 1; i < count; i++) {
+            leftBounds.expand(buildPrimitives[begin + i - 1].bounds);
+            double cost = BVH_TRAVERSAL_COST + (leftBounds.surfaceArea() * i + rightCosts[i]) / area;
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.position = i;
+            }
+        }
+    }
+
+    //- Every shape is a single point in the same place -//
+    if (split.axis < 0)
+        return false;
+
+    //- The last sweep left the range sorted on z, re-sort if another axis won -//
+    if (split.axis != 2) {
+        int axis = split.axis;
+        std::sort(buildPrimitives.begin() + begin, buildPrimitives.begin() + end,
+                  [axis](const BuildPrimitive &a, const BuildPrimitive &b) {
+                      return a.centroid[axis] < b.centroid[axis];
+                  });
+    }
+
+    boundRange(begin, begin + split.position, split.leftBounds, split.leftCentroidBounds);
+    boundRange(begin + split.position, end, split.rightBounds, split.rightCentroidBounds);
+    return true;
+}
+
+/* Moves the shapes left of a binned split to the front of the range and
+ * returns the index of the first shape on the right.
+ */
+unsigned BVHBuilder::partition(unsigned begin, unsigned end, const BoundingBox &centroidBounds, const Split &split) {
+    int axis = split.axis;
+    SAH sah(centroidBounds, numberOfBins());
+    unsigned lastLeftBin = split.position;
+
+    if (pool == NULL || end - begin < BVH_PARALLEL_THRESHOLD) {
+        std::vector<BuildPrimitive>::iterator middle =
+            std::partition(buildPrimitives.begin() + begin, buildPrimitives.begin() + end,
+                           [&](const BuildPrimitive &primitive) {
+                               return sah.binIndex(primitive.centroid[axis], axis) <= lastLeftBin;
+                           });
+        return middle - buildPrimitives.begin();
+    }
+
+    //- Count each chunk's left shapes, then scatter every chunk into scratch and copy back -//
+    unsigned chunks = (end - begin + BVH_CHUNK_SIZE - 1) / BVH_CHUNK_SIZE;
+    std::vector<unsigned> leftCounts(chunks);
+    parallelChunks(begin, end, [&](unsigned chunk, unsigned chunkBegin, unsigned chunkEnd) {
+        unsigned leftCount = 0;
+        for (unsigned i = chunkBegin; i < chunkEnd; i++) {
+            if (sah.binIndex(buildPrimitives[i].centroid[axis], axis) <= lastLeftBin)
+                leftCount++;
+        }
+        leftCounts[chunk] = leftCount;
+    });
+
+    std::vector<unsigned> leftOffsets(chunks);
+    unsigned totalLeft = 0;
+    for (unsigned chunk = 0; chunk < chunks; chunk++) {
+        leftOffsets[chunk] = totalLeft;
+        totalLeft += leftCounts[chunk];
+    }
+
+    parallelChunks(begin, end, [&](unsigned chunk, unsigned chunkBegin, unsigned chunkEnd) {
+        unsigned left = begin + leftOffsets[chunk];
+        unsigned right = begin + totalLeft + (chunkBegin - begin - leftOffsets[chunk]);
+        for (unsigned i = chunkBegin; i < chunkEnd; i++) {
+            if (sah.binIndex(buildPrimitives[i].centroid[axis], axis) <= lastLeftBin)
+                scratch[left++] = buildPrimitives[i];
+            else
+                scratch[right++] = buildPrimitives[i];
+        }
+    });
+
+    parallelChunks(begin, end, [&](unsigned chunk, unsigned chunkBegin, unsigned chunkEnd) {
+        std::copy(scratch.begin() + chunkBegin, scratch.begin() + chunkEnd, buildPrimitives.begin() + chunkBegin);
+    });
+
+    return begin + totalLeft;
+}
+
+void BVHBuilder::boundRange(unsigned begin, unsigned end, BoundingBox &bounds, BoundingBox &centroidBounds) const {
+    bounds = BoundingBox();
+    centroidBounds = BoundingBox();
+    for (unsigned i = begin; i < end; i++) {
+        bounds.expand(buildPrimitives[i].bounds);
+        centroidBounds.expand(buildPrimitives[i].centroid);
+    }
+}
+
+/* Calls function(chunk, chunkBegin, chunkEnd) for every BVH_CHUNK_SIZE
+ * sized chunk of [begin, end), on the pool if there is one.
+ */
+template <typename Function>
+void BVHBuilder::parallelChunks(unsigned begin, unsigned end, const Function &function) {
+    unsigned chunks = (end - begin + BVH_CHUNK_SIZE - 1) / BVH_CHUNK_SIZE;
+    if (pool == NULL || chunks == 1) {
+        for (unsigned chunk = 0; chunk < chunks; chunk++) {
+            unsigned chunkBegin = begin + chunk * BVH_CHUNK_SIZE;
+            function(chunk, chunkBegin, std::min(chunkBegin + BVH_CHUNK_SIZE, end));
+        }
+        return;
+    }
+
+    ThreadPool::TaskGroup chunkTasks;
+    for (unsigned chunk = 0; chunk < chunks; chunk++) {
+        unsigned chunkBegin = begin + chunk * BVH_CHUNK_SIZE;
+        unsigned chunkEnd = std::min(chunkBegin + BVH_CHUNK_SIZE, end);
+        pool->submit(chunkTasks, [&function, chunk, chunkBegin, chunkEnd] {
+            function(chunk, chunkBegin, chunkEnd);
+        });
+    }
+    pool->wait(chunkTasks);
+}
+
+/* Builds a new tree for the shapes under nodeIndex. Its root replaces the
+ * node in place and the rest of its nodes are appended to the node array,
+ * leaving the old subtree's nodes unused.
+ */
+void BVHBuilder::rebuildSubtree(BVH &bvh, unsigned nodeIndex) {
+    BVH::RefitInfo info = bvh.refitInfo[nodeIndex];
+    bvh.unusedNodes += countNodes(bvh, nodeIndex) - 1;
+
+    std::vector<Shape*> shapes(bvh.primitives.begin() + info.begin, bvh.primitives.begin() + info.end);
+    BVH subtree;
+    buildTree(subtree, shapes.data(), shapes.size(), info.depth);
+
+    //- Subtree node i > 0 ends up at base + i - 1 -//
+    unsigned base = bvh.nodes.size();
+    for (unsigned i = 0; i < subtree.nodes.size(); i++) {
+        BVH::Node node = subtree.nodes[i];
+        if (node.primitiveCount > 0)
+            node.firstIndex += info.begin;
+        else
+            node.firstIndex += base - 1;
+
+        if (i == 0)
+            bvh.nodes[nodeIndex] = node;
+        else
+            bvh.nodes.push_back(node);
+    }
+
+    for (unsigned i = 0; i < subtree.primitives.size(); i++)
+        bvh.primitives[info.begin + i] = subtree.primitives[i];
+
+    bvh.leafBatches.resize(bvh.nodes.size());
+    bvh.packLeaves(nodeIndex);
+    bvh.refitInfo.resize(bvh.nodes.size());
+    describeSubtree(bvh, nodeIndex, info.parent, info.depth);
+}
+
+/* Fills in the refit bookkeeping for nodeIndex and everything under it */
+void BVHBuilder::describeSubtree(BVH &bvh, unsigned nodeIndex, unsigned parent, unsigned depth) {
+    const BVH::Node &node = bvh.nodes[nodeIndex];
+    BVH::RefitInfo &info = bvh.refitInfo[nodeIndex];
+    info.parent = parent;
+    info.depth = depth;
+    info.builtArea = node.bounds.surfaceArea();
+
+    if (node.primitiveCount > 0) {
+        info.begin = node.firstIndex;
+        info.end = node.firstIndex + node.primitiveCount;
+        for (unsigned i = info.begin; i < info.end; i++) {
+            bvh.primitiveLeaves[i] = nodeIndex;
+            bvh.primitiveIndices[bvh.primitives[i]] = i;
+        }
+        return;
+    }
+
+    describeSubtree(bvh, node.firstIndex, nodeIndex, depth + 1);
+    describeSubtree(bvh, node.firstIndex + 1, nodeIndex, depth + 1);
+    info.begin = bvh.refitInfo[node.firstIndex].begin;
+    info.end = bvh.refitInfo[node.firstIndex + 1].end;
+}
+
+unsigned BVHBuilder::countNodes(const BVH &bvh, unsigned nodeIndex) const {
+    const BVH::Node &node = bvh.nodes[nodeIndex];
+    if (node.primitiveCount > 0)
+        return 1;
+    return 1 + countNodes(bvh, node.firstIndex) + countNodes(bvh, node.firstIndex + 1);
+}
+
+bool BVHBuilder::sameBounds(const BoundingBox &a, const BoundingBox &b) {
+    return a.min == b.min && a.max == b.max;
+}
+
+#endif
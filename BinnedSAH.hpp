@@ -0,0 +1,161 @@
+/* The binned surface area heuristic (SAH) shared by BVHBuilder, which
+ * splits the scene's shapes, and TriangleMesh, which splits a mesh's
+ * triangles with float bounds. The primitives' centroids are dropped into
+ * bins spread evenly along each axis, and the boundary between two bins
+ * with the lowest expected intersection cost is the split.
+ *
+ * Bounds is BoundingBox or a type like it: min and max indexed by axis,
+ * expand by another Bounds or by a centroid, and surfaceArea. Centroids
+ * are binned in Scalar, so each builder keeps the precision of its bounds.
+ */
+#ifndef BINNEDSAH_HPP
+#define BINNEDSAH_HPP
+
+#include <math.h>
+#include <algorithm>
+
+//- The most bins per axis, as many as BVHBuilder's high quality builds use -//
+const unsigned SAH_MAX_BINS = 32;
+
+template <typename Bounds, typename Scalar>
+class BinnedSAH {
+public:
+    struct Bin {
+        Bin();
+
+        Bounds bounds;
+        Bounds centroidBounds;
+        unsigned count;
+    };
+
+    struct Split {
+        int axis;
+        //- Binned splits: the last bin on the left. BVHBuilder's sweep splits: the number of shapes on the left -//
+        unsigned position;
+        double cost;
+        Bounds leftBounds;
+        Bounds leftCentroidBounds;
+        Bounds rightBounds;
+        Bounds rightCentroidBounds;
+    };
+
+    //- Spreads binsPerAxis bins, at most SAH_MAX_BINS, over centroidBounds along every axis -//
+    BinnedSAH(const Bounds &centroidBounds, unsigned binsPerAxis);
+
+    unsigned binIndex(Scalar centroid, int axis) const;
+    //- Adds count primitives, each with bounds and centroid members, to bins, which holds binsPerAxis bins per axis -//
+    template <typename Primitive>
+    void addToBins(const Primitive *primitives, unsigned count, Bin *bins) const;
+    bool findSplit(const Bin *bins, unsigned count, const Bounds &bounds,
+                   double traversalCost, double maxCost, Split &split) const;
+
+private:
+    unsigned binsPerAxis;
+    Scalar low[3];
+    //- Bins per unit along each axis, 0 where the centroids do not spread -//
+    Scalar scale[3];
+};
+
+template <typename Bounds, typename Scalar>
+BinnedSAH<Bounds, Scalar>::Bin::Bin() {
+    count = 0;
+}
+
+template <typename Bounds, typename Scalar>
+BinnedSAH<Bounds, Scalar>::BinnedSAH(const Bounds &centroidBounds, unsigned binsPerAxis) {
+    this->binsPerAxis = binsPerAxis;
+    for (int axis = 0; axis < 3; axis++) {
+        low[axis] = centroidBounds.min[axis];
+        Scalar extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        scale[axis] = extent > 0 ? binsPerAxis / extent : 0;
+    }
+}
+
+template <typename Bounds, typename Scalar>
+unsigned BinnedSAH<Bounds, Scalar>::binIndex(Scalar centroid, int axis) const {
+    int bin = (int) ((centroid - low[axis]) * scale[axis]);
+    return std::min(std::max(bin, 0), (int) binsPerAxis - 1);
+}
+
+template <typename Bounds, typename Scalar>
+template <typename Primitive>
+void BinnedSAH<Bounds, Scalar>::addToBins(const Primitive *primitives, unsigned count, Bin *bins) const {
+    for (unsigned i = 0; i < count; i++) {
+        const Primitive &primitive = primitives[i];
+        for (int axis = 0; axis < 3; axis++) {
+            Bin &bin = bins[axis * binsPerAxis + binIndex(primitive.centroid[axis], axis)];
+            bin.bounds.expand(primitive.bounds);
+            bin.centroidBounds.expand(primitive.centroid);
+            bin.count++;
+        }
+    }
+}
+
+/* Evaluates the SAH at every boundary between two bins of the count
+ * primitives binned, whose bounds are bounds. Returns false if no split
+ * costs less than maxCost, which is also the case when the centroids do
+ * not spread along any axis.
+ */
+template <typename Bounds, typename Scalar>
+bool BinnedSAH<Bounds, Scalar>::findSplit(const Bin *bins, unsigned count, const Bounds &bounds,
+                                          double traversalCost, double maxCost, Split &split) const {
+    double area = bounds.surfaceArea();
+    split.axis = -1;
+    split.cost = maxCost;
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0)
+            continue;
+
+        const Bin *axisBins = &bins[axis * binsPerAxis];
+        double rightCosts[SAH_MAX_BINS];
+        Bounds rightBounds;
+        unsigned rightCount = 0;
+        for (unsigned i = binsPerAxis - 1; i > 0; i--) {
+            rightBounds.expand(axisBins[i].bounds);
+            rightCount += axisBins[i].count;
+            rightCosts[i] = rightBounds.surfaceArea() * rightCount;
+        }
+
+        Bounds leftBounds;
+        unsigned leftCount = 0;
+        for (unsigned i = 0; i < binsPerAxis - 1; i++) {
+            leftBounds.expand(axisBins[i].bounds);
+            leftCount += axisBins[i].count;
+            if (leftCount == 0 || leftCount == count)
+                continue;
+
+            double cost = traversalCost + (leftBounds.surfaceArea() * leftCount + rightCosts[i + 1]) / area;
+            if (cost < split.cost) {
+                split.cost = cost;
+                split.axis = axis;
+                split.position = i;
+            }
+        }
+    }
+
+    if (split.axis < 0)
+        return false;
+
+    //- The children's bounds are the union of the bins on either side -//
+    const Bin *axisBins = &bins[split.axis * binsPerAxis];
+    split.leftBounds = Bounds();
+    split.leftCentroidBounds = Bounds();
+    split.rightBounds = Bounds();
+    split.rightCentroidBounds = Bounds();
+    for (unsigned i = 0; i < binsPerAxis; i++) {
+        if (axisBins[i].count == 0)
+            continue;
+
+        if (i <= split.position) {
+            split.leftBounds.expand(axisBins[i].bounds);
+            split.leftCentroidBounds.expand(axisBins[i].centroidBounds);
+        } else {
+            split.rightBounds.expand(axisBins[i].bounds);
+            split.rightCentroidBounds.expand(axisBins[i].centroidBounds);
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,100 @@
+/* An axis aligned bounding box, used by the acceleration structures
+ * to bound shapes and groups of shapes.
+ */
+#ifndef BOUNDINGBOX_HPP
+#define BOUNDINGBOX_HPP
+
+#include "Real.hpp"
+#include "Vector3.hpp"
+
+struct BoundingBox {
+    //- Constructors -//
+    BoundingBox();
+    BoundingBox(const Vector3 &min, const Vector3 &max);
+
+    //- Methods -//
+    void expand(const Vector3 &point);
+    void expand(const BoundingBox &box);
+    bool isEmpty() const;
+    Vector3 centroid() const;
+    Real surfaceArea() const;
+    int longestAxis() const;
+    bool intersect(const Ray &ray, const Vector3 &inverseDirection, Real maxTime, Real &entryTime) const;
+
+    //- Static Methods -//
+    static BoundingBox infinite();
+
+    Vector3 min;
+    Vector3 max;
+};
+
+//- Constructors -//
+/* An empty box, expanding it by anything results in that thing's bounds */
+BoundingBox::BoundingBox() : min(REAL_MAX, REAL_MAX, REAL_MAX), max(-REAL_MAX, -REAL_MAX, -REAL_MAX) {
+}
+
+BoundingBox::BoundingBox(const Vector3 &min, const Vector3 &max) : min(min), max(max) {
+}
+
+//- Methods -//
+void BoundingBox::expand(const Vector3 &point) {
+    min(fmin(min[0], point[0]), fmin(min[1], point[1]), fmin(min[2], point[2]));
+    max(fmax(max[0], point[0]), fmax(max[1], point[1]), fmax(max[2], point[2]));
+}
+
+void BoundingBox::expand(const BoundingBox &box) {
+    expand(box.min);
+    expand(box.max);
+}
+
+bool BoundingBox::isEmpty() const {
+    return min[0] > max[0] || min[1] > max[1] || min[2] > max[2];
+}
+
+Vector3 BoundingBox::centroid() const {
+    return (min + max) * 0.5;
+}
+
+Real BoundingBox::surfaceArea() const {
+    if (isEmpty())
+        return 0;
+
+    Vector3 extent = max - min;
+    return 2 * (extent[0] * extent[1] + extent[1] * extent[2] + extent[2] * extent[0]);
+}
+
+int BoundingBox::longestAxis() const {
+    Vector3 extent = max - min;
+    if (extent[0] >= extent[1] && extent[0] >= extent[2])
+        return 0;
+    return extent[1] >= extent[2] ? 1 : 2;
+}
+
+/* Slab test. inverseDirection holds 1 / ray.direction per component.
+ * On a hit entryTime is set to where the ray enters the box, which is 0
+ * if the ray starts inside it. The exit times are pushed out by
+ * REAL_ROUNDING so rays grazing a box still enter it in float builds.
+ */
+bool BoundingBox::intersect(const Ray &ray, const Vector3 &inverseDirection, Real maxTime, Real &entryTime) const {
+    Real tMin = 0;
+    Real tMax = maxTime;
+    for (int axis = 0; axis < 3; axis++) {
+        Real t1 = (min[axis] - ray.position[axis]) * inverseDirection[axis];
+        Real t2 = (max[axis] - ray.position[axis]) * inverseDirection[axis];
+        //- fmin/fmax drop the NaN produced by 0 * inf when the ray lies on a slab -//
+        tMin = fmax(tMin, fmin(t1, t2));
+        tMax = fmin(tMax, fmax(t1, t2) * (1 + REAL_ROUNDING));
+    }
+
+    entryTime = tMin;
+    return tMin <= tMax;
+}
+
+//- Static Methods -//
+BoundingBox BoundingBox::infinite() {
+    Vector3 min(-INFINITY, -INFINITY, -INFINITY);
+    Vector3 max(INFINITY, INFINITY, INFINITY);
+    return BoundingBox(min, max);
+}
+
+#endif
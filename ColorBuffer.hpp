@@ -1,178 +1,187 @@
+/* An image of high dynamic range colors, one contiguous, cache line
+ * aligned array of float red, green, blue and alpha. Values are on the
+ * renderer's scale, where 255 is full intensity, and are not clamped, so
+ * highlights brighter than white survive until the image is written.
+ * Tone mapping and quantisation only happen in writeToFile, except for
+ * .pfm files, which keep the colors as they are.
+ *
+ * Pixels are written directly through getPixel or getRow. A pixel is 16
+ * bytes, so four of them fill a cache line; threads writing disjoint
+ * regions whose columns start on multiples of PIXELS_PER_CACHE_LINE never
+ * share a line.
+ */
 #ifndef COLORBUFFER_HPP
 #define COLORBUFFER_HPP
 
-#include <fstream>
+#include "AlignedAllocator.hpp"
+#include "ImageWriter.hpp"
+#include "ThreadPool.hpp"
+#include <assert.h>
+#include <math.h>
 #include <iostream>
-#include <sstream>
-#include <stdexcept>
+#include <vector>
 
 using namespace std;
+
+const unsigned COLOR_CHANNELS = 4;
+const unsigned PIXELS_PER_CACHE_LINE = CACHE_LINE_SIZE / (COLOR_CHANNELS * sizeof(float));
+
 class ColorBuffer {
 public:
+    //- How colors are brought into 0 to 255 when written -//
+    enum ToneMapping {
+        //- Clips at 255, matching how images looked before HDR -//
+        TONE_MAP_CLAMP,
+        //- Reinhard's c / (1 + c), which rolls highlights off smoothly -//
+        TONE_MAP_REINHARD,
+        //- Narkowicz's fit of the ACES filmic curve -//
+        TONE_MAP_ACES
+    };
+
     ColorBuffer(unsigned w, unsigned h);
-    ColorBuffer(unsigned w, unsigned h, unsigned *bgColor);
-    ~ColorBuffer();
-    void clearBuffer();
-    unsigned getHeight();
-    unsigned getWidth();
-    unsigned *getColorAt(unsigned a, unsigned b);
-    unsigned *getBackgroundColor();
-    unsigned *getStrokeColor();
-    void setBackgroundColor(unsigned r, unsigned g, unsigned b);
-    void setColorAt(unsigned a, unsigned b);
-    void setStrokeColor(unsigned r, unsigned g, unsigned b);
-    string writeToFile(string fileName, string fileExtension);
+    void clear(float r, float g, float b, float a = 1);
+    unsigned getHeight() const;
+    unsigned getWidth() const;
+    //- The pixel's red, green, blue and alpha, next to each other -//
+    float *getPixel(unsigned column, unsigned row);
+    const float *getPixel(unsigned column, unsigned row) const;
+    //- A row's pixels, next to each other -//
+    float *getRow(unsigned row);
+    const float *getRow(unsigned row) const;
+    void setColorAt(unsigned column, unsigned row, float r, float g, float b);
+    string writeToFile(string fileName, string fileExtension, ThreadPool *pool = NULL) const;
+    //- A color channel tone mapped and rounded to 0 to 255 -//
+    static unsigned char quantise(float value, ToneMapping toneMapping, float exposure);
+
+    ToneMapping toneMapping;
+    //- Multiplies colors before tone mapping -//
+    float exposure;
 private:
     unsigned width;
     unsigned height;
-    unsigned **colorBuffer;
-    unsigned *backgroundColor;
-    unsigned *strokeColor;
+    std::vector<float, CacheAlignedAllocator<float> > pixels;
+
+    //- Tone maps the image into 3 bytes per pixel, as the 8 bit formats store it -//
+    void quantiseImage(std::vector<unsigned char> &rgb) const;
 };
 
 /* w will be the width of the image created by the colorBuffer
  * h will be the height of the image created by the colorBuffer
- * The actual colorBuffer array will have width w * h and
- * height 3 (representing r g and b values respectively).
+ * Every pixel starts black and opaque.
  */
 ColorBuffer::ColorBuffer(unsigned w, unsigned h) {
     width = w;
     height = h;
-    colorBuffer = new unsigned*[width * height];
-    backgroundColor = new unsigned[3];
-    backgroundColor[0] = 0;
-    backgroundColor[1] = 0;
-    backgroundColor[2] = 0;
-
-    strokeColor = new unsigned[3];
-    strokeColor[0] = 255;
-    strokeColor[1] = 255;
-    strokeColor[2] = 255;
-
-    clearBuffer();
+    toneMapping = TONE_MAP_CLAMP;
+    exposure = 1;
+    pixels.resize((size_t) width * height * COLOR_CHANNELS);
+    clear(0, 0, 0);
 }
 
-/* bgColor will be the rgb value that the buffer will be cleared to */
-ColorBuffer::ColorBuffer(unsigned w, unsigned h, unsigned *bgColor) {
-    width = w;
-    height = h;
-    colorBuffer = new unsigned*[width * height];
-    backgroundColor = new unsigned[3];
-    backgroundColor[0] = bgColor[0];
-    backgroundColor[1] = bgColor[1];
-    backgroundColor[2] = bgColor[2];
-    clearBuffer();
-}
-
-/* cleans up the pointers used in the class */
-ColorBuffer::~ColorBuffer() {
-    for (unsigned i = 0; i < width * height; i++) {
-        delete colorBuffer[i];
-        colorBuffer[i] = NULL;
-    }
-
-    delete colorBuffer;
-    colorBuffer = NULL;
-
-    delete backgroundColor;
-    backgroundColor = NULL;
-
-    delete strokeColor;
-    strokeColor = NULL;
-}
-
-/* sets all rgb values in the color buffer to
- * the background color.
- */
-void ColorBuffer::clearBuffer() {
-    for (unsigned i = 0; i < width * height; i++) {
-        colorBuffer[i] = new unsigned[3];
-        colorBuffer[i][0] = backgroundColor[0];
-        colorBuffer[i][1] = backgroundColor[1];
-        colorBuffer[i][2] = backgroundColor[2];
+/* sets every pixel to the given color */
+void ColorBuffer::clear(float r, float g, float b, float a) {
+    for (size_t i = 0; i < pixels.size(); i += COLOR_CHANNELS) {
+        pixels[i] = r;
+        pixels[i + 1] = g;
+        pixels[i + 2] = b;
+        pixels[i + 3] = a;
     }
 }
 
 /* returns the height of the image created
  * by the colorbuffer.
  */
-unsigned ColorBuffer::getHeight() {
+unsigned ColorBuffer::getHeight() const {
     return height;
 }
 
 /* returns the width of the image created
  * by the colorBuffer.
  */
-unsigned ColorBuffer::getWidth() {
+unsigned ColorBuffer::getWidth() const {
     return width;
 }
 
-/* returns the color at a certain index */
-unsigned *ColorBuffer::getColorAt(unsigned column, unsigned row) {
-    if (column >= width || row >= height) {
-        ostringstream error;
-        error << "ColorBuffer index (" << row << ", " << column << ") is out of bounds.\n";
-        throw out_of_range(error.str());
-    }
+float *ColorBuffer::getPixel(unsigned column, unsigned row) {
+    assert(column < width && row < height);
+    return &pixels[((size_t) row * width + column) * COLOR_CHANNELS];
+}
 
-    return colorBuffer[row*width + column];
+const float *ColorBuffer::getPixel(unsigned column, unsigned row) const {
+    assert(column < width && row < height);
+    return &pixels[((size_t) row * width + column) * COLOR_CHANNELS];
 }
 
-unsigned *ColorBuffer::getBackgroundColor() {
-    return backgroundColor;
+float *ColorBuffer::getRow(unsigned row) {
+    return getPixel(0, row);
 }
 
-unsigned *ColorBuffer::getStrokeColor() {
-    return strokeColor;
+const float *ColorBuffer::getRow(unsigned row) const {
+    return getPixel(0, row);
 }
 
-/* Sets the background color */
-void ColorBuffer::setBackgroundColor(unsigned r, unsigned g, unsigned b) {
-    backgroundColor[0] = r;
-    backgroundColor[1] = g;
-    backgroundColor[2] = b;
+/* Sets the color of a pixel, leaving its alpha */
+void ColorBuffer::setColorAt(unsigned column, unsigned row, float r, float g, float b) {
+    float *pixel = getPixel(column, row);
+    pixel[0] = r;
+    pixel[1] = g;
+    pixel[2] = b;
 }
 
-/* Sets the color buffer at the given index to the stroke color */
-void ColorBuffer::setColorAt(unsigned column, unsigned row) {
-    if (column >= width || row >= height) {
-        ostringstream error;
-        error << "ColorBuffer index (" << column << ", " << row << ") is out of bounds.\n";
-        throw out_of_range(error.str());
+unsigned char ColorBuffer::quantise(float value, ToneMapping toneMapping, float exposure) {
+    float mapped = value * exposure / 255;
+    if (toneMapping == TONE_MAP_REINHARD) {
+        mapped = mapped / (1 + mapped);
+    } else if (toneMapping == TONE_MAP_ACES) {
+        mapped = (mapped * (2.51f * mapped + 0.03f)) / (mapped * (2.43f * mapped + 0.59f) + 0.14f);
     }
 
-    colorBuffer[row*width + column][0] = strokeColor[0];
-    colorBuffer[row*width + column][1] = strokeColor[1];
-    colorBuffer[row*width + column][2] = strokeColor[2];
-
+    if (!(mapped > 0))
+        return 0;
+    if (mapped >= 1)
+        return 255;
+    return (unsigned char) (mapped * 255 + 0.5f);
 }
 
-/* Sets the stroke color */
-void ColorBuffer::setStrokeColor(unsigned r, unsigned g, unsigned b) {
-    strokeColor[0] = r;
-    strokeColor[1] = g;
-    strokeColor[2] = b;
+/* Tone maps every pixel, row by row */
+void ColorBuffer::quantiseImage(std::vector<unsigned char> &rgb) const {
+    rgb.resize((size_t) width * height * 3);
+    for (size_t i = 0; i < (size_t) width * height; i++) {
+        for (int j = 0; j < 3; j++) {
+            rgb[i * 3 + j] = quantise(pixels[i * COLOR_CHANNELS + j], toneMapping, exposure);
+        }
+    }
 }
 
-/* writes the colorBuffer to an imageFile. Currently, fileExtension must
- * be ".ppm".
+/* writes the colorBuffer to an imageFile. fileExtension picks the format:
+ * ".ppm", ".pfm", ".qoi" or ".png". .pfm files hold the colors divided by
+ * 255, so 1 is white, before exposure and tone mapping. If pool is not
+ * NULL, PNGs are compressed on it in parallel. The file appears complete
+ * or not at all. Returns an empty string if the format is unknown or the
+ * file could not be written.
  */
-string ColorBuffer::writeToFile(string fileName, string fileExtension) {
-    ofstream outputFile(fileName + fileExtension);
-
-    if (!outputFile.is_open()) {
-        return NULL;
+string ColorBuffer::writeToFile(string fileName, string fileExtension, ThreadPool *pool) const {
+    string path = fileName + fileExtension;
+    ImageWriter::Format format = ImageWriter::getFormat(path);
+    std::vector<unsigned char> encoded;
+    if (format == ImageWriter::FORMAT_PFM) {
+        ImageWriter::encodePFM(pixels.data(), width, height, 1 / 255.0f, encoded);
+    } else if (format != ImageWriter::FORMAT_UNKNOWN) {
+        std::vector<unsigned char> rgb;
+        quantiseImage(rgb);
+        if (format == ImageWriter::FORMAT_PPM)
+            ImageWriter::encodePPM(rgb.data(), width, height, encoded);
+        else if (format == ImageWriter::FORMAT_QOI)
+            ImageWriter::encodeQOI(rgb.data(), width, height, encoded);
+        else
+            ImageWriter::encodePNG(rgb.data(), width, height, encoded, pool);
+    } else {
+        return "";
     }
 
-    outputFile << "P3\n";
-    outputFile << width << " " << height << " " << 255 << "\n";
-    for (int i = 0; i < width * height; i++) {
-        for (int j = 0; j < 3; j++) {
-            outputFile << colorBuffer[i][j] << " ";
-        }
+    if (!ImageWriter::writeFile(path, encoded)) {
+        return "";
     }
-    outputFile << "\n";
-    outputFile.close();
     return fileName;
 }
 
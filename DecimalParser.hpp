@@ -0,0 +1,95 @@
+/* Converts decimal numbers in place, without the terminating '\0' that
+ * strtod needs, so text files can be parsed straight from a mapping.
+ */
+#ifndef DECIMALPARSER_HPP
+#define DECIMALPARSER_HPP
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Parses the number from begin to end, which must hold nothing else.
+ * Decimal numbers whose digits fit in 53 bits and whose exponent is at
+ * most 22 are exact doubles scaled by an exact power of ten, so a single
+ * multiply or divide rounds them correctly. That covers what scene and
+ * mesh files hold; anything else goes through strtod.
+ */
+inline bool parseDecimal(const char *begin, const char *end, double &value) {
+    static const double powersOfTen[23] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    const char *c = begin;
+    bool negative = c < end && *c == '-';
+    if (c < end && (*c == '-' || *c == '+'))
+        c++;
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool anyDigits = false;
+    for (; c < end && *c >= '0' && *c <= '9'; c++) {
+        anyDigits = true;
+        if (mantissa == 0 && *c == '0')
+            continue;
+        if (digits++ < 19)
+            mantissa = mantissa * 10 + (*c - '0');
+        else
+            exponent++;
+    }
+    if (c < end && *c == '.') {
+        for (c++; c < end && *c >= '0' && *c <= '9'; c++) {
+            anyDigits = true;
+            if (mantissa == 0 && *c == '0') {
+                exponent--;
+                continue;
+            }
+            if (digits++ < 19) {
+                mantissa = mantissa * 10 + (*c - '0');
+                exponent--;
+            }
+        }
+    }
+    if (!anyDigits)
+        return false;
+
+    if (c < end && (*c == 'e' || *c == 'E')) {
+        c++;
+        bool negativeExponent = c < end && *c == '-';
+        if (c < end && (*c == '-' || *c == '+'))
+            c++;
+        if (c == end)
+            return false;
+        int written = 0;
+        for (; c < end && *c >= '0' && *c <= '9'; c++) {
+            if (written < 10000)
+                written = written * 10 + (*c - '0');
+        }
+        exponent += negativeExponent ? -written : written;
+    }
+    if (c != end)
+        return false;
+
+    double result;
+    if (mantissa == 0) {
+        result = 0;
+    } else if (digits <= 19 && mantissa < (uint64_t) 1 << 53 && exponent >= -22 && exponent <= 22) {
+        result = (double) mantissa;
+        result = exponent < 0 ? result / powersOfTen[-exponent] : result * powersOfTen[exponent];
+    } else {
+        char buffer[128];
+        size_t length = end - begin;
+        if (length >= sizeof(buffer))
+            return false;
+        memcpy(buffer, begin, length);
+        buffer[length] = '\0';
+        value = strtod(buffer, NULL);
+        return true;
+    }
+
+    value = negative ? -result : result;
+    return true;
+}
+
+#endif
@@ -0,0 +1,513 @@
+/* DEFLATE compression (RFC 1951) in zlib framing (RFC 1950), and the
+ * Adler-32 and CRC-32 checksums they and PNG need, so images can be
+ * written without external libraries.
+ *
+ * Matches are found with hash chains and one step of lazy matching, and
+ * every block gets its own dynamic Huffman codes. Input is cut into
+ * chunks that are compressed in parallel, like pigz: each chunk may still
+ * refer back into the 32 KB before it, which the decoder has already
+ * produced, and all but the last chunk end with an empty stored block so
+ * they are byte aligned and can simply be concatenated.
+ */
+#ifndef DEFLATE_HPP
+#define DEFLATE_HPP
+
+#include "ThreadPool.hpp"
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+uint32_t adler32(const unsigned char *data, size_t length, uint32_t adler = 1);
+uint32_t crc32(const unsigned char *data, size_t length, uint32_t crc = 0);
+
+class Deflate {
+public:
+    /* Appends the zlib stream of data to output. With a pool, chunks of
+     * DEFLATE_CHUNK_SIZE bytes are compressed in parallel.
+     */
+    static void zlibCompress(const unsigned char *data, size_t length, std::vector<unsigned char> &output,
+                             ThreadPool *pool = NULL);
+    /* Appends the deflate blocks of data[start, end) to output. Matches
+     * may reach back before start. The last chunk of a stream ends with
+     * the final block, every other one with an empty stored block.
+     */
+    static void compressChunk(const unsigned char *data, size_t start, size_t end, bool last,
+                              std::vector<unsigned char> &output);
+private:
+    //- A literal byte when distance is 0, otherwise a match -//
+    struct Token {
+        uint16_t value;
+        uint16_t distance;
+    };
+
+    class BitWriter {
+    public:
+        BitWriter(std::vector<unsigned char> &output);
+        void write(uint32_t bits, unsigned count);
+        void alignToByte();
+    private:
+        std::vector<unsigned char> &output;
+        uint64_t buffer;
+        unsigned bitsInBuffer;
+    };
+
+    static void findMatches(const unsigned char *data, size_t start, size_t end, std::vector<Token> &tokens);
+    static void writeBlock(const Token *tokens, size_t count, bool final, BitWriter &writer);
+    static void buildLengths(const uint32_t *frequencies, unsigned count, unsigned maxBits, uint8_t *lengths);
+    static void buildCodes(const uint8_t *lengths, unsigned count, uint16_t *codes);
+    static unsigned lengthSymbol(unsigned length);
+    static unsigned distanceSymbol(unsigned distance);
+};
+
+const unsigned DEFLATE_WINDOW_SIZE = 32768;
+const unsigned DEFLATE_MIN_MATCH = 3;
+const unsigned DEFLATE_MAX_MATCH = 258;
+//- Longest hash chain followed, trading ratio for speed -//
+const unsigned DEFLATE_MAX_CHAIN = 64;
+//- A match this long is taken without looking further -//
+const unsigned DEFLATE_GOOD_MATCH = 64;
+const unsigned DEFLATE_HASH_BITS = 15;
+const unsigned DEFLATE_TOKENS_PER_BLOCK = 65536;
+const size_t DEFLATE_CHUNK_SIZE = 256 * 1024;
+
+const uint16_t DEFLATE_LENGTH_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+const uint8_t DEFLATE_LENGTH_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+const uint16_t DEFLATE_DISTANCE_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+const uint8_t DEFLATE_DISTANCE_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+//- The order code length code lengths are stored in -//
+const uint8_t DEFLATE_CODE_LENGTH_ORDER[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+//- Checksums -//
+uint32_t adler32(const unsigned char *data, size_t length, uint32_t adler) {
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    while (length > 0) {
+        //- The most bytes that can be summed before b could overflow -//
+        size_t run = std::min(length, (size_t) 5552);
+        for (size_t i = 0; i < run; i++) {
+            a += data[i];
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+        data += run;
+        length -= run;
+    }
+    return (b << 16) | a;
+}
+
+//- The CRC-32 of every byte value, built once on first use -//
+struct Crc32Table {
+    Crc32Table() {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            entries[n] = c;
+        }
+    }
+
+    uint32_t entries[256];
+};
+
+uint32_t crc32(const unsigned char *data, size_t length, uint32_t crc) {
+    static const Crc32Table table;
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+        crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+//- Streams -//
+void Deflate::zlibCompress(const unsigned char *data, size_t length, std::vector<unsigned char> &output,
+                           ThreadPool *pool) {
+    //- 32 KB window, default compression -//
+    output.push_back(0x78);
+    output.push_back(0x9c);
+
+    size_t numberOfChunks = std::max((size_t) 1, (length + DEFLATE_CHUNK_SIZE - 1) / DEFLATE_CHUNK_SIZE);
+    std::vector<std::vector<unsigned char> > chunks(numberOfChunks);
+    if (pool != NULL && numberOfChunks > 1) {
+        ThreadPool::TaskGroup group;
+        for (size_t i = 0; i < numberOfChunks; i++) {
+            std::vector<unsigned char> *chunk = &chunks[i];
+            size_t start = i * DEFLATE_CHUNK_SIZE;
+            size_t end = std::min(length, start + DEFLATE_CHUNK_SIZE);
+            bool last = i + 1 == numberOfChunks;
+            pool->submit(group, [data, start, end, last, chunk] { compressChunk(data, start, end, last, *chunk); });
+        }
+        pool->wait(group);
+    } else {
+        for (size_t i = 0; i < numberOfChunks; i++) {
+            size_t start = i * DEFLATE_CHUNK_SIZE;
+            compressChunk(data, start, std::min(length, start + DEFLATE_CHUNK_SIZE), i + 1 == numberOfChunks, chunks[i]);
+        }
+    }
+
+    for (size_t i = 0; i < numberOfChunks; i++)
+        output.insert(output.end(), chunks[i].begin(), chunks[i].end());
+
+    uint32_t checksum = adler32(data, length);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        output.push_back((checksum >> shift) & 0xff);
+}
+
+void Deflate::compressChunk(const unsigned char *data, size_t start, size_t end, bool last,
+                            std::vector<unsigned char> &output) {
+    std::vector<Token> tokens;
+    findMatches(data, start, end, tokens);
+
+    BitWriter writer(output);
+    size_t written = 0;
+    do {
+        size_t count = std::min(tokens.size() - written, (size_t) DEFLATE_TOKENS_PER_BLOCK);
+        bool finalBlock = last && written + count == tokens.size();
+        writeBlock(tokens.data() + written, count, finalBlock, writer);
+        written += count;
+    } while (written < tokens.size());
+
+    if (!last) {
+        //- An empty stored block, which leaves the stream byte aligned -//
+        writer.write(0, 3);
+        writer.alignToByte();
+        writer.write(0x0000, 16);
+        writer.write(0xffff, 16);
+    }
+    writer.alignToByte();
+}
+
+//- Matching -//
+/* Greedy matching with one step of lazy evaluation: a match is put off by
+ * a byte if the next position has a longer one.
+ */
+void Deflate::findMatches(const unsigned char *data, size_t start, size_t end, std::vector<Token> &tokens) {
+    size_t base = start > DEFLATE_WINDOW_SIZE ? start - DEFLATE_WINDOW_SIZE : 0;
+    const unsigned hashSize = 1u << DEFLATE_HASH_BITS;
+    std::vector<int32_t> head(hashSize, -1);
+    //- Previous position with the same hash, indexed from base -//
+    std::vector<int32_t> previous(end - base, -1);
+
+    struct Matcher {
+        const unsigned char *data;
+        size_t base;
+        size_t end;
+        std::vector<int32_t> &head;
+        std::vector<int32_t> &previous;
+
+        unsigned hash(size_t position) const {
+            return ((data[position] << 10) ^ (data[position + 1] << 5) ^ data[position + 2]) & ((1u << DEFLATE_HASH_BITS) - 1);
+        }
+
+        void insert(size_t position) {
+            if (position + DEFLATE_MIN_MATCH > end)
+                return;
+            unsigned h = hash(position);
+            previous[position - base] = head[h];
+            head[h] = (int32_t) (position - base);
+        }
+
+        //- Longest match for position among earlier positions, 0 if shorter than DEFLATE_MIN_MATCH -//
+        unsigned longest(size_t position, unsigned &distance) const {
+            if (position + DEFLATE_MIN_MATCH > end)
+                return 0;
+            unsigned limit = (unsigned) std::min((size_t) DEFLATE_MAX_MATCH, end - position);
+            unsigned best = DEFLATE_MIN_MATCH - 1;
+            int32_t candidate = head[hash(position)];
+            for (unsigned chain = 0; candidate >= 0 && chain < DEFLATE_MAX_CHAIN; chain++) {
+                size_t from = base + candidate;
+                if (position - from > DEFLATE_WINDOW_SIZE)
+                    break;
+                if (from < position && data[from + best] == data[position + best]) {
+                    unsigned length = 0;
+                    while (length < limit && data[from + length] == data[position + length])
+                        length++;
+                    if (length > best) {
+                        best = length;
+                        distance = (unsigned) (position - from);
+                        if (length >= DEFLATE_GOOD_MATCH || length == limit)
+                            break;
+                    }
+                }
+                candidate = previous[candidate];
+            }
+            return best >= DEFLATE_MIN_MATCH ? best : 0;
+        }
+    } matcher = {data, base, end, head, previous};
+
+    for (size_t position = base; position < start; position++)
+        matcher.insert(position);
+
+    tokens.reserve((end - start) / 2);
+    size_t position = start;
+    while (position < end) {
+        unsigned distance = 0;
+        unsigned length = matcher.longest(position, distance);
+        matcher.insert(position);
+        if (length == 0) {
+            Token literal = {data[position], 0};
+            tokens.push_back(literal);
+            position++;
+            continue;
+        }
+
+        unsigned nextDistance = 0;
+        if (length < DEFLATE_GOOD_MATCH && matcher.longest(position + 1, nextDistance) > length) {
+            Token literal = {data[position], 0};
+            tokens.push_back(literal);
+            position++;
+            continue;
+        }
+
+        Token match = {(uint16_t) length, (uint16_t) distance};
+        tokens.push_back(match);
+        for (size_t covered = position + 1; covered < position + length; covered++)
+            matcher.insert(covered);
+        position += length;
+    }
+}
+
+//- Blocks -//
+void Deflate::writeBlock(const Token *tokens, size_t count, bool final, BitWriter &writer) {
+    uint32_t literalFrequencies[286] = {0};
+    uint32_t distanceFrequencies[30] = {0};
+    for (size_t i = 0; i < count; i++) {
+        if (tokens[i].distance == 0) {
+            literalFrequencies[tokens[i].value]++;
+        } else {
+            literalFrequencies[257 + lengthSymbol(tokens[i].value)]++;
+            distanceFrequencies[distanceSymbol(tokens[i].distance)]++;
+        }
+    }
+    literalFrequencies[256] = 1;
+
+    uint8_t literalLengths[286];
+    uint8_t distanceLengths[30];
+    buildLengths(literalFrequencies, 286, 15, literalLengths);
+    buildLengths(distanceFrequencies, 30, 15, distanceLengths);
+
+    unsigned numberOfLiteralCodes = 286;
+    while (numberOfLiteralCodes > 257 && literalLengths[numberOfLiteralCodes - 1] == 0)
+        numberOfLiteralCodes--;
+    unsigned numberOfDistanceCodes = 30;
+    while (numberOfDistanceCodes > 1 && distanceLengths[numberOfDistanceCodes - 1] == 0)
+        numberOfDistanceCodes--;
+
+    //- Run length code both tables' code lengths as one sequence -//
+    std::vector<uint8_t> lengths(literalLengths, literalLengths + numberOfLiteralCodes);
+    lengths.insert(lengths.end(), distanceLengths, distanceLengths + numberOfDistanceCodes);
+
+    std::vector<uint8_t> symbols;
+    std::vector<uint8_t> extras;
+    for (size_t i = 0; i < lengths.size();) {
+        size_t run = 1;
+        while (i + run < lengths.size() && lengths[i + run] == lengths[i])
+            run++;
+
+        if (lengths[i] == 0 && run >= 3) {
+            run = std::min(run, (size_t) 138);
+            symbols.push_back(run >= 11 ? 18 : 17);
+            extras.push_back(run >= 11 ? run - 11 : run - 3);
+        } else if (lengths[i] != 0 && run >= 4) {
+            run = std::min(run, (size_t) 7);
+            symbols.push_back(lengths[i]);
+            extras.push_back(0);
+            symbols.push_back(16);
+            extras.push_back(run - 4);
+        } else {
+            run = 1;
+            symbols.push_back(lengths[i]);
+            extras.push_back(0);
+        }
+        i += run;
+    }
+
+    uint32_t codeLengthFrequencies[19] = {0};
+    for (size_t i = 0; i < symbols.size(); i++)
+        codeLengthFrequencies[symbols[i]]++;
+    uint8_t codeLengthLengths[19];
+    uint16_t codeLengthCodes[19];
+    buildLengths(codeLengthFrequencies, 19, 7, codeLengthLengths);
+    buildCodes(codeLengthLengths, 19, codeLengthCodes);
+
+    unsigned numberOfCodeLengthCodes = 19;
+    while (numberOfCodeLengthCodes > 4 && codeLengthLengths[DEFLATE_CODE_LENGTH_ORDER[numberOfCodeLengthCodes - 1]] == 0)
+        numberOfCodeLengthCodes--;
+
+    writer.write(final ? 1 : 0, 1);
+    writer.write(2, 2);
+    writer.write(numberOfLiteralCodes - 257, 5);
+    writer.write(numberOfDistanceCodes - 1, 5);
+    writer.write(numberOfCodeLengthCodes - 4, 4);
+    for (unsigned i = 0; i < numberOfCodeLengthCodes; i++)
+        writer.write(codeLengthLengths[DEFLATE_CODE_LENGTH_ORDER[i]], 3);
+    for (size_t i = 0; i < symbols.size(); i++) {
+        writer.write(codeLengthCodes[symbols[i]], codeLengthLengths[symbols[i]]);
+        if (symbols[i] == 16)
+            writer.write(extras[i], 2);
+        else if (symbols[i] == 17)
+            writer.write(extras[i], 3);
+        else if (symbols[i] == 18)
+            writer.write(extras[i], 7);
+    }
+
+    uint16_t literalCodes[286];
+    uint16_t distanceCodes[30];
+    buildCodes(literalLengths, 286, literalCodes);
+    buildCodes(distanceLengths, 30, distanceCodes);
+    for (size_t i = 0; i < count; i++) {
+        const Token &token = tokens[i];
+        if (token.distance == 0) {
+            writer.write(literalCodes[token.value], literalLengths[token.value]);
+            continue;
+        }
+
+        unsigned length = lengthSymbol(token.value);
+        writer.write(literalCodes[257 + length], literalLengths[257 + length]);
+        writer.write(token.value - DEFLATE_LENGTH_BASE[length], DEFLATE_LENGTH_EXTRA[length]);
+        unsigned distance = distanceSymbol(token.distance);
+        writer.write(distanceCodes[distance], distanceLengths[distance]);
+        writer.write(token.distance - DEFLATE_DISTANCE_BASE[distance], DEFLATE_DISTANCE_EXTRA[distance]);
+    }
+    writer.write(literalCodes[256], literalLengths[256]);
+}
+
+//- Huffman codes -//
+/* Huffman code lengths for the frequencies, none longer than maxBits.
+ * Codes that come out too long are rebuilt from flattened frequencies.
+ * At least two symbols always get a code, so every code is complete.
+ */
+void Deflate::buildLengths(const uint32_t *frequencies, unsigned count, unsigned maxBits, uint8_t *lengths) {
+    std::vector<uint32_t> weights(frequencies, frequencies + count);
+    unsigned used = 0;
+    for (unsigned i = 0; i < count; i++)
+        used += weights[i] > 0;
+    for (unsigned i = 0; i < count && used < 2; i++) {
+        if (weights[i] == 0) {
+            weights[i] = 1;
+            used++;
+        }
+    }
+
+    while (true) {
+        //- Leaves then internal nodes; parents[i] is the node merging i -//
+        std::vector<std::pair<uint64_t, unsigned> > leaves;
+        for (unsigned i = 0; i < count; i++) {
+            if (weights[i] > 0)
+                leaves.push_back(std::make_pair((uint64_t) weights[i], i));
+        }
+        std::sort(leaves.begin(), leaves.end());
+
+        unsigned numberOfLeaves = leaves.size();
+        std::vector<uint64_t> nodeWeights(2 * numberOfLeaves - 1);
+        std::vector<unsigned> parents(2 * numberOfLeaves - 1, 0);
+        for (unsigned i = 0; i < numberOfLeaves; i++)
+            nodeWeights[i] = leaves[i].first;
+
+        //- Two queue merge: leaves are sorted, and merged nodes come out in order -//
+        unsigned nextLeaf = 0;
+        unsigned nextMerged = numberOfLeaves;
+        for (unsigned node = numberOfLeaves; node < 2 * numberOfLeaves - 1; node++) {
+            unsigned children[2];
+            for (int c = 0; c < 2; c++) {
+                if (nextLeaf < numberOfLeaves && (nextMerged >= node || nodeWeights[nextLeaf] <= nodeWeights[nextMerged]))
+                    children[c] = nextLeaf++;
+                else
+                    children[c] = nextMerged++;
+            }
+            nodeWeights[node] = nodeWeights[children[0]] + nodeWeights[children[1]];
+            parents[children[0]] = node;
+            parents[children[1]] = node;
+        }
+
+        std::vector<unsigned> depths(2 * numberOfLeaves - 1, 0);
+        unsigned deepest = 0;
+        for (int node = 2 * numberOfLeaves - 3; node >= 0; node--) {
+            depths[node] = depths[parents[node]] + 1;
+            deepest = std::max(deepest, depths[node]);
+        }
+
+        if (deepest <= maxBits) {
+            std::fill(lengths, lengths + count, 0);
+            for (unsigned i = 0; i < numberOfLeaves; i++)
+                lengths[leaves[i].second] = depths[i];
+            return;
+        }
+
+        for (unsigned i = 0; i < count; i++) {
+            if (weights[i] > 0)
+                weights[i] = (weights[i] >> 1) | 1;
+        }
+    }
+}
+
+//- Canonical codes for the lengths, bit reversed as deflate sends them -//
+void Deflate::buildCodes(const uint8_t *lengths, unsigned count, uint16_t *codes) {
+    unsigned lengthCounts[16] = {0};
+    for (unsigned i = 0; i < count; i++)
+        lengthCounts[lengths[i]]++;
+    lengthCounts[0] = 0;
+
+    unsigned nextCode[16];
+    unsigned code = 0;
+    for (unsigned bits = 1; bits < 16; bits++) {
+        code = (code + lengthCounts[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        codes[i] = 0;
+        if (lengths[i] == 0)
+            continue;
+        unsigned value = nextCode[lengths[i]]++;
+        unsigned reversed = 0;
+        for (unsigned bit = 0; bit < lengths[i]; bit++)
+            reversed |= ((value >> bit) & 1) << (lengths[i] - 1 - bit);
+        codes[i] = reversed;
+    }
+}
+
+unsigned Deflate::lengthSymbol(unsigned length) {
+    return std::upper_bound(DEFLATE_LENGTH_BASE, DEFLATE_LENGTH_BASE + 29, length) - DEFLATE_LENGTH_BASE - 1;
+}
+
+unsigned Deflate::distanceSymbol(unsigned distance) {
+    return std::upper_bound(DEFLATE_DISTANCE_BASE, DEFLATE_DISTANCE_BASE + 30, distance) - DEFLATE_DISTANCE_BASE - 1;
+}
+
+//- Bit Writer -//
+Deflate::BitWriter::BitWriter(std::vector<unsigned char> &output) : output(output) {
+    buffer = 0;
+    bitsInBuffer = 0;
+}
+
+//- Appends the low count bits, least significant first -//
+void Deflate::BitWriter::write(uint32_t bits, unsigned count) {
+    buffer |= (uint64_t) bits << bitsInBuffer;
+    bitsInBuffer += count;
+    while (bitsInBuffer >= 8) {
+        output.push_back(buffer & 0xff);
+        buffer >>= 8;
+        bitsInBuffer -= 8;
+    }
+}
+
+void Deflate::BitWriter::alignToByte() {
+    if (bitsInBuffer > 0)
+        write(0, 8 - bitsInBuffer);
+}
+
+#endif
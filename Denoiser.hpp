@@ -0,0 +1,267 @@
+/* An edge-avoiding à-trous wavelet filter for images rendered with few
+ * samples per pixel (Dammertz et al. 2010, with the variance guided color
+ * weight of Schied et al. 2017).
+ *
+ * Each iteration blurs with a 5x5 B3 spline kernel whose taps are spread
+ * twice as far apart as in the iteration before, so five iterations cover
+ * 61 pixels for the cost of 125 taps. Every tap is weighted by how alike
+ * the two pixels are:
+ *
+ *   shape ID   pixels of different shapes are never mixed
+ *   normal     max(0, n_p . n_q) ^ normalPower
+ *   depth      relative to how fast depth changes across the pixel
+ *   albedo     Gaussian in the difference of material colors
+ *   color      luminance difference relative to the pixel's noise, so
+ *              converged pixels keep their detail and noisy ones blur
+ *
+ * The auxiliary buffers come from the camera rays' first hits and are
+ * free of shading noise, so shadow edges blur while geometry edges stay
+ * sharp. Rows are filtered in parallel bands.
+ */
+#ifndef DENOISER_HPP
+#define DENOISER_HPP
+
+#include "Scene.hpp"
+#include "ThreadPool.hpp"
+#include "Vector3.hpp"
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+class Denoiser {
+public:
+    Denoiser();
+
+    /* Filters colors into output, both width * height in row order.
+     * variances is each pixel's variance of its mean luminance, negative
+     * where it is unknown (pixels with a single sample); those pixels use
+     * the variance of their 3x3 neighbourhood instead.
+     */
+    void denoise(ThreadPool &pool, unsigned width, unsigned height, const Vector3 *colors,
+                 const Real *variances, const Scene::SurfaceInfo *surfaces, Vector3 *output) const;
+
+    unsigned iterations;
+    //- Larger sigmas blur more across differences in that buffer -//
+    Real colorSigma;
+    Real normalPower;
+    Real depthSigma;
+    Real albedoSigma;
+private:
+    //- A frame's buffers, shared by all the bands of an iteration -//
+    struct Frame {
+        unsigned width;
+        unsigned height;
+        const Scene::SurfaceInfo *surfaces;
+        std::vector<Real> depthGradients;
+    };
+
+    void estimateVariances(const Frame &frame, const Vector3 *colors, const Real *variances,
+                           unsigned firstRow, unsigned endRow, Real *estimated) const;
+    void filterRows(const Frame &frame, unsigned stepSize, const Vector3 *colors, const Real *variances,
+                    unsigned firstRow, unsigned endRow, Vector3 *filteredColors, Real *filteredVariances) const;
+    static Real blurredVariance(const Frame &frame, const Real *variances, unsigned column, unsigned row);
+    static Real luminance(const Vector3 &color);
+};
+
+//- Rows per task -//
+const unsigned DENOISER_BAND_HEIGHT = 16;
+const Real DENOISER_KERNEL[3] = {3 / (Real) 8, 1 / (Real) 4, 1 / (Real) 16};
+
+Denoiser::Denoiser() {
+    iterations = 5;
+    colorSigma = 2;
+    normalPower = 64;
+    depthSigma = 1;
+    albedoSigma = 0.1;
+}
+
+void Denoiser::denoise(ThreadPool &pool, unsigned width, unsigned height, const Vector3 *colors,
+                       const Real *variances, const Scene::SurfaceInfo *surfaces, Vector3 *output) const {
+    unsigned size = width * height;
+    Frame frame;
+    frame.width = width;
+    frame.height = height;
+    frame.surfaces = surfaces;
+
+    //- How much depth changes per pixel, so slanted surfaces are not cut up -//
+    frame.depthGradients.resize(size);
+    for (unsigned row = 0; row < height; row++) {
+        for (unsigned column = 0; column < width; column++) {
+            unsigned index = row * width + column;
+            unsigned left = row * width + (column > 0 ? column - 1 : column);
+            unsigned right = row * width + (column + 1 < width ? column + 1 : column);
+            unsigned up = (row > 0 ? row - 1 : row) * width + column;
+            unsigned down = (row + 1 < height ? row + 1 : row) * width + column;
+            Real horizontal = fabs(surfaces[right].depth - surfaces[left].depth) / 2;
+            Real vertical = fabs(surfaces[down].depth - surfaces[up].depth) / 2;
+            frame.depthGradients[index] = std::max(horizontal, vertical);
+        }
+    }
+
+    //- Two sets of buffers, each iteration reading one and writing the other -//
+    std::vector<Vector3> colorBuffers[2];
+    std::vector<Real> varianceBuffers[2];
+    colorBuffers[0].assign(colors, colors + size);
+    colorBuffers[1].resize(size);
+    varianceBuffers[0].resize(size);
+    varianceBuffers[1].resize(size);
+
+    ThreadPool::TaskGroup varianceGroup;
+    for (unsigned firstRow = 0; firstRow < height; firstRow += DENOISER_BAND_HEIGHT) {
+        unsigned endRow = std::min(firstRow + DENOISER_BAND_HEIGHT, height);
+        Real *estimated = varianceBuffers[0].data();
+        pool.submit(varianceGroup, [this, &frame, colors, variances, firstRow, endRow, estimated] {
+            estimateVariances(frame, colors, variances, firstRow, endRow, estimated);
+        });
+    }
+    pool.wait(varianceGroup);
+
+    unsigned current = 0;
+    for (unsigned iteration = 0; iteration < iterations; iteration++) {
+        const Vector3 *source = colorBuffers[current].data();
+        const Real *sourceVariances = varianceBuffers[current].data();
+        Vector3 *destination = colorBuffers[1 - current].data();
+        Real *destinationVariances = varianceBuffers[1 - current].data();
+        unsigned stepSize = 1u << iteration;
+
+        ThreadPool::TaskGroup group;
+        for (unsigned firstRow = 0; firstRow < height; firstRow += DENOISER_BAND_HEIGHT) {
+            unsigned endRow = std::min(firstRow + DENOISER_BAND_HEIGHT, height);
+            pool.submit(group, [=, &frame] {
+                filterRows(frame, stepSize, source, sourceVariances, firstRow, endRow,
+                           destination, destinationVariances);
+            });
+        }
+        pool.wait(group);
+        current = 1 - current;
+    }
+
+    std::copy(colorBuffers[current].begin(), colorBuffers[current].end(), output);
+}
+
+//- Fills in unknown variances from the luminance of the pixel's 3x3 neighbourhood on the same shape -//
+void Denoiser::estimateVariances(const Frame &frame, const Vector3 *colors, const Real *variances,
+                                 unsigned firstRow, unsigned endRow, Real *estimated) const {
+    for (unsigned row = firstRow; row < endRow; row++) {
+        for (unsigned column = 0; column < frame.width; column++) {
+            unsigned index = row * frame.width + column;
+            if (variances[index] >= 0) {
+                estimated[index] = variances[index];
+                continue;
+            }
+
+            Real sum = 0;
+            Real sumOfSquares = 0;
+            unsigned count = 0;
+            for (int y = (int) row - 1; y <= (int) row + 1; y++) {
+                for (int x = (int) column - 1; x <= (int) column + 1; x++) {
+                    if (x < 0 || y < 0 || x >= (int) frame.width || y >= (int) frame.height)
+                        continue;
+                    unsigned neighbour = y * frame.width + x;
+                    if (frame.surfaces[neighbour].shapeId != frame.surfaces[index].shapeId)
+                        continue;
+                    Real value = luminance(colors[neighbour]);
+                    sum += value;
+                    sumOfSquares += value * value;
+                    count++;
+                }
+            }
+            Real mean = sum / count;
+            estimated[index] = std::max((Real) 0, sumOfSquares / count - mean * mean);
+        }
+    }
+}
+
+/* One à-trous iteration over rows firstRow to endRow. The variances are
+ * filtered alongside the colors with squared weights, as the variance of a
+ * weighted mean is.
+ */
+void Denoiser::filterRows(const Frame &frame, unsigned stepSize, const Vector3 *colors, const Real *variances,
+                          unsigned firstRow, unsigned endRow, Vector3 *filteredColors, Real *filteredVariances) const {
+    const Real smallest = 1e-10;
+    for (unsigned row = firstRow; row < endRow; row++) {
+        for (unsigned column = 0; column < frame.width; column++) {
+            unsigned index = row * frame.width + column;
+            const Scene::SurfaceInfo &center = frame.surfaces[index];
+            Real centerLuminance = luminance(colors[index]);
+            Real colorScale = colorSigma * sqrt(blurredVariance(frame, variances, column, row)) + smallest;
+            Real depthScale = depthSigma * frame.depthGradients[index] + smallest;
+
+            Vector3 totalColor(0, 0, 0);
+            Real totalVariance = 0;
+            Real totalWeight = 0;
+            for (int offsetY = -2; offsetY <= 2; offsetY++) {
+                int y = (int) row + offsetY * (int) stepSize;
+                if (y < 0 || y >= (int) frame.height)
+                    continue;
+                for (int offsetX = -2; offsetX <= 2; offsetX++) {
+                    int x = (int) column + offsetX * (int) stepSize;
+                    if (x < 0 || x >= (int) frame.width)
+                        continue;
+
+                    unsigned neighbourIndex = y * frame.width + x;
+                    const Scene::SurfaceInfo &neighbour = frame.surfaces[neighbourIndex];
+                    if (neighbour.shapeId != center.shapeId)
+                        continue;
+
+                    Real weight = DENOISER_KERNEL[abs(offsetX)] * DENOISER_KERNEL[abs(offsetY)];
+                    if (neighbourIndex != index) {
+                        Real exponent = 0;
+                        if (center.shapeId != 0) {
+                            Real normalWeight = pow(std::max((Real) 0, center.normal * neighbour.normal), normalPower);
+                            Vector3 albedoDifference = center.albedo - neighbour.albedo;
+                            Real distance = sqrt((Real) (offsetX * offsetX + offsetY * offsetY)) * stepSize;
+                            exponent += fabs(center.depth - neighbour.depth) / (depthScale * distance);
+                            exponent += albedoDifference * albedoDifference / (albedoSigma * albedoSigma);
+                            weight *= normalWeight;
+                        }
+                        exponent += fabs(centerLuminance - luminance(colors[neighbourIndex])) / colorScale;
+                        weight *= exp(-exponent);
+                    }
+
+                    totalColor = totalColor + colors[neighbourIndex] * weight;
+                    totalVariance += weight * weight * variances[neighbourIndex];
+                    totalWeight += weight;
+                }
+            }
+
+            //- The pixel itself always has a positive weight -//
+            filteredColors[index] = totalColor * (1 / totalWeight);
+            filteredVariances[index] = totalVariance / (totalWeight * totalWeight);
+        }
+    }
+}
+
+/* A pixel's variance blurred with its 3x3 neighbours on the same shape.
+ * Variances estimated from a few samples are noisy themselves, and an
+ * underestimate would keep a noisy pixel from being filtered at all.
+ */
+Real Denoiser::blurredVariance(const Frame &frame, const Real *variances, unsigned column, unsigned row) {
+    const Real kernel[2] = {1 / (Real) 2, 1 / (Real) 4};
+    unsigned index = row * frame.width + column;
+    Real total = 0;
+    Real totalWeight = 0;
+    for (int offsetY = -1; offsetY <= 1; offsetY++) {
+        int y = (int) row + offsetY;
+        if (y < 0 || y >= (int) frame.height)
+            continue;
+        for (int offsetX = -1; offsetX <= 1; offsetX++) {
+            int x = (int) column + offsetX;
+            if (x < 0 || x >= (int) frame.width)
+                continue;
+            unsigned neighbourIndex = y * frame.width + x;
+            if (frame.surfaces[neighbourIndex].shapeId != frame.surfaces[index].shapeId)
+                continue;
+            Real weight = kernel[abs(offsetX)] * kernel[abs(offsetY)];
+            total += weight * variances[neighbourIndex];
+            totalWeight += weight;
+        }
+    }
+    return total / totalWeight;
+}
+
+Real Denoiser::luminance(const Vector3 &color) {
+    return 0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2];
+}
+
+#endif
@@ -0,0 +1,169 @@
+/* An image written straight to a binary .ppm or .pfm file a band of rows
+ * at a time, for images too large to hold in memory. The file is sized
+ * when it is opened and every band is written at its own offset, so bands
+ * may arrive in any order and from any thread; only the rows being written
+ * are ever in memory.
+ *
+ * Like ColorBuffer::writeToFile, the file is written beside its path and
+ * only renamed over it by close, so a crashed render leaves no half image.
+ */
+#ifndef IMAGESTREAM_HPP
+#define IMAGESTREAM_HPP
+
+#include "ColorBuffer.hpp"
+#include "ImageWriter.hpp"
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+class ImageStream {
+public:
+    ImageStream();
+    //- Removes the file if close was never called -//
+    ~ImageStream();
+
+    /* Creates an image of width by height at path, which must end in .ppm
+     * or .pfm. Returns false if it could not be created.
+     */
+    bool open(const std::string &path, unsigned width, unsigned height);
+    unsigned getWidth() const;
+    unsigned getHeight() const;
+    /* Writes numberOfRows rows from firstRow on. rgba holds their pixels
+     * as a ColorBuffer does, 4 floats each, a full row after another.
+     */
+    bool writeRows(const float *rgba, unsigned firstRow, unsigned numberOfRows) const;
+    //- Renames the finished file over the path -//
+    bool close();
+
+    //- As for ColorBuffer; .pfm files are not tone mapped -//
+    ColorBuffer::ToneMapping toneMapping;
+    float exposure;
+private:
+    int file;
+    std::string path;
+    ImageWriter::Format format;
+    unsigned width;
+    unsigned height;
+    size_t headerSize;
+
+    size_t bytesPerPixel() const;
+    bool writeAt(const unsigned char *data, size_t size, off_t offset) const;
+};
+
+ImageStream::ImageStream() {
+    toneMapping = ColorBuffer::TONE_MAP_CLAMP;
+    exposure = 1;
+    file = -1;
+    format = ImageWriter::FORMAT_UNKNOWN;
+    width = 0;
+    height = 0;
+    headerSize = 0;
+}
+
+ImageStream::~ImageStream() {
+    if (file >= 0) {
+        ::close(file);
+        remove((path + ".partial").c_str());
+    }
+}
+
+bool ImageStream::open(const std::string &path, unsigned width, unsigned height) {
+    ImageWriter::Format format = ImageWriter::getFormat(path);
+    if (file >= 0 || (format != ImageWriter::FORMAT_PPM && format != ImageWriter::FORMAT_PFM))
+        return false;
+
+    int file = ::open((path + ".partial").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0)
+        return false;
+
+    this->file = file;
+    this->path = path;
+    this->format = format;
+    this->width = width;
+    this->height = height;
+
+    std::vector<unsigned char> header;
+    if (format == ImageWriter::FORMAT_PPM)
+        ImageWriter::encodePPMHeader(width, height, header);
+    else
+        ImageWriter::encodePFMHeader(width, height, header);
+    headerSize = header.size();
+
+    //- Sized up front, so bands can be written anywhere in it -//
+    off_t size = headerSize + (off_t) width * height * bytesPerPixel();
+    if (ftruncate(file, size) != 0 || !writeAt(header.data(), header.size(), 0)) {
+        ::close(file);
+        remove((path + ".partial").c_str());
+        this->file = -1;
+        return false;
+    }
+    return true;
+}
+
+unsigned ImageStream::getWidth() const {
+    return width;
+}
+
+unsigned ImageStream::getHeight() const {
+    return height;
+}
+
+bool ImageStream::writeRows(const float *rgba, unsigned firstRow, unsigned numberOfRows) const {
+    if (file < 0 || firstRow + numberOfRows > height)
+        return false;
+
+    size_t rowBytes = width * bytesPerPixel();
+    std::vector<unsigned char> encoded(rowBytes * numberOfRows);
+    off_t offset;
+    if (format == ImageWriter::FORMAT_PPM) {
+        for (size_t i = 0; i < (size_t) width * numberOfRows; i++) {
+            for (int j = 0; j < 3; j++)
+                encoded[i * 3 + j] = ColorBuffer::quantise(rgba[i * COLOR_CHANNELS + j], toneMapping, exposure);
+        }
+        offset = headerSize + (off_t) firstRow * rowBytes;
+    } else {
+        //- PFM rows go bottom first, so the band is written reversed, ending at its first row -//
+        for (unsigned row = 0; row < numberOfRows; row++) {
+            ImageWriter::encodePFMRow(rgba + (size_t) row * width * COLOR_CHANNELS, width, 1 / 255.0f,
+                                      &encoded[(numberOfRows - 1 - row) * rowBytes]);
+        }
+        offset = headerSize + (off_t) (height - firstRow - numberOfRows) * rowBytes;
+    }
+    return writeAt(encoded.data(), encoded.size(), offset);
+}
+
+bool ImageStream::close() {
+    if (file < 0)
+        return false;
+
+    bool closed = ::close(file) == 0;
+    file = -1;
+    std::string partialPath = path + ".partial";
+    if (!closed || rename(partialPath.c_str(), path.c_str()) != 0) {
+        remove(partialPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+size_t ImageStream::bytesPerPixel() const {
+    return format == ImageWriter::FORMAT_PFM ? 3 * sizeof(float) : 3;
+}
+
+//- pwrite may write less than asked, so this keeps going until it is all written -//
+bool ImageStream::writeAt(const unsigned char *data, size_t size, off_t offset) const {
+    while (size > 0) {
+        ssize_t written = pwrite(file, data, size, offset);
+        if (written <= 0)
+            return false;
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,327 @@
+/* Encoders for the image files a ColorBuffer can be written as:
+ *
+ *   .ppm  binary P6, 8 bits per channel
+ *   .pfm  32 bit float RGB, keeping the full dynamic range
+ *   .qoi  the Quite OK Image format, losslessly compressed in one fast pass
+ *   .png  8 bit RGB, compressed with the in-tree Deflate
+ *
+ * Files are written beside their path and renamed over it once complete,
+ * so a viewer never opens half an image.
+ */
+#ifndef IMAGEWRITER_HPP
+#define IMAGEWRITER_HPP
+
+#include "Deflate.hpp"
+#include "ThreadPool.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+class ImageWriter {
+public:
+    enum Format {
+        FORMAT_PPM,
+        FORMAT_PFM,
+        FORMAT_QOI,
+        FORMAT_PNG,
+        FORMAT_UNKNOWN
+    };
+
+    //- The format a path's extension names -//
+    static Format getFormat(const std::string &path);
+
+    //- rgb holds width * height pixels of 3 bytes, top row first -//
+    static void encodePPM(const unsigned char *rgb, unsigned width, unsigned height, std::vector<unsigned char> &output);
+    static void encodeQOI(const unsigned char *rgb, unsigned width, unsigned height, std::vector<unsigned char> &output);
+    //- Filters bands of rows and deflates chunks in parallel if pool is not NULL -//
+    static void encodePNG(const unsigned char *rgb, unsigned width, unsigned height, std::vector<unsigned char> &output,
+                          ThreadPool *pool = NULL);
+    /* rgba holds width * height pixels of 4 floats, top row first, which
+     * are multiplied by scale. The alpha channel is dropped.
+     */
+    static void encodePFM(const float *rgba, unsigned width, unsigned height, float scale, std::vector<unsigned char> &output);
+
+    //- The headers the pixels follow, for writing an image in pieces -//
+    static void encodePPMHeader(unsigned width, unsigned height, std::vector<unsigned char> &output);
+    static void encodePFMHeader(unsigned width, unsigned height, std::vector<unsigned char> &output);
+    //- Writes a row of width RGBA pixels as 12 bytes each -//
+    static void encodePFMRow(const float *rgba, unsigned width, float scale, unsigned char *output);
+
+    //- Writes data to path through a temporary file, returning false on failure -//
+    static bool writeFile(const std::string &path, const std::vector<unsigned char> &data);
+private:
+    static void filterRows(const unsigned char *rgb, unsigned width, unsigned firstRow, unsigned endRow,
+                           unsigned char *filtered);
+    static void appendChunk(std::vector<unsigned char> &output, const char *type, const unsigned char *data, size_t length);
+    static void appendBigEndian(std::vector<unsigned char> &output, uint32_t value);
+};
+
+//- Rows PNG filters per task -//
+const unsigned PNG_BAND_HEIGHT = 64;
+
+ImageWriter::Format ImageWriter::getFormat(const std::string &path) {
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos)
+        return FORMAT_UNKNOWN;
+
+    std::string extension = path.substr(dot);
+    if (extension == ".ppm")
+        return FORMAT_PPM;
+    if (extension == ".pfm")
+        return FORMAT_PFM;
+    if (extension == ".qoi")
+        return FORMAT_QOI;
+    if (extension == ".png")
+        return FORMAT_PNG;
+    return FORMAT_UNKNOWN;
+}
+
+//- PPM -//
+void ImageWriter::encodePPM(const unsigned char *rgb, unsigned width, unsigned height, std::vector<unsigned char> &output) {
+    encodePPMHeader(width, height, output);
+    output.insert(output.end(), rgb, rgb + (size_t) width * height * 3);
+}
+
+void ImageWriter::encodePPMHeader(unsigned width, unsigned height, std::vector<unsigned char> &output) {
+    char header[64];
+    int length = snprintf(header, sizeof(header), "P6\n%u %u\n255\n", width, height);
+    output.insert(output.end(), header, header + length);
+}
+
+//- PFM -//
+/* PFM stores rows bottom first; a negative scale in the header marks the
+ * floats as little endian.
+ */
+void ImageWriter::encodePFM(const float *rgba, unsigned width, unsigned height, float scale, std::vector<unsigned char> &output) {
+    encodePFMHeader(width, height, output);
+    size_t rowBytes = (size_t) width * 3 * sizeof(float);
+    size_t start = output.size();
+    output.resize(start + rowBytes * height);
+    for (unsigned row = 0; row < height; row++)
+        encodePFMRow(rgba + (size_t) row * width * 4, width, scale, &output[start + (height - 1 - row) * rowBytes]);
+}
+
+void ImageWriter::encodePFMHeader(unsigned width, unsigned height, std::vector<unsigned char> &output) {
+    char header[64];
+    int length = snprintf(header, sizeof(header), "PF\n%u %u\n-1.0\n", width, height);
+    output.insert(output.end(), header, header + length);
+}
+
+void ImageWriter::encodePFMRow(const float *rgba, unsigned width, float scale, unsigned char *output) {
+    for (unsigned column = 0; column < width; column++, rgba += 4) {
+        for (int channel = 0; channel < 3; channel++) {
+            float value = rgba[channel] * scale;
+            uint32_t bits;
+            memcpy(&bits, &value, sizeof(bits));
+            for (int shift = 0; shift < 32; shift += 8)
+                *output++ = (bits >> shift) & 0xff;
+        }
+    }
+}
+
+//- QOI -//
+/* Each pixel is stored as the shortest of: a run of the previous pixel,
+ * an index into the 64 most recently hashed pixels, a small difference
+ * from the previous pixel, or the pixel itself. The format is a single
+ * sequential pass, so it is not split across threads.
+ */
+void ImageWriter::encodeQOI(const unsigned char *rgb, unsigned width, unsigned height, std::vector<unsigned char> &output) {
+    const unsigned char header[4] = {'q', 'o', 'i', 'f'};
+    output.insert(output.end(), header, header + 4);
+    appendBigEndian(output, width);
+    appendBigEndian(output, height);
+    output.push_back(3);
+    output.push_back(0);
+
+    //- RGBA and all zero to start, as a decoder's are, so an opaque pixel never matches an unused slot -//
+    unsigned char seen[64][4] = {{0}};
+    unsigned char previous[3] = {0, 0, 0};
+    unsigned run = 0;
+    size_t numberOfPixels = (size_t) width * height;
+    for (size_t i = 0; i < numberOfPixels; i++) {
+        const unsigned char *pixel = rgb + i * 3;
+        bool same = pixel[0] == previous[0] && pixel[1] == previous[1] && pixel[2] == previous[2];
+        if (same) {
+            run++;
+            if (run == 62 || i + 1 == numberOfPixels) {
+                output.push_back(0xc0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+
+        if (run > 0) {
+            output.push_back(0xc0 | (run - 1));
+            run = 0;
+        }
+
+        //- Alpha is always 255 -//
+        unsigned hash = (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + 255 * 11) % 64;
+        if (seen[hash][0] == pixel[0] && seen[hash][1] == pixel[1] && seen[hash][2] == pixel[2] && seen[hash][3] == 255) {
+            output.push_back(hash);
+        } else {
+            seen[hash][0] = pixel[0];
+            seen[hash][1] = pixel[1];
+            seen[hash][2] = pixel[2];
+            seen[hash][3] = 255;
+
+            int red = (signed char) (pixel[0] - previous[0]);
+            int green = (signed char) (pixel[1] - previous[1]);
+            int blue = (signed char) (pixel[2] - previous[2]);
+            int redFromGreen = red - green;
+            int blueFromGreen = blue - green;
+            if (red >= -2 && red <= 1 && green >= -2 && green <= 1 && blue >= -2 && blue <= 1) {
+                output.push_back(0x40 | (red + 2) << 4 | (green + 2) << 2 | (blue + 2));
+            } else if (green >= -32 && green <= 31 && redFromGreen >= -8 && redFromGreen <= 7
+                       && blueFromGreen >= -8 && blueFromGreen <= 7) {
+                output.push_back(0x80 | (green + 32));
+                output.push_back((redFromGreen + 8) << 4 | (blueFromGreen + 8));
+            } else {
+                output.push_back(0xfe);
+                output.insert(output.end(), pixel, pixel + 3);
+            }
+        }
+
+        previous[0] = pixel[0];
+        previous[1] = pixel[1];
+        previous[2] = pixel[2];
+    }
+
+    const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    output.insert(output.end(), end, end + 8);
+}
+
+//- PNG -//
+void ImageWriter::encodePNG(const unsigned char *rgb, unsigned width, unsigned height, std::vector<unsigned char> &output,
+                            ThreadPool *pool) {
+    const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    output.insert(output.end(), signature, signature + 8);
+
+    std::vector<unsigned char> header;
+    appendBigEndian(header, width);
+    appendBigEndian(header, height);
+    //- 8 bit RGB, deflate, adaptive filtering, not interlaced -//
+    const unsigned char format[5] = {8, 2, 0, 0, 0};
+    header.insert(header.end(), format, format + 5);
+    appendChunk(output, "IHDR", header.data(), header.size());
+
+    //- Each row is a filter type byte followed by the filtered row -//
+    size_t rowSize = (size_t) width * 3 + 1;
+    std::vector<unsigned char> filtered(rowSize * height);
+    if (pool != NULL) {
+        ThreadPool::TaskGroup group;
+        for (unsigned firstRow = 0; firstRow < height; firstRow += PNG_BAND_HEIGHT) {
+            unsigned endRow = std::min(firstRow + PNG_BAND_HEIGHT, height);
+            unsigned char *destination = filtered.data();
+            pool->submit(group, [rgb, width, firstRow, endRow, destination] {
+                filterRows(rgb, width, firstRow, endRow, destination);
+            });
+        }
+        pool->wait(group);
+    } else {
+        filterRows(rgb, width, 0, height, filtered.data());
+    }
+
+    std::vector<unsigned char> compressed;
+    Deflate::zlibCompress(filtered.data(), filtered.size(), compressed, pool);
+    appendChunk(output, "IDAT", compressed.data(), compressed.size());
+    appendChunk(output, "IEND", NULL, 0);
+}
+
+/* Gives each row the filter whose output has the smallest sum of
+ * absolute values, the usual heuristic for finding the best one.
+ */
+void ImageWriter::filterRows(const unsigned char *rgb, unsigned width, unsigned firstRow, unsigned endRow,
+                             unsigned char *filtered) {
+    const unsigned bytesPerPixel = 3;
+    size_t rowBytes = (size_t) width * bytesPerPixel;
+    std::vector<unsigned char> candidates[5];
+    for (int filter = 0; filter < 5; filter++)
+        candidates[filter].resize(rowBytes);
+
+    for (unsigned row = firstRow; row < endRow; row++) {
+        const unsigned char *current = rgb + row * rowBytes;
+        const unsigned char *above = row > 0 ? current - rowBytes : NULL;
+
+        unsigned best = 0;
+        uint64_t bestCost = UINT64_MAX;
+        for (int filter = 0; filter < 5; filter++) {
+            unsigned char *out = candidates[filter].data();
+            uint64_t cost = 0;
+            for (size_t i = 0; i < rowBytes; i++) {
+                int left = i >= bytesPerPixel ? current[i - bytesPerPixel] : 0;
+                int up = above != NULL ? above[i] : 0;
+                int upLeft = above != NULL && i >= bytesPerPixel ? above[i - bytesPerPixel] : 0;
+
+                int predicted = 0;
+                if (filter == 1) {
+                    predicted = left;
+                } else if (filter == 2) {
+                    predicted = up;
+                } else if (filter == 3) {
+                    predicted = (left + up) / 2;
+                } else if (filter == 4) {
+                    int estimate = left + up - upLeft;
+                    int toLeft = abs(estimate - left);
+                    int toUp = abs(estimate - up);
+                    int toUpLeft = abs(estimate - upLeft);
+                    if (toLeft <= toUp && toLeft <= toUpLeft)
+                        predicted = left;
+                    else if (toUp <= toUpLeft)
+                        predicted = up;
+                    else
+                        predicted = upLeft;
+                }
+
+                out[i] = (unsigned char) (current[i] - predicted);
+                cost += abs((signed char) out[i]);
+            }
+
+            if (cost < bestCost) {
+                bestCost = cost;
+                best = filter;
+            }
+        }
+
+        unsigned char *destination = filtered + row * (rowBytes + 1);
+        destination[0] = best;
+        std::copy(candidates[best].begin(), candidates[best].end(), destination + 1);
+    }
+}
+
+void ImageWriter::appendChunk(std::vector<unsigned char> &output, const char *type, const unsigned char *data, size_t length) {
+    appendBigEndian(output, length);
+    size_t typeStart = output.size();
+    output.insert(output.end(), type, type + 4);
+    if (length > 0)
+        output.insert(output.end(), data, data + length);
+    //- The CRC covers the type and the data -//
+    appendBigEndian(output, crc32(&output[typeStart], length + 4));
+}
+
+void ImageWriter::appendBigEndian(std::vector<unsigned char> &output, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8)
+        output.push_back((value >> shift) & 0xff);
+}
+
+//- Files -//
+bool ImageWriter::writeFile(const std::string &path, const std::vector<unsigned char> &data) {
+    std::string partialPath = path + ".partial";
+    FILE *file = fopen(partialPath.c_str(), "wb");
+    if (file == NULL)
+        return false;
+
+    bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+    written = fclose(file) == 0 && written;
+    if (!written || rename(partialPath.c_str(), path.c_str()) != 0) {
+        remove(partialPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,142 @@
+/* A copy of a shape placed in the scene by a transformation matrix,
+ * without copying its geometry. Any number of instances can share one
+ * object, usually a TriangleMesh, so a forest of a thousand trees keeps a
+ * single tree's triangles and BVH, plus a couple of matrices per tree.
+ *
+ * The scene's BVH holds the instances, each bounded by its object's box
+ * carried into the scene, and the object's own BVH is searched below it.
+ * Rays are carried into the object's space rather than the object into
+ * the scene's: the direction is not normalised again, so times along the
+ * ray are the same in both spaces and hits compare with other shapes'.
+ *
+ * Each instance has its own material, and transform moves an instance
+ * about its center, as it moves any other shape.
+ */
+#ifndef INSTANCE_HPP
+#define INSTANCE_HPP
+
+#include "BoundingBox.hpp"
+#include "Matrix.hpp"
+#include "Shape.hpp"
+#include "Vector3.hpp"
+#include "Vector4.hpp"
+#include <memory>
+
+class Instance: public Shape {
+public:
+    //- Places object where it is, until the instance is transformed -//
+    Instance(const std::shared_ptr<const Shape> &object);
+
+    Shape::Intersection intersect(const Ray &ray) const;
+    bool occluded(const Ray &ray, Real maxTime) const;
+    Vector3 getNormalAt(const Vector3 &point) const;
+    Vector3 getPrimitiveNormalAt(const Vector3 &point, unsigned primitive) const;
+    void transform(Real translateX, Real translateY, Real translateZ,
+                   Real rotateX, Real rotateY, Real rotateZ);
+    //- Inverts objectToWorld -//
+    void precompute();
+    BoundingBox getBounds() const;
+    bool isBounded() const;
+
+    //- The shared geometry, in its own space. It must not change while instances use it -//
+    std::shared_ptr<const Shape> object;
+    //- Takes points of the object into the scene. Call precompute after changing it -//
+    Matrix objectToWorld;
+
+private:
+    Matrix worldToObject;
+
+    Ray toObject(const Ray &ray) const;
+    Vector3 pointToObject(const Vector3 &point) const;
+    Vector3 normalToWorld(const Vector3 &normal) const;
+};
+
+Instance::Instance(const std::shared_ptr<const Shape> &object)
+    : object(object),
+      objectToWorld(1, 0, 0, 0,
+                    0, 1, 0, 0,
+                    0, 0, 1, 0,
+                    0, 0, 0, 1),
+      worldToObject(objectToWorld) {
+    center = object->getBounds().centroid();
+    precompute();
+}
+
+Shape::Intersection Instance::intersect(const Ray &ray) const {
+    Shape::Intersection intersection = intersectShape(*object, toObject(ray));
+    if (intersection.hit)
+        intersection.intersection = intersection.time * ray.direction + ray.position;
+    return intersection;
+}
+
+bool Instance::occluded(const Ray &ray, Real maxTime) const {
+    return occludedByShape(*object, toObject(ray), maxTime);
+}
+
+Vector3 Instance::getNormalAt(const Vector3 &point) const {
+    return normalToWorld(object->getNormalAt(pointToObject(point)));
+}
+
+Vector3 Instance::getPrimitiveNormalAt(const Vector3 &point, unsigned primitive) const {
+    return normalToWorld(getShapeNormalAt(*object, pointToObject(point), primitive));
+}
+
+void Instance::transform(Real translateX, Real translateY, Real translateZ,
+                         Real rotateX, Real rotateY, Real rotateZ) {
+    Matrix transform = Matrix::createTransformationMatrix(translateX, translateY, translateZ,
+                                                          rotateX, rotateY, rotateZ);
+    Matrix toCenter = Matrix::createTransformationMatrix(-center[0], -center[1], -center[2], 0, 0, 0);
+    Matrix fromCenter = Matrix::createTransformationMatrix(center[0], center[1], center[2], 0, 0, 0);
+
+    objectToWorld = fromCenter * transform * toCenter * objectToWorld;
+    precompute();
+}
+
+void Instance::precompute() {
+    worldToObject = objectToWorld.affineInverse();
+}
+
+//- The box around the object's box carried into the scene -//
+BoundingBox Instance::getBounds() const {
+    if (!object->isBounded())
+        return BoundingBox::infinite();
+
+    BoundingBox objectBounds = object->getBounds();
+    BoundingBox bounds;
+    for (int corner = 0; corner < 8; corner++) {
+        Vector4 point(corner & 1 ? objectBounds.max[0] : objectBounds.min[0],
+                      corner & 2 ? objectBounds.max[1] : objectBounds.min[1],
+                      corner & 4 ? objectBounds.max[2] : objectBounds.min[2], 1);
+        Vector4 transformed = objectToWorld * point;
+        bounds.expand(Vector3(transformed[0], transformed[1], transformed[2]));
+    }
+    return bounds;
+}
+
+bool Instance::isBounded() const {
+    return object->isBounded();
+}
+
+Ray Instance::toObject(const Ray &ray) const {
+    Ray objectRay;
+    objectRay.position = pointToObject(ray.position);
+    Vector4 direction = worldToObject * Vector4::vec3ToVec4(ray.direction, 0);
+    objectRay.direction(direction[0], direction[1], direction[2]);
+    return objectRay;
+}
+
+Vector3 Instance::pointToObject(const Vector3 &point) const {
+    Vector4 point4 = worldToObject * Vector4::vec3ToVec4(point, 1);
+    return Vector3(point4[0], point4[1], point4[2]);
+}
+
+//- Normals are carried by the inverse transpose, so they stay normal under any transformation -//
+Vector3 Instance::normalToWorld(const Vector3 &normal) const {
+    Vector4 normal4 = Vector4::vec3ToVec4(normal, 0);
+    Vector3 transformed(worldToObject.getColumnVector(0) * normal4,
+                        worldToObject.getColumnVector(1) * normal4,
+                        worldToObject.getColumnVector(2) * normal4);
+    return transformed.normalise();
+}
+
+#endif
@@ -1,170 +1,246 @@
+/* Renders scene files from the command line:
+ *
+ *   ./a.out [options] scene output... [scene output...]
+ *
+ * Every scene is followed by the images to write it to, whose extensions
+ * pick their formats. A scene's images are written in the background
+ * while the next scene renders. Run without arguments for the options.
+ */
+#include <stdlib.h>
 #include <iostream>
+#include <string>
+#include <vector>
+#include "AsyncImageWriter.hpp"
 #include "ColorBuffer.hpp"
-#include "Vector3.hpp"
-#include "Shape.hpp"
+#include "ImageStream.hpp"
+#include "ImageWriter.hpp"
+#include "Renderer.hpp"
 #include "Scene.hpp"
-#include "Matrix.hpp"
-
-int main() {
-    const unsigned numberOfShapes = 10;
-    Vector3 a(1, 2, 3);
-    Vector3 b(4, 5, 6);
-    unsigned width = 500;
-    unsigned height = 500;
-
-    //- Scene camera -//
-    Scene::Camera camera;
-    camera.direction(0, 0, -1);
-    camera.position(0, 0, 1100);
-    camera.focalLength = 600;
-
-    //- Scene light -//
-    Scene::AreaLight areaLight;
-    areaLight.position(1000, 1000, 1000);
-    areaLight.radius = 100;
-    areaLight.intensity = 1;
-
-    //- Materials -//
-    Shape::Material sphereMaterial;
-    sphereMaterial.specularity = 1;
-    sphereMaterial.diffusion = 1;
-    sphereMaterial.shininess = 100;
-    sphereMaterial.reflectivity = 0;
-    sphereMaterial.red = 50;
-    sphereMaterial.green = 50;
-    sphereMaterial.blue = 200;
-
-    Shape::Material sphere2Material;
-    sphere2Material.specularity = 1;
-    sphere2Material.diffusion = 1;
-    sphere2Material.shininess = 100;
-    sphere2Material.reflectivity = 1;
-    sphere2Material.red = 50;
-    sphere2Material.green = 200;
-    sphere2Material.blue = 50;
-
-    Shape::Material sphere3Material;
-    sphere3Material.specularity = 0;
-    sphere3Material.diffusion = 1;
-    sphere3Material.shininess = 0;
-    sphere3Material.reflectivity = 0;
-    sphere3Material.red = 200;
-    sphere3Material.green = 50;
-    sphere3Material.blue = 50;
-
-    Shape::Material sphere4Material;
-    sphere4Material.specularity = 0.5;
-    sphere4Material.diffusion = 1;
-    sphere4Material.shininess = 100;
-    sphere4Material.reflectivity = 0.9;
-    sphere4Material.red = 50;
-    sphere4Material.green = 200;
-    sphere4Material.blue = 50;
-
-    Shape::Material planeMaterial;
-    planeMaterial.specularity = 0;
-    planeMaterial.diffusion = 1;
-    planeMaterial.shininess = 0;
-    planeMaterial.reflectivity = 0.1;
-    planeMaterial.red = 255;
-    planeMaterial.green = 255;
-    planeMaterial.blue = 255;
-
-    Shape::Material triangleMaterial;
-    triangleMaterial.specularity = 0;
-    triangleMaterial.diffusion = 1;
-    triangleMaterial.shininess = 0;
-    triangleMaterial.reflectivity = 0;
-    triangleMaterial.red = 50;
-    triangleMaterial.green = 200;
-    triangleMaterial.blue = 50;
-
-    //- Shapes -//
-    Sphere *sphere = new Sphere(100, -100, 0, 100);
-    sphere->material = sphereMaterial;
-
-    Sphere *sphere2 = new Sphere(300, -100, 150, 100);
-    sphere2->material = sphere2Material;
-
-    Sphere *sphere3 = new Sphere(-50, -100, 150, 100);
-    sphere3->material = sphere3Material;
-
-    Sphere *sphere4 = new Sphere(100, -150, 300, 50);
-    sphere4->material = sphere4Material;
-    
-    sphere4->transform(0, 100, 0, 0, 0, 0);
-
-    Vector3 planeNormal(0, 1, 0);
-    Plane *plane = new Plane(0, -200, -100, planeNormal);
-    plane->material = planeMaterial;
-    //plane->transform(0, 0, 0, 0, 0, M_PI/6);
-
-
-    double pyramidX = -100;
-    double pyramidY = -200;
-    double pyramidZ = 400;
-    Triangle *triangle = new Triangle(0 + pyramidX, 100 + pyramidY, 0 + pyramidZ,
-                                      50 + pyramidX, 0 + pyramidY, 100 + pyramidZ,
-                                      -100 + pyramidX, 0 + pyramidY, 50 + pyramidZ);
-    triangle->material = triangleMaterial;
-
-    Triangle *triangle1 = new Triangle(0 + pyramidX, 100 + pyramidY, 0 + pyramidZ,
-                                       100 + pyramidX, 0 + pyramidY, -100 + pyramidZ,
-                                       50 + pyramidX, 0 + pyramidY, 100 + pyramidZ);
-    triangle1->material = triangleMaterial;
-
-    Triangle *triangle2 = new Triangle(0 + pyramidX, 100 + pyramidY, 0 + pyramidZ,
-                                       -100 + pyramidX, 0 + pyramidY, 50 + pyramidZ,
-                                       100 + pyramidX, 0 + pyramidY, -100 + pyramidZ
-                                       );
-    triangle2->material = triangleMaterial;
-
-    double theta = -M_PI / 6;
-    triangle->center(0 + pyramidX, 100 + pyramidY, 0 + pyramidZ);
-    triangle1->center(0 + pyramidX, 100 + pyramidY, 0 + pyramidZ);
-    triangle2->center(0 + pyramidX, 100 + pyramidY, 0 + pyramidZ);
-
-    triangle->transform(100, 100, 100, theta, 0, 0);
-    triangle1->transform(100, 100, 100, theta, 0, 0);
-    triangle2->transform(100, 100, 100, theta, 0, 0);
-
-    //- Constructing the scene -//
-    Scene scene;
-    scene.camera = camera;
-    scene.areaLight = areaLight;
-    scene.addShape(sphere4);
-    scene.addShape(sphere3);
-    scene.addShape(sphere2);
-    scene.addShape(sphere);
-    
-    scene.addShape(triangle);
-    scene.addShape(triangle1);
-    scene.addShape(triangle2);
-    
-    scene.addShape(plane);
+#include "SceneCache.hpp"
+#include "SceneParser.hpp"
+
+struct Options {
+    Options() {
+        width = 0;
+        height = 0;
+        samplesPerPixel = 0;
+        numberOfThreads = 0;
+        progressive = false;
+        denoising = false;
+        streaming = false;
+        caching = false;
+        toneMapping = ColorBuffer::TONE_MAP_CLAMP;
+        exposure = 1;
+    }
 
-    ColorBuffer cBuff(width, height);
+    //- 0 keeps the scene's own size and the renderer's own sample count -//
+    unsigned width;
+    unsigned height;
+    unsigned samplesPerPixel;
+    unsigned numberOfThreads;
+    bool progressive;
+    std::string previewFile;
+    bool denoising;
+    bool streaming;
+    bool caching;
+    ColorBuffer::ToneMapping toneMapping;
+    float exposure;
+};
+
+struct Job {
+    std::string sceneFile;
+    std::vector<std::string> outputFiles;
+};
+
+void printUsage(const char *program) {
+    std::cerr << "usage: " << program << " [options] scene output... [scene output...]\n"
+              << "Outputs are .ppm, .pfm, .qoi or .png images.\n"
+              << "  --size WxH          image size, instead of the scene's (default 500x500)\n"
+              << "  --samples N         samples per pixel\n"
+              << "  --threads N         worker threads, 0 for one per core\n"
+              << "  --progressive       refine the whole image a pass at a time; Ctrl-C stops early\n"
+              << "  --preview FILE      progressive, writing the image so far to FILE\n"
+              << "  --denoise           filter the final image with the denoiser\n"
+              << "  --stream            write a single .ppm or .pfm output a band at a time\n"
+              << "  --cache             load each scene from SCENE.cache while it is up to date,\n"
+              << "                      and save it there when it is not\n"
+              << "  --tone-map NAME     clamp, reinhard or aces\n"
+              << "  --exposure X        multiplies colors before tone mapping\n";
+}
+
+bool parseUnsigned(const char *text, unsigned &value) {
+    char *end;
+    unsigned long number = strtoul(text, &end, 10);
+    if (end == text || *end != '\0' || number > 0xffffffffUL)
+        return false;
+    value = number;
+    return true;
+}
+
+bool parseSize(const std::string &text, unsigned &width, unsigned &height) {
+    size_t separator = text.find('x');
+    if (separator == std::string::npos)
+        return false;
+    return parseUnsigned(text.substr(0, separator).c_str(), width)
+           && parseUnsigned(text.substr(separator + 1).c_str(), height) && width > 0 && height > 0;
+}
+
+//- Reads the options and the scenes with their outputs, false if they do not make sense -//
+bool parseArguments(int argc, char **argv, Options &options, std::vector<Job> &jobs) {
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (argument == "--progressive") {
+            options.progressive = true;
+        } else if (argument == "--denoise") {
+            options.denoising = true;
+        } else if (argument == "--stream") {
+            options.streaming = true;
+        } else if (argument == "--cache") {
+            options.caching = true;
+        } else if (argument == "--size" && hasValue) {
+            if (!parseSize(argv[++i], options.width, options.height))
+                return false;
+        } else if (argument == "--samples" && hasValue) {
+            if (!parseUnsigned(argv[++i], options.samplesPerPixel) || options.samplesPerPixel == 0)
+                return false;
+        } else if (argument == "--threads" && hasValue) {
+            if (!parseUnsigned(argv[++i], options.numberOfThreads))
+                return false;
+        } else if (argument == "--preview" && hasValue) {
+            options.previewFile = argv[++i];
+            options.progressive = true;
+        } else if (argument == "--tone-map" && hasValue) {
+            std::string name = argv[++i];
+            if (name == "clamp")
+                options.toneMapping = ColorBuffer::TONE_MAP_CLAMP;
+            else if (name == "reinhard")
+                options.toneMapping = ColorBuffer::TONE_MAP_REINHARD;
+            else if (name == "aces")
+                options.toneMapping = ColorBuffer::TONE_MAP_ACES;
+            else
+                return false;
+        } else if (argument == "--exposure" && hasValue) {
+            char *end;
+            options.exposure = strtod(argv[++i], &end);
+            if (*end != '\0')
+                return false;
+        } else if (argument.compare(0, 2, "--") == 0) {
+            return false;
+        } else if (ImageWriter::getFormat(argument) != ImageWriter::FORMAT_UNKNOWN) {
+            if (jobs.empty())
+                return false;
+            jobs.back().outputFiles.push_back(argument);
+        } else {
+            Job job;
+            job.sceneFile = argument;
+            jobs.push_back(job);
+        }
+    }
 
-    double cameraViewXBound = width / 2;
-    double cameraViewYBound = height / 2;
-    for (int x = -cameraViewXBound; x < cameraViewXBound; x++) {
-        for (int y = -cameraViewYBound; y < cameraViewYBound; y++) {
-            int iteration = (x + cameraViewXBound) * height + (y + cameraViewYBound);
-            if (iteration % 100 == 0) {
-                std::cout << "\r" << (int) (100 * iteration / ((double) width * height))  << "\% complete";
+    if (jobs.empty())
+        return false;
+    for (unsigned i = 0; i < jobs.size(); i++) {
+        if (jobs[i].outputFiles.empty()) {
+            std::cerr << jobs[i].sceneFile << " has no output\n";
+            return false;
+        }
+        if (options.streaming) {
+            ImageWriter::Format format = ImageWriter::getFormat(jobs[i].outputFiles[0]);
+            if (jobs[i].outputFiles.size() > 1 || (format != ImageWriter::FORMAT_PPM && format != ImageWriter::FORMAT_PFM)) {
+                std::cerr << "--stream writes a single .ppm or .pfm per scene\n";
+                return false;
             }
+        }
+    }
+    return true;
+}
+
+/* Loads sceneFile into scene, setting width and height to its image size.
+ * With caching, the scene is loaded from its cache if that is up to date,
+ * and otherwise parsed and saved to the cache for next time.
+ */
+bool loadScene(const std::string &sceneFile, bool caching, Scene &scene, unsigned &width, unsigned &height) {
+    std::string cacheFile = sceneFile + ".cache";
+    SceneCache cache;
+    if (caching && cache.load(cacheFile, sceneFile, scene)) {
+        width = cache.width;
+        height = cache.height;
+        return true;
+    }
 
-            //- Anti-Aliasing by averaging -//
-            Vector3 colorVector1 = scene.getColorAt(x, y);
-            Vector3 colorVector2 = scene.getColorAt(x + 0.5, y);
-            Vector3 colorVector3 = scene.getColorAt(x + 0.5, y + 0.5);
-            Vector3 colorVector4 = scene.getColorAt(x, y + 0.5);
+    SceneParser parser;
+    if (!parser.load(sceneFile, scene)) {
+        std::cerr << parser.getError() << "\n";
+        return false;
+    }
+    width = parser.width;
+    height = parser.height;
 
-            Vector3 colorVector = (colorVector1 + colorVector2 + colorVector3 + colorVector4) * (1 / 4.0);
-            cBuff.setStrokeColor(colorVector[0], colorVector[1], colorVector[2]);
-            cBuff.setColorAt(x + width / 2, -y - 1 + height / 2);
+    //- The render can go ahead without a cache -//
+    if (caching && !cache.save(cacheFile, sceneFile, parser, scene))
+        std::cerr << cache.getError() << "\n";
+    return true;
+}
+
+/* Renders one scene into its outputs, queueing them on writer unless
+ * streaming. stopped is set if a progressive render was stopped early.
+ */
+bool renderJob(const Job &job, const Options &options, AsyncImageWriter &writer, bool &stopped) {
+    Scene scene;
+    unsigned sceneWidth, sceneHeight;
+    if (!loadScene(job.sceneFile, options.caching, scene, sceneWidth, sceneHeight))
+        return false;
+
+    unsigned width = options.width > 0 ? options.width : (sceneWidth > 0 ? sceneWidth : 500);
+    unsigned height = options.width > 0 ? options.height : (sceneHeight > 0 ? sceneHeight : 500);
+
+    Renderer renderer(scene, width, height);
+    if (options.samplesPerPixel > 0)
+        renderer.samplesPerPixel = options.samplesPerPixel;
+    renderer.numberOfThreads = options.numberOfThreads;
+    renderer.progressive = options.progressive;
+    renderer.snapshotFile = options.previewFile;
+    renderer.snapshotInterval = 2;
+    renderer.denoising = options.denoising;
+
+    if (options.streaming) {
+        ImageStream image;
+        image.toneMapping = options.toneMapping;
+        image.exposure = options.exposure;
+        if (!image.open(job.outputFiles[0], width, height) || !renderer.render(image) || !image.close()) {
+            std::cerr << "Could not write " << job.outputFiles[0] << "\n";
+            return false;
         }
+        return true;
     }
 
-    cBuff.writeToFile("pictures/output", ".ppm");
+    ColorBuffer cBuff(width, height);
+    cBuff.toneMapping = options.toneMapping;
+    cBuff.exposure = options.exposure;
+    renderer.render(cBuff);
+    stopped = renderer.wasStopped();
+
+    for (unsigned i = 0; i < job.outputFiles.size(); i++)
+        writer.write(cBuff, job.outputFiles[i], "");
+    return true;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    std::vector<Job> jobs;
+    if (!parseArguments(argc, argv, options, jobs)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    if (options.progressive)
+        Renderer::stopOnInterrupt();
+
+    bool succeeded = true;
+    AsyncImageWriter writer(options.numberOfThreads);
+    bool stopped = false;
+    for (unsigned i = 0; i < jobs.size() && !stopped; i++)
+        succeeded = renderJob(jobs[i], options, writer, stopped) && succeeded;
+    return writer.wait() && succeeded ? 0 : 1;
 }
@@ -0,0 +1,83 @@
+/* A whole file mapped read only into memory, for as long as the object
+ * lives. The scene and mesh loaders read their files through one, and
+ * shared through a shared_ptr it keeps data used in place, such as a
+ * SceneCache's meshes, valid until the last user lets go of it.
+ */
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string>
+
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+
+    //- Maps the file at path, false if it could not be opened or mapped -//
+    bool open(const std::string &path);
+    //- NULL for an empty file -//
+    const unsigned char *getData() const;
+    size_t getSize() const;
+    //- Tells the kernel how the mapping will be read, e.g. MADV_SEQUENTIAL -//
+    void advise(int advice) const;
+private:
+    void *mapping;
+    size_t size;
+
+    MappedFile(const MappedFile&);
+    MappedFile &operator=(const MappedFile&);
+};
+
+MappedFile::MappedFile() {
+    mapping = NULL;
+    size = 0;
+}
+
+MappedFile::~MappedFile() {
+    if (mapping != NULL)
+        munmap(mapping, size);
+}
+
+bool MappedFile::open(const std::string &path) {
+    if (mapping != NULL)
+        return false;
+
+    int file = ::open(path.c_str(), O_RDONLY);
+    if (file < 0)
+        return false;
+
+    struct stat status;
+    if (fstat(file, &status) != 0) {
+        close(file);
+        return false;
+    }
+
+    size_t length = status.st_size;
+    void *mapped = length > 0 ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, file, 0) : NULL;
+    close(file);
+    if (mapped == MAP_FAILED)
+        return false;
+
+    mapping = mapped;
+    size = length;
+    return true;
+}
+
+const unsigned char *MappedFile::getData() const {
+    return (const unsigned char*) mapping;
+}
+
+size_t MappedFile::getSize() const {
+    return size;
+}
+
+void MappedFile::advise(int advice) const {
+    if (mapping != NULL)
+        madvise(mapping, size, advice);
+}
+
+#endif
@@ -2,44 +2,51 @@
 #include "math.h"
 #ifndef MATRIX_HPP
 #define MATRIX_HPP
-class Matrix {
+template <typename T>
+class MatrixT {
 public:
-    Matrix(double, double, double, double,
-           double, double, double, double,
-           double, double, double, double,
-           double, double, double, double);
-
-    static Matrix createTransformationMatrix(double tx, double ty, double tz, 
-                                             double rx, double ry, double rz) {
-        Matrix rotationZ( cos(rz), sin(rz), 0, tx,
-                         -sin(rz), cos(rz), 0, ty,
-                          0,       0,       1, tz,
-                          0,       0,       0, 1);
-
-        Matrix rotationX( 1,  0,       0,       0,
-                          0,  cos(rx), sin(rx), 0,
-                          0, -sin(rx), cos(rx), 0,
-                          0,  0,       0,       1);
-
-        Matrix rotationY( cos(ry), 0, sin(ry), 0,
-                          0,       1, 0,       0,
-                         -sin(ry), 0, cos(ry), 0,
-                          0,       0, 0,       1);
+    MatrixT(T, T, T, T,
+            T, T, T, T,
+            T, T, T, T,
+            T, T, T, T);
+
+    static MatrixT createTransformationMatrix(T tx, T ty, T tz, 
+                                              T rx, T ry, T rz) {
+        MatrixT rotationZ( cos(rz), sin(rz), 0, tx,
+                          -sin(rz), cos(rz), 0, ty,
+                           0,       0,       1, tz,
+                           0,       0,       0, 1);
+
+        MatrixT rotationX( 1,  0,       0,       0,
+                           0,  cos(rx), sin(rx), 0,
+                           0, -sin(rx), cos(rx), 0,
+                           0,  0,       0,       1);
+
+        MatrixT rotationY( cos(ry), 0, sin(ry), 0,
+                           0,       1, 0,       0,
+                          -sin(ry), 0, cos(ry), 0,
+                           0,       0, 0,       1);
         return rotationZ * rotationY * rotationX;
     }
-    Matrix operator *(const Matrix &m)const;
-    Vector4 operator *(const Vector4 &v)const;
+    MatrixT operator *(const MatrixT &m)const;
+    Vector4T<T> operator *(const Vector4T<T> &v)const;
+    //- The inverse of a matrix whose last row is 0 0 0 1, as transformations are -//
+    MatrixT affineInverse() const;
     void print() const;
-    void setAt(unsigned int i, unsigned int j, double value);
-    Vector4 getRowVector(unsigned int row) const;
-    Vector4 getColumnVector(unsigned int row) const;
+    void setAt(unsigned int i, unsigned int j, T value);
+    Vector4T<T> getRowVector(unsigned int row) const;
+    Vector4T<T> getColumnVector(unsigned int row) const;
 private:
-    double matrixArray[4][4];
+    T matrixArray[4][4];
 };
-Matrix::Matrix(double x1, double y1, double z1, double w1,
-               double x2, double y2, double z2, double w2,
-               double x3, double y3, double z3, double w3,
-               double x4, double y4, double z4, double w4) {
+
+typedef MatrixT<Real> Matrix;
+
+template <typename T>
+MatrixT<T>::MatrixT(T x1, T y1, T z1, T w1,
+                    T x2, T y2, T z2, T w2,
+                    T x3, T y3, T z3, T w3,
+                    T x4, T y4, T z4, T w4) {
 
     matrixArray[0][0] = x1;
     matrixArray[0][1] = y1;
@@ -63,7 +70,8 @@ Matrix::Matrix(double x1, double y1, double z1, double w1,
 }
 
 
-void Matrix::print() const {
+template <typename T>
+void MatrixT<T>::print() const {
     for (int i = 0; i < 4; i++) {
         cout << "|";
         for (int j = 0; j < 4; j++) {
@@ -73,22 +81,26 @@ void Matrix::print() const {
     }
 }
 
-void Matrix::setAt(unsigned int i, unsigned int j, double value) {
+template <typename T>
+void MatrixT<T>::setAt(unsigned int i, unsigned int j, T value) {
     matrixArray[j][i] = value;
 }
 
-Vector4 Matrix::getRowVector(unsigned int row) const {
-    Vector4 result(matrixArray[row][0], matrixArray[row][1], matrixArray[row][2], matrixArray[row][3]); 
+template <typename T>
+Vector4T<T> MatrixT<T>::getRowVector(unsigned int row) const {
+    Vector4T<T> result(matrixArray[row][0], matrixArray[row][1], matrixArray[row][2], matrixArray[row][3]); 
     return result;
 }
-Vector4 Matrix::getColumnVector(unsigned int column) const {
-    Vector4 result(matrixArray[0][column], matrixArray[1][column], matrixArray[2][column], matrixArray[3][column]);
+template <typename T>
+Vector4T<T> MatrixT<T>::getColumnVector(unsigned int column) const {
+    Vector4T<T> result(matrixArray[0][column], matrixArray[1][column], matrixArray[2][column], matrixArray[3][column]);
     return result;
 }
 
-Matrix Matrix::operator *(const Matrix &m) const {
+template <typename T>
+MatrixT<T> MatrixT<T>::operator *(const MatrixT &m) const {
 
-    Matrix result(0, 0, 0, 0,
+    MatrixT result(0, 0, 0, 0,
                   0, 0, 0, 0,
                   0, 0, 0, 0,
                   0, 0, 0, 0);
@@ -101,8 +113,40 @@ Matrix Matrix::operator *(const Matrix &m) const {
     return result;
 }
 
-Vector4 Matrix::operator *(const Vector4 &v)const {
-    Vector4 result(0, 0, 0, 0);
+/* Inverts the 3x3 part by its cofactors, and undoes the translation
+ * with the inverted part: if y = Ax + t then x = A'y - A't.
+ */
+template <typename T>
+MatrixT<T> MatrixT<T>::affineInverse() const {
+    const T (&m)[4][4] = matrixArray;
+    T cofactor[3][3];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            int i1 = (i + 1) % 3, i2 = (i + 2) % 3;
+            int j1 = (j + 1) % 3, j2 = (j + 2) % 3;
+            cofactor[i][j] = m[i1][j1] * m[i2][j2] - m[i1][j2] * m[i2][j1];
+        }
+    }
+    T inverseDeterminant = 1 / (m[0][0] * cofactor[0][0] + m[0][1] * cofactor[0][1] + m[0][2] * cofactor[0][2]);
+
+    MatrixT result(0, 0, 0, 0,
+                   0, 0, 0, 0,
+                   0, 0, 0, 0,
+                   0, 0, 0, 1);
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            result.matrixArray[i][j] = cofactor[j][i] * inverseDeterminant;
+    }
+    for (int i = 0; i < 3; i++) {
+        result.matrixArray[i][3] = -(result.matrixArray[i][0] * m[0][3] + result.matrixArray[i][1] * m[1][3]
+                                     + result.matrixArray[i][2] * m[2][3]);
+    }
+    return result;
+}
+
+template <typename T>
+Vector4T<T> MatrixT<T>::operator *(const Vector4T<T> &v)const {
+    Vector4T<T> result(0, 0, 0, 0);
     for (int i = 0; i < 4; i++) {
         result.setAt(i, this->getRowVector(i) * v);
     }
@@ -0,0 +1,579 @@
+/* Loads .obj and binary .ply files into a TriangleMesh. The file is mapped
+ * into memory and read straight into the mesh's vertex and index buffers,
+ * which are sized once up front, so nothing is copied on the way.
+ *
+ * OBJ files are split into chunks at line boundaries and parsed in
+ * parallel, in two passes: the first counts every chunk's vertices and
+ * triangles, so each chunk knows where its part of the buffers starts and
+ * what its relative indices refer to, and the second fills them in. Only
+ * v and f lines are read; polygons are split into fans of triangles and
+ * texture and normal indices are skipped.
+ *
+ * PLY files must be binary, either byte order. The vertex element's x, y
+ * and z are read and any other properties skipped; faces are split into
+ * fans as in OBJ files.
+ */
+#ifndef MESHLOADER_HPP
+#define MESHLOADER_HPP
+
+#include "DecimalParser.hpp"
+#include "MappedFile.hpp"
+#include "ThreadPool.hpp"
+#include "TriangleMesh.hpp"
+#include <ctype.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+class MeshLoader {
+public:
+    MeshLoader();
+
+    /* Replaces the vertices and indices of mesh with those of the file at
+     * path, whose extension must be .obj or .ply. Returns false if it
+     * could not be read or has an error, which getError then describes.
+     */
+    bool load(const std::string &path, TriangleMesh &mesh);
+    const std::string &getError() const;
+
+    //- Threads parsing OBJ files, 0 uses every hardware thread -//
+    unsigned numberOfThreads;
+private:
+    //- A piece of an OBJ file, made of whole lines -//
+    struct ObjChunk {
+        const char *begin;
+        const char *end;
+        unsigned numberOfLines;
+        size_t numberOfVertices;
+        size_t numberOfTriangles;
+        //- Where the chunk's vertices and triangles go, and the number of its first line -//
+        size_t firstVertex;
+        size_t firstTriangle;
+        unsigned firstLine;
+        //- The chunk's first error, at a line counted from the chunk's start -//
+        std::string error;
+        unsigned errorLine;
+    };
+
+    enum PlyType {
+        PLY_INT8,
+        PLY_UINT8,
+        PLY_INT16,
+        PLY_UINT16,
+        PLY_INT32,
+        PLY_UINT32,
+        PLY_FLOAT32,
+        PLY_FLOAT64,
+        PLY_UNKNOWN
+    };
+
+    struct PlyProperty {
+        std::string name;
+        PlyType type;
+        bool isList;
+        PlyType countType;
+    };
+
+    struct PlyElement {
+        std::string name;
+        size_t count;
+        std::vector<PlyProperty> properties;
+    };
+
+    std::string path;
+    std::string error;
+
+    bool loadOBJ(const char *text, size_t length, TriangleMesh &mesh);
+    void countChunk(ObjChunk &chunk) const;
+    void parseChunk(ObjChunk &chunk, size_t totalVertices, TriangleMesh &mesh) const;
+    bool loadPLY(const unsigned char *data, size_t length, TriangleMesh &mesh);
+    //- Sets the error, at lineNumber of the file unless it is 0 -//
+    bool fail(const std::string &message, unsigned lineNumber = 0);
+
+    static PlyType plyType(const std::string &name);
+    static size_t plySize(PlyType type);
+    static double readPly(const unsigned char *data, PlyType type, bool bigEndian);
+    static bool nextWord(const char *&cursor, const char *end, const char *&wordBegin, const char *&wordEnd);
+};
+
+//- OBJ files below this size are parsed as one chunk on the calling thread -//
+const size_t OBJ_PARALLEL_THRESHOLD = 1 << 20;
+//- OBJ files are split into about this many chunks per thread, so uneven chunks balance out -//
+const unsigned OBJ_CHUNKS_PER_THREAD = 4;
+
+MeshLoader::MeshLoader() {
+    numberOfThreads = 0;
+}
+
+bool MeshLoader::load(const std::string &path, TriangleMesh &mesh) {
+    this->path = path;
+    error.clear();
+
+    std::string extension = path.size() >= 4 ? path.substr(path.size() - 4) : "";
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if (extension != ".obj" && extension != ".ply")
+        return fail("unknown mesh format, expected .obj or .ply");
+
+    MappedFile file;
+    if (!file.open(path))
+        return fail("could not read the file");
+
+    mesh.vertices.clear();
+    mesh.indices.clear();
+    bool loaded;
+    if (extension == ".obj") {
+        file.advise(MADV_WILLNEED);
+        loaded = loadOBJ((const char*) file.getData(), file.getSize(), mesh);
+    } else {
+        file.advise(MADV_SEQUENTIAL);
+        loaded = loadPLY(file.getData(), file.getSize(), mesh);
+    }
+
+    if (!loaded) {
+        std::vector<float>().swap(mesh.vertices);
+        std::vector<uint32_t>().swap(mesh.indices);
+    }
+    return loaded;
+}
+
+const std::string &MeshLoader::getError() const {
+    return error;
+}
+
+bool MeshLoader::loadOBJ(const char *text, size_t length, TriangleMesh &mesh) {
+    ThreadPool *pool = NULL;
+    size_t chunkSize = length;
+    if (length >= OBJ_PARALLEL_THRESHOLD) {
+        pool = new ThreadPool(numberOfThreads);
+        chunkSize = length / (pool->getNumberOfThreads() * OBJ_CHUNKS_PER_THREAD) + 1;
+    }
+
+    //- Cut after the first newline past every multiple of chunkSize -//
+    std::vector<ObjChunk> chunks;
+    const char *end = text + length;
+    for (const char *begin = text; begin < end; ) {
+        ObjChunk chunk;
+        chunk.begin = begin;
+        chunk.end = end;
+        if ((size_t) (end - begin) > chunkSize) {
+            const char *newline = (const char*) memchr(begin + chunkSize, '\n', end - begin - chunkSize);
+            if (newline != NULL)
+                chunk.end = newline + 1;
+        }
+        chunks.push_back(chunk);
+        begin = chunk.end;
+    }
+
+    ThreadPool::TaskGroup tasks;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (pool != NULL)
+            pool->submit(tasks, [this, &chunks, i] { countChunk(chunks[i]); });
+        else
+            countChunk(chunks[i]);
+    }
+    if (pool != NULL)
+        pool->wait(tasks);
+
+    size_t totalVertices = 0;
+    size_t totalTriangles = 0;
+    unsigned totalLines = 0;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        chunks[i].firstVertex = totalVertices;
+        chunks[i].firstTriangle = totalTriangles;
+        chunks[i].firstLine = totalLines;
+        totalVertices += chunks[i].numberOfVertices;
+        totalTriangles += chunks[i].numberOfTriangles;
+        totalLines += chunks[i].numberOfLines;
+    }
+
+    if (totalVertices > UINT32_MAX || totalTriangles > UINT32_MAX / 3) {
+        delete pool;
+        return fail("too many vertices or triangles");
+    }
+
+    mesh.vertices.resize(3 * totalVertices);
+    mesh.indices.resize(3 * totalTriangles);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (pool != NULL)
+            pool->submit(tasks, [this, &chunks, i, totalVertices, &mesh] { parseChunk(chunks[i], totalVertices, mesh); });
+        else
+            parseChunk(chunks[i], totalVertices, mesh);
+    }
+    if (pool != NULL)
+        pool->wait(tasks);
+    delete pool;
+
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (!chunks[i].error.empty())
+            return fail(chunks[i].error, chunks[i].firstLine + chunks[i].errorLine);
+    }
+    return true;
+}
+
+//- The first pass over a chunk: counts its lines, vertices and triangles -//
+void MeshLoader::countChunk(ObjChunk &chunk) const {
+    chunk.numberOfLines = 0;
+    chunk.numberOfVertices = 0;
+    chunk.numberOfTriangles = 0;
+    chunk.errorLine = 0;
+
+    for (const char *line = chunk.begin; line < chunk.end; ) {
+        const char *lineEnd = (const char*) memchr(line, '\n', chunk.end - line);
+        if (lineEnd == NULL)
+            lineEnd = chunk.end;
+        chunk.numberOfLines++;
+
+        const char *cursor = line;
+        const char *wordBegin, *wordEnd;
+        if (nextWord(cursor, lineEnd, wordBegin, wordEnd) && wordEnd - wordBegin == 1) {
+            if (*wordBegin == 'v') {
+                chunk.numberOfVertices++;
+            } else if (*wordBegin == 'f') {
+                unsigned corners = 0;
+                while (nextWord(cursor, lineEnd, wordBegin, wordEnd))
+                    corners++;
+                if (corners >= 3)
+                    chunk.numberOfTriangles += corners - 2;
+            }
+        }
+        line = lineEnd + 1;
+    }
+}
+
+//- The second pass over a chunk: reads its vertices and triangles into mesh -//
+void MeshLoader::parseChunk(ObjChunk &chunk, size_t totalVertices, TriangleMesh &mesh) const {
+    float *vertex = mesh.vertices.data() + 3 * chunk.firstVertex;
+    uint32_t *index = mesh.indices.data() + 3 * chunk.firstTriangle;
+    size_t verticesSoFar = chunk.firstVertex;
+    unsigned lineNumber = 0;
+
+    for (const char *line = chunk.begin; line < chunk.end; ) {
+        const char *lineEnd = (const char*) memchr(line, '\n', chunk.end - line);
+        if (lineEnd == NULL)
+            lineEnd = chunk.end;
+        lineNumber++;
+
+        const char *cursor = line;
+        const char *wordBegin, *wordEnd;
+        line = lineEnd + 1;
+        if (!nextWord(cursor, lineEnd, wordBegin, wordEnd) || wordEnd - wordBegin != 1)
+            continue;
+
+        if (*wordBegin == 'v') {
+            for (int axis = 0; axis < 3; axis++) {
+                double value;
+                if (!nextWord(cursor, lineEnd, wordBegin, wordEnd) || !parseDecimal(wordBegin, wordEnd, value)) {
+                    chunk.error = "a vertex needs three numbers";
+                    chunk.errorLine = lineNumber;
+                    return;
+                }
+                *vertex++ = value;
+            }
+            verticesSoFar++;
+        } else if (*wordBegin == 'f') {
+            //- The corners are v, v/vt, v//vn or v/vt/vn; only v matters -//
+            uint32_t first = 0, previous = 0;
+            unsigned corners = 0;
+            while (nextWord(cursor, lineEnd, wordBegin, wordEnd)) {
+                const char *c = wordBegin;
+                bool negative = *c == '-';
+                if (negative)
+                    c++;
+                uint64_t number = 0;
+                const char *digits = c;
+                for (; c < wordEnd && *c >= '0' && *c <= '9' && number <= UINT32_MAX; c++)
+                    number = number * 10 + (*c - '0');
+
+                //- Indices count from 1, or back from the last vertex if negative -//
+                int64_t resolved = negative ? (int64_t) verticesSoFar - (int64_t) number : (int64_t) number - 1;
+                if (c == digits || (c < wordEnd && *c != '/') || number == 0 || resolved < 0
+                    || resolved >= (int64_t) totalVertices) {
+                    chunk.error = "bad vertex index '" + std::string(wordBegin, wordEnd) + "'";
+                    chunk.errorLine = lineNumber;
+                    return;
+                }
+
+                uint32_t current = resolved;
+                if (corners == 0) {
+                    first = current;
+                } else if (corners >= 2) {
+                    *index++ = first;
+                    *index++ = previous;
+                    *index++ = current;
+                }
+                previous = current;
+                corners++;
+            }
+            if (corners < 3) {
+                chunk.error = "a face needs at least three vertices";
+                chunk.errorLine = lineNumber;
+                return;
+            }
+        }
+    }
+}
+
+bool MeshLoader::loadPLY(const unsigned char *data, size_t length, TriangleMesh &mesh) {
+    //- The header is text, up to a line reading end_header -//
+    const char *text = (const char*) data;
+    const char *end = text + length;
+    const char *line = text;
+    std::vector<PlyElement> elements;
+    bool bigEndian = false;
+    bool formatGiven = false;
+    const unsigned char *body = NULL;
+
+    for (unsigned lineNumber = 1; line < end && body == NULL; lineNumber++) {
+        const char *lineEnd = (const char*) memchr(line, '\n', end - line);
+        if (lineEnd == NULL)
+            return fail("the header has no end_header");
+
+        std::vector<std::string> words;
+        const char *cursor = line;
+        const char *wordBegin, *wordEnd;
+        while (nextWord(cursor, lineEnd, wordBegin, wordEnd))
+            words.push_back(std::string(wordBegin, wordEnd));
+        line = lineEnd + 1;
+
+        if (lineNumber == 1) {
+            if (words.size() != 1 || words[0] != "ply")
+                return fail("not a PLY file");
+        } else if (words.empty() || words[0] == "comment" || words[0] == "obj_info") {
+            continue;
+        } else if (words[0] == "format" && words.size() >= 2) {
+            if (words[1] == "binary_little_endian")
+                bigEndian = false;
+            else if (words[1] == "binary_big_endian")
+                bigEndian = true;
+            else
+                return fail("only binary PLY files are supported, not " + words[1]);
+            formatGiven = true;
+        } else if (words[0] == "element" && words.size() == 3) {
+            PlyElement element;
+            element.name = words[1];
+            char *countEnd;
+            element.count = strtoull(words[2].c_str(), &countEnd, 10);
+            if (*countEnd != '\0')
+                return fail("bad element count '" + words[2] + "'", lineNumber);
+            elements.push_back(element);
+        } else if (words[0] == "property" && !elements.empty()) {
+            PlyProperty property;
+            property.isList = words.size() == 5 && words[1] == "list";
+            if (!property.isList && words.size() != 3)
+                return fail("bad property", lineNumber);
+            property.countType = property.isList ? plyType(words[2]) : PLY_UNKNOWN;
+            property.type = plyType(words[words.size() - 2]);
+            property.name = words.back();
+            if (property.type == PLY_UNKNOWN || (property.isList && property.countType == PLY_UNKNOWN))
+                return fail("unknown property type", lineNumber);
+            elements.back().properties.push_back(property);
+        } else if (words[0] == "end_header") {
+            body = (const unsigned char*) line;
+        } else {
+            return fail("unexpected '" + words[0] + "' in the header", lineNumber);
+        }
+    }
+    if (body == NULL)
+        return fail("the header has no end_header");
+    if (!formatGiven)
+        return fail("the header has no format");
+
+    const unsigned char *cursor = body;
+    const unsigned char *dataEnd = data + length;
+    for (size_t e = 0; e < elements.size(); e++) {
+        const PlyElement &element = elements[e];
+        bool isVertex = element.name == "vertex";
+        bool isFace = element.name == "face";
+
+        //- Offsets of the coordinates in a vertex, if it has no lists and so a fixed size -//
+        size_t fixedSize = 0;
+        bool hasLists = false;
+        int coordinate[3] = {-1, -1, -1};
+        PlyType coordinateType[3] = {PLY_UNKNOWN, PLY_UNKNOWN, PLY_UNKNOWN};
+        for (size_t p = 0; p < element.properties.size(); p++) {
+            const PlyProperty &property = element.properties[p];
+            hasLists = hasLists || property.isList;
+            for (int axis = 0; axis < 3; axis++) {
+                if (!property.isList && property.name.size() == 1 && property.name[0] == "xyz"[axis]) {
+                    coordinate[axis] = fixedSize;
+                    coordinateType[axis] = property.type;
+                }
+            }
+            fixedSize += property.isList ? 0 : plySize(property.type);
+        }
+
+        if (isVertex) {
+            if (hasLists || coordinate[0] < 0 || coordinate[1] < 0 || coordinate[2] < 0)
+                return fail("vertices need x, y and z and no lists");
+            if (element.count > UINT32_MAX || element.count > (size_t) (dataEnd - cursor) / fixedSize)
+                return fail("the file ends in the vertices");
+
+            mesh.vertices.resize(3 * element.count);
+            float *vertex = mesh.vertices.data();
+            for (size_t i = 0; i < element.count; i++, cursor += fixedSize) {
+                for (int axis = 0; axis < 3; axis++)
+                    *vertex++ = readPly(cursor + coordinate[axis], coordinateType[axis], bigEndian);
+            }
+            continue;
+        }
+
+        if (!hasLists) {
+            if (fixedSize > 0 && element.count > (size_t) (dataEnd - cursor) / fixedSize)
+                return fail("the file ends in the " + element.name + " element");
+            cursor += element.count * fixedSize;
+            continue;
+        }
+
+        /* Elements with lists have to be walked item by item. Faces are
+         * walked twice, first to count their triangles so the index
+         * buffer is sized once, then to fill it in.
+         */
+        size_t numberOfVertices = mesh.vertices.size() / 3;
+        for (int pass = 0; pass < (isFace ? 2 : 1); pass++) {
+            const unsigned char *item = cursor;
+            size_t triangles = 0;
+            uint32_t *index = pass == 1 ? mesh.indices.data() : NULL;
+
+            //- item never passes dataEnd, so dataEnd - item is what is left -//
+            for (size_t i = 0; i < element.count; i++) {
+                for (size_t p = 0; p < element.properties.size(); p++) {
+                    const PlyProperty &property = element.properties[p];
+                    if (!property.isList) {
+                        if ((size_t) (dataEnd - item) < plySize(property.type))
+                            return fail("the file ends in the " + element.name + " element");
+                        item += plySize(property.type);
+                        continue;
+                    }
+
+                    size_t countSize = plySize(property.countType);
+                    if ((size_t) (dataEnd - item) < countSize)
+                        return fail("the file ends in the " + element.name + " element");
+                    double count = readPly(item, property.countType, bigEndian);
+                    item += countSize;
+                    size_t itemSize = plySize(property.type);
+                    if (!(count >= 0) || count > (double) ((size_t) (dataEnd - item) / itemSize))
+                        return fail("the file ends in the " + element.name + " element");
+
+                    bool isIndices = isFace && (property.name == "vertex_indices" || property.name == "vertex_index");
+                    if (isIndices && pass == 0) {
+                        if (count < 3)
+                            return fail("a face needs at least three vertices");
+                        triangles += (size_t) count - 2;
+                    } else if (isIndices) {
+                        uint32_t first = 0, previous = 0;
+                        for (size_t corner = 0; corner < (size_t) count; corner++) {
+                            double value = readPly(item + corner * itemSize, property.type, bigEndian);
+                            if (!(value >= 0 && value < numberOfVertices))
+                                return fail("a face has a bad vertex index");
+
+                            uint32_t current = value;
+                            if (corner == 0) {
+                                first = current;
+                            } else if (corner >= 2) {
+                                *index++ = first;
+                                *index++ = previous;
+                                *index++ = current;
+                            }
+                            previous = current;
+                        }
+                    }
+                    item += (size_t) count * itemSize;
+                }
+            }
+
+            if (pass == 0 && isFace) {
+                if (triangles > UINT32_MAX / 3)
+                    return fail("too many triangles");
+                mesh.indices.resize(3 * triangles);
+            } else {
+                cursor = item;
+            }
+        }
+    }
+    return true;
+}
+
+bool MeshLoader::fail(const std::string &message, unsigned lineNumber) {
+    error = path + ":" + (lineNumber > 0 ? std::to_string(lineNumber) + ":" : "") + " " + message;
+    return false;
+}
+
+MeshLoader::PlyType MeshLoader::plyType(const std::string &name) {
+    if (name == "char" || name == "int8")
+        return PLY_INT8;
+    if (name == "uchar" || name == "uint8")
+        return PLY_UINT8;
+    if (name == "short" || name == "int16")
+        return PLY_INT16;
+    if (name == "ushort" || name == "uint16")
+        return PLY_UINT16;
+    if (name == "int" || name == "int32")
+        return PLY_INT32;
+    if (name == "uint" || name == "uint32")
+        return PLY_UINT32;
+    if (name == "float" || name == "float32")
+        return PLY_FLOAT32;
+    if (name == "double" || name == "float64")
+        return PLY_FLOAT64;
+    return PLY_UNKNOWN;
+}
+
+size_t MeshLoader::plySize(PlyType type) {
+    switch (type) {
+    case PLY_INT8:
+    case PLY_UINT8:
+        return 1;
+    case PLY_INT16:
+    case PLY_UINT16:
+        return 2;
+    case PLY_FLOAT64:
+        return 8;
+    default:
+        return 4;
+    }
+}
+
+//- Reads one value of type, swapping its bytes if the file's order is not the machine's -//
+double MeshLoader::readPly(const unsigned char *data, PlyType type, bool bigEndian) {
+    unsigned char bytes[8];
+    size_t size = plySize(type);
+    uint16_t byteOrderTest = 1;
+    bool machineBigEndian = *(const unsigned char*) &byteOrderTest == 0;
+    if (bigEndian == machineBigEndian) {
+        memcpy(bytes, data, size);
+    } else {
+        for (size_t i = 0; i < size; i++)
+            bytes[i] = data[size - 1 - i];
+    }
+
+    switch (type) {
+    case PLY_INT8: { int8_t value; memcpy(&value, bytes, 1); return value; }
+    case PLY_UINT8: { uint8_t value; memcpy(&value, bytes, 1); return value; }
+    case PLY_INT16: { int16_t value; memcpy(&value, bytes, 2); return value; }
+    case PLY_UINT16: { uint16_t value; memcpy(&value, bytes, 2); return value; }
+    case PLY_INT32: { int32_t value; memcpy(&value, bytes, 4); return value; }
+    case PLY_UINT32: { uint32_t value; memcpy(&value, bytes, 4); return value; }
+    case PLY_FLOAT32: { float value; memcpy(&value, bytes, 4); return value; }
+    case PLY_FLOAT64: { double value; memcpy(&value, bytes, 8); return value; }
+    default: return 0;
+    }
+}
+
+//- The next word between cursor and end, false if only spaces are left -//
+bool MeshLoader::nextWord(const char *&cursor, const char *end, const char *&wordBegin, const char *&wordEnd) {
+    while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+        cursor++;
+    if (cursor == end)
+        return false;
+
+    wordBegin = cursor;
+    while (cursor < end && *cursor != ' ' && *cursor != '\t' && *cursor != '\r')
+        cursor++;
+    wordEnd = cursor;
+    return true;
+}
+
+#endif
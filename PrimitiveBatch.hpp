@@ -0,0 +1,457 @@
+/* Spheres and triangles packed structure-of-arrays style, BATCH_WIDTH to
+ * a batch, and kernels that intersect one ray with whole batches at once.
+ *
+ * Every kernel comes in three versions: plain scalar code, SSE2 and AVX2.
+ * The best one the CPU supports is picked at runtime. All three perform
+ * exactly the same floating point operations in the same order as
+ * Sphere::intersect and Triangle::intersect, so they report bit-identical
+ * hit times. Unused lanes of a batch are filled with copies of lane 0,
+ * which can never win over lane 0 itself.
+ */
+#ifndef PRIMITIVEBATCH_HPP
+#define PRIMITIVEBATCH_HPP
+
+#include "AlignedAllocator.hpp"
+#include "Shape.hpp"
+#include "Vector3.hpp"
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PRIMITIVEBATCH_X86
+#include <immintrin.h>
+
+/* The kernels are written once against these names. SSE_OP(add) is
+ * _mm_add_pd in double builds and _mm_add_ps in float builds, and the same
+ * for AVX_OP with _mm256_.
+ */
+#ifdef RAYTRACER_FLOAT
+typedef __m128 SseReal;
+typedef __m256 AvxReal;
+#define SSE_OP(operation) _mm_##operation##_ps
+#define AVX_OP(operation) _mm256_##operation##_ps
+#else
+typedef __m128d SseReal;
+typedef __m256d AvxReal;
+#define SSE_OP(operation) _mm_##operation##_pd
+#define AVX_OP(operation) _mm256_##operation##_pd
+#endif
+
+const unsigned SSE_LANES = sizeof(SseReal) / sizeof(Real);
+#endif
+
+//- One AVX register of Reals: four doubles, or eight floats -//
+const unsigned BATCH_WIDTH = 32 / sizeof(Real);
+
+//- Smallest hit time the shapes accept, as in Shape.hpp -//
+const Real BATCH_MIN_TIME = HIT_EPSILON;
+
+//- Cache line aligned so the kernels never load a lane split across two lines -//
+struct alignas(CACHE_LINE_SIZE) SphereBatch {
+    Real centerX[BATCH_WIDTH];
+    Real centerY[BATCH_WIDTH];
+    Real centerZ[BATCH_WIDTH];
+    Real radiusSquared[BATCH_WIDTH];
+    const Shape *shapes[BATCH_WIDTH];
+};
+
+struct alignas(CACHE_LINE_SIZE) TriangleBatch {
+    Real vertex1X[BATCH_WIDTH];
+    Real vertex1Y[BATCH_WIDTH];
+    Real vertex1Z[BATCH_WIDTH];
+    //- vertex2 - vertex1 and vertex3 - vertex1 -//
+    Real edge1X[BATCH_WIDTH];
+    Real edge1Y[BATCH_WIDTH];
+    Real edge1Z[BATCH_WIDTH];
+    Real edge2X[BATCH_WIDTH];
+    Real edge2Y[BATCH_WIDTH];
+    Real edge2Z[BATCH_WIDTH];
+    const Shape *shapes[BATCH_WIDTH];
+};
+
+//- A ray, split into components, with the products every test needs -//
+struct BatchRay {
+    BatchRay() {}
+    BatchRay(const Ray &ray);
+
+    Real positionX;
+    Real positionY;
+    Real positionZ;
+    Real directionX;
+    Real directionY;
+    Real directionZ;
+    Real directionSquared;
+};
+
+/* Kernels return the index (batch * BATCH_WIDTH + lane) of the closest
+ * shape hit before closestTime and lower closestTime to its hit time, or
+ * return -1 and leave closestTime alone if nothing is hit.
+ */
+typedef int (*SphereBatchKernel)(const BatchRay &ray, const SphereBatch *batches, unsigned numberOfBatches, Real &closestTime);
+typedef int (*TriangleBatchKernel)(const BatchRay &ray, const TriangleBatch *batches, unsigned numberOfBatches, Real &closestTime);
+
+enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+struct BatchKernels {
+    SimdLevel level;
+    SphereBatchKernel intersectSpheres;
+    TriangleBatchKernel intersectTriangles;
+};
+
+//- Packing -//
+void packSphere(SphereBatch &batch, unsigned lane, const Sphere &sphere);
+void packTriangle(TriangleBatch &batch, unsigned lane, const Triangle &triangle);
+void padSphereBatch(SphereBatch &batch, unsigned usedLanes);
+void padTriangleBatch(TriangleBatch &batch, unsigned usedLanes);
+
+//- Kernel selection -//
+SimdLevel detectSimdLevel();
+BatchKernels getBatchKernels(SimdLevel level);
+
+BatchRay::BatchRay(const Ray &ray) {
+    positionX = ray.position[0];
+    positionY = ray.position[1];
+    positionZ = ray.position[2];
+    directionX = ray.direction[0];
+    directionY = ray.direction[1];
+    directionZ = ray.direction[2];
+    directionSquared = ray.direction * ray.direction;
+}
+
+//- Packing -//
+void packSphere(SphereBatch &batch, unsigned lane, const Sphere &sphere) {
+    batch.centerX[lane] = sphere.position[0];
+    batch.centerY[lane] = sphere.position[1];
+    batch.centerZ[lane] = sphere.position[2];
+    batch.radiusSquared[lane] = sphere.getRadiusSquared();
+    batch.shapes[lane] = &sphere;
+}
+
+void packTriangle(TriangleBatch &batch, unsigned lane, const Triangle &triangle) {
+    const Vector3 &vertex1 = triangle.getVertex1();
+    const Vector3 &edge1 = triangle.getEdge1();
+    const Vector3 &edge2 = triangle.getEdge2();
+
+    batch.vertex1X[lane] = vertex1[0];
+    batch.vertex1Y[lane] = vertex1[1];
+    batch.vertex1Z[lane] = vertex1[2];
+    batch.edge1X[lane] = edge1[0];
+    batch.edge1Y[lane] = edge1[1];
+    batch.edge1Z[lane] = edge1[2];
+    batch.edge2X[lane] = edge2[0];
+    batch.edge2Y[lane] = edge2[1];
+    batch.edge2Z[lane] = edge2[2];
+    batch.shapes[lane] = &triangle;
+}
+
+/* Fills the lanes from usedLanes on with copies of lane 0 */
+void padSphereBatch(SphereBatch &batch, unsigned usedLanes) {
+    for (unsigned lane = usedLanes; lane < BATCH_WIDTH; lane++)
+        packSphere(batch, lane, *static_cast<const Sphere*>(batch.shapes[0]));
+}
+
+void padTriangleBatch(TriangleBatch &batch, unsigned usedLanes) {
+    for (unsigned lane = usedLanes; lane < BATCH_WIDTH; lane++)
+        packTriangle(batch, lane, *static_cast<const Triangle*>(batch.shapes[0]));
+}
+
+//- Scalar Kernels -//
+int intersectSpheresScalar(const BatchRay &ray, const SphereBatch *batches, unsigned numberOfBatches, Real &closestTime) {
+    int closest = -1;
+    for (unsigned i = 0; i < numberOfBatches; i++) {
+        const SphereBatch &batch = batches[i];
+        for (unsigned lane = 0; lane < BATCH_WIDTH; lane++) {
+            Real toRayX = ray.positionX - batch.centerX[lane];
+            Real toRayY = ray.positionY - batch.centerY[lane];
+            Real toRayZ = ray.positionZ - batch.centerZ[lane];
+            Real b = toRayX * ray.directionX + toRayY * ray.directionY + toRayZ * ray.directionZ;
+            Real c = (toRayX * toRayX + toRayY * toRayY + toRayZ * toRayZ) - batch.radiusSquared[lane];
+
+            Real descriminant = b * b - ray.directionSquared * c;
+            if (descriminant >= 0) {
+                Real solution = (-b - sqrt(descriminant)) / ray.directionSquared;
+                if (solution > BATCH_MIN_TIME && solution < closestTime) {
+                    closestTime = solution;
+                    closest = i * BATCH_WIDTH + lane;
+                }
+            }
+        }
+    }
+    return closest;
+}
+
+/* Moller-Trumbore, see Triangle::intersect */
+int intersectTrianglesScalar(const BatchRay &ray, const TriangleBatch *batches, unsigned numberOfBatches, Real &closestTime) {
+    int closest = -1;
+    for (unsigned i = 0; i < numberOfBatches; i++) {
+        const TriangleBatch &batch = batches[i];
+        for (unsigned lane = 0; lane < BATCH_WIDTH; lane++) {
+            Real e1x = batch.edge1X[lane], e1y = batch.edge1Y[lane], e1z = batch.edge1Z[lane];
+            Real e2x = batch.edge2X[lane], e2y = batch.edge2Y[lane], e2z = batch.edge2Z[lane];
+
+            Real px = ray.directionY * e2z - e2y * ray.directionZ;
+            Real py = ray.directionZ * e2x - ray.directionX * e2z;
+            Real pz = ray.directionX * e2y - ray.directionY * e2x;
+            Real determinant = e1x * px + e1y * py + e1z * pz;
+            if (determinant == 0)
+                continue;
+
+            Real inverseDeterminant = 1 / determinant;
+            Real tx = ray.positionX - batch.vertex1X[lane];
+            Real ty = ray.positionY - batch.vertex1Y[lane];
+            Real tz = ray.positionZ - batch.vertex1Z[lane];
+            Real u = (tx * px + ty * py + tz * pz) * inverseDeterminant;
+            if (!(u >= 0 && u <= 1))
+                continue;
+
+            Real qx = ty * e1z - e1y * tz;
+            Real qy = tz * e1x - tx * e1z;
+            Real qz = tx * e1y - ty * e1x;
+            Real v = (ray.directionX * qx + ray.directionY * qy + ray.directionZ * qz) * inverseDeterminant;
+            if (!(v >= 0 && u + v <= 1))
+                continue;
+
+            Real solution = (e2x * qx + e2y * qy + e2z * qz) * inverseDeterminant;
+            if (solution > BATCH_MIN_TIME && solution < closestTime) {
+                closestTime = solution;
+                closest = i * BATCH_WIDTH + lane;
+            }
+        }
+    }
+    return closest;
+}
+
+#ifdef PRIMITIVEBATCH_X86
+//- Picks the closest lane of times (misses hold infinity), as the scalar loop would -//
+static inline int closestLane(const Real *times, unsigned first, unsigned lanes, Real &closestTime, int closest) {
+    for (unsigned lane = 0; lane < lanes; lane++) {
+        if (times[lane] < closestTime) {
+            closestTime = times[lane];
+            closest = first + lane;
+        }
+    }
+    return closest;
+}
+
+//- SSE2 Kernels, SSE_LANES lanes at a time -//
+int intersectSpheresSse2(const BatchRay &ray, const SphereBatch *batches, unsigned numberOfBatches, Real &closestTime) {
+    const SseReal px = SSE_OP(set1)(ray.positionX), py = SSE_OP(set1)(ray.positionY), pz = SSE_OP(set1)(ray.positionZ);
+    const SseReal dx = SSE_OP(set1)(ray.directionX), dy = SSE_OP(set1)(ray.directionY), dz = SSE_OP(set1)(ray.directionZ);
+    const SseReal a = SSE_OP(set1)(ray.directionSquared);
+    const SseReal signBit = SSE_OP(set1)(-0.0);
+    const SseReal zero = SSE_OP(setzero)();
+    const SseReal minTime = SSE_OP(set1)(BATCH_MIN_TIME);
+    const SseReal miss = SSE_OP(set1)(INFINITY);
+
+    int closest = -1;
+    Real times[SSE_LANES];
+    for (unsigned i = 0; i < numberOfBatches; i++) {
+        const SphereBatch &batch = batches[i];
+        for (unsigned lane = 0; lane < BATCH_WIDTH; lane += SSE_LANES) {
+            SseReal tx = SSE_OP(sub)(px, SSE_OP(load)(batch.centerX + lane));
+            SseReal ty = SSE_OP(sub)(py, SSE_OP(load)(batch.centerY + lane));
+            SseReal tz = SSE_OP(sub)(pz, SSE_OP(load)(batch.centerZ + lane));
+
+            SseReal b = SSE_OP(add)(SSE_OP(add)(SSE_OP(mul)(tx, dx), SSE_OP(mul)(ty, dy)), SSE_OP(mul)(tz, dz));
+            SseReal c = SSE_OP(sub)(SSE_OP(add)(SSE_OP(add)(SSE_OP(mul)(tx, tx), SSE_OP(mul)(ty, ty)), SSE_OP(mul)(tz, tz)),
+                                   SSE_OP(load)(batch.radiusSquared + lane));
+
+            SseReal descriminant = SSE_OP(sub)(SSE_OP(mul)(b, b), SSE_OP(mul)(a, c));
+            SseReal solution = SSE_OP(div)(SSE_OP(sub)(SSE_OP(xor)(b, signBit), SSE_OP(sqrt)(descriminant)), a);
+            SseReal hit = SSE_OP(and)(SSE_OP(cmpge)(descriminant, zero), SSE_OP(cmpgt)(solution, minTime));
+            if (SSE_OP(movemask)(hit) == 0)
+                continue;
+
+            SSE_OP(storeu)(times, SSE_OP(or)(SSE_OP(and)(hit, solution), SSE_OP(andnot)(hit, miss)));
+            closest = closestLane(times, i * BATCH_WIDTH + lane, SSE_LANES, closestTime, closest);
+        }
+    }
+    return closest;
+}
+
+int intersectTrianglesSse2(const BatchRay &ray, const TriangleBatch *batches, unsigned numberOfBatches, Real &closestTime) {
+    const SseReal ox = SSE_OP(set1)(ray.positionX), oy = SSE_OP(set1)(ray.positionY), oz = SSE_OP(set1)(ray.positionZ);
+    const SseReal dx = SSE_OP(set1)(ray.directionX), dy = SSE_OP(set1)(ray.directionY), dz = SSE_OP(set1)(ray.directionZ);
+    const SseReal zero = SSE_OP(setzero)();
+    const SseReal one = SSE_OP(set1)(1);
+    const SseReal minTime = SSE_OP(set1)(BATCH_MIN_TIME);
+    const SseReal miss = SSE_OP(set1)(INFINITY);
+
+    int closest = -1;
+    Real times[SSE_LANES];
+    for (unsigned i = 0; i < numberOfBatches; i++) {
+        const TriangleBatch &batch = batches[i];
+        for (unsigned lane = 0; lane < BATCH_WIDTH; lane += SSE_LANES) {
+            SseReal e1x = SSE_OP(load)(batch.edge1X + lane), e1y = SSE_OP(load)(batch.edge1Y + lane), e1z = SSE_OP(load)(batch.edge1Z + lane);
+            SseReal e2x = SSE_OP(load)(batch.edge2X + lane), e2y = SSE_OP(load)(batch.edge2Y + lane), e2z = SSE_OP(load)(batch.edge2Z + lane);
+
+            SseReal px = SSE_OP(sub)(SSE_OP(mul)(dy, e2z), SSE_OP(mul)(e2y, dz));
+            SseReal py = SSE_OP(sub)(SSE_OP(mul)(dz, e2x), SSE_OP(mul)(dx, e2z));
+            SseReal pz = SSE_OP(sub)(SSE_OP(mul)(dx, e2y), SSE_OP(mul)(dy, e2x));
+            SseReal determinant = SSE_OP(add)(SSE_OP(add)(SSE_OP(mul)(e1x, px), SSE_OP(mul)(e1y, py)), SSE_OP(mul)(e1z, pz));
+            SseReal hit = SSE_OP(cmpneq)(determinant, zero);
+            if (SSE_OP(movemask)(hit) == 0)
+                continue;
+
+            SseReal inverseDeterminant = SSE_OP(div)(one, determinant);
+            SseReal tx = SSE_OP(sub)(ox, SSE_OP(load)(batch.vertex1X + lane));
+            SseReal ty = SSE_OP(sub)(oy, SSE_OP(load)(batch.vertex1Y + lane));
+            SseReal tz = SSE_OP(sub)(oz, SSE_OP(load)(batch.vertex1Z + lane));
+            SseReal u = SSE_OP(mul)(SSE_OP(add)(SSE_OP(add)(SSE_OP(mul)(tx, px), SSE_OP(mul)(ty, py)), SSE_OP(mul)(tz, pz)),
+                                   inverseDeterminant);
+            hit = SSE_OP(and)(hit, SSE_OP(and)(SSE_OP(cmpge)(u, zero), SSE_OP(cmple)(u, one)));
+            if (SSE_OP(movemask)(hit) == 0)
+                continue;
+
+            SseReal qx = SSE_OP(sub)(SSE_OP(mul)(ty, e1z), SSE_OP(mul)(e1y, tz));
+            SseReal qy = SSE_OP(sub)(SSE_OP(mul)(tz, e1x), SSE_OP(mul)(tx, e1z));
+            SseReal qz = SSE_OP(sub)(SSE_OP(mul)(tx, e1y), SSE_OP(mul)(ty, e1x));
+            SseReal v = SSE_OP(mul)(SSE_OP(add)(SSE_OP(add)(SSE_OP(mul)(dx, qx), SSE_OP(mul)(dy, qy)), SSE_OP(mul)(dz, qz)),
+                                   inverseDeterminant);
+            SseReal solution = SSE_OP(mul)(SSE_OP(add)(SSE_OP(add)(SSE_OP(mul)(e2x, qx), SSE_OP(mul)(e2y, qy)), SSE_OP(mul)(e2z, qz)),
+                                          inverseDeterminant);
+            hit = SSE_OP(and)(hit, SSE_OP(and)(SSE_OP(cmpge)(v, zero), SSE_OP(cmple)(SSE_OP(add)(u, v), one)));
+            hit = SSE_OP(and)(hit, SSE_OP(cmpgt)(solution, minTime));
+            if (SSE_OP(movemask)(hit) == 0)
+                continue;
+
+            SSE_OP(storeu)(times, SSE_OP(or)(SSE_OP(and)(hit, solution), SSE_OP(andnot)(hit, miss)));
+            closest = closestLane(times, i * BATCH_WIDTH + lane, SSE_LANES, closestTime, closest);
+        }
+    }
+    return closest;
+}
+
+//- AVX2 Kernels, a whole batch at a time -//
+__attribute__((target("avx2")))
+int intersectSpheresAvx2(const BatchRay &ray, const SphereBatch *batches, unsigned numberOfBatches, Real &closestTime) {
+    const AvxReal px = AVX_OP(set1)(ray.positionX), py = AVX_OP(set1)(ray.positionY), pz = AVX_OP(set1)(ray.positionZ);
+    const AvxReal dx = AVX_OP(set1)(ray.directionX), dy = AVX_OP(set1)(ray.directionY), dz = AVX_OP(set1)(ray.directionZ);
+    const AvxReal a = AVX_OP(set1)(ray.directionSquared);
+    const AvxReal signBit = AVX_OP(set1)(-0.0);
+    const AvxReal zero = AVX_OP(setzero)();
+    const AvxReal minTime = AVX_OP(set1)(BATCH_MIN_TIME);
+    const AvxReal miss = AVX_OP(set1)(INFINITY);
+
+    int closest = -1;
+    Real times[BATCH_WIDTH];
+    for (unsigned i = 0; i < numberOfBatches; i++) {
+        const SphereBatch &batch = batches[i];
+        AvxReal tx = AVX_OP(sub)(px, AVX_OP(load)(batch.centerX));
+        AvxReal ty = AVX_OP(sub)(py, AVX_OP(load)(batch.centerY));
+        AvxReal tz = AVX_OP(sub)(pz, AVX_OP(load)(batch.centerZ));
+
+        AvxReal b = AVX_OP(add)(AVX_OP(add)(AVX_OP(mul)(tx, dx), AVX_OP(mul)(ty, dy)), AVX_OP(mul)(tz, dz));
+        AvxReal c = AVX_OP(sub)(AVX_OP(add)(AVX_OP(add)(AVX_OP(mul)(tx, tx), AVX_OP(mul)(ty, ty)),
+                                                AVX_OP(mul)(tz, tz)),
+                                  AVX_OP(load)(batch.radiusSquared));
+
+        AvxReal descriminant = AVX_OP(sub)(AVX_OP(mul)(b, b), AVX_OP(mul)(a, c));
+        AvxReal solution = AVX_OP(div)(AVX_OP(sub)(AVX_OP(xor)(b, signBit), AVX_OP(sqrt)(descriminant)), a);
+        AvxReal hit = AVX_OP(and)(AVX_OP(cmp)(descriminant, zero, _CMP_GE_OQ),
+                                    AVX_OP(cmp)(solution, minTime, _CMP_GT_OQ));
+        if (AVX_OP(movemask)(hit) == 0)
+            continue;
+
+        AVX_OP(storeu)(times, AVX_OP(blendv)(miss, solution, hit));
+        closest = closestLane(times, i * BATCH_WIDTH, BATCH_WIDTH, closestTime, closest);
+    }
+    return closest;
+}
+
+__attribute__((target("avx2")))
+int intersectTrianglesAvx2(const BatchRay &ray, const TriangleBatch *batches, unsigned numberOfBatches, Real &closestTime) {
+    const AvxReal ox = AVX_OP(set1)(ray.positionX), oy = AVX_OP(set1)(ray.positionY), oz = AVX_OP(set1)(ray.positionZ);
+    const AvxReal dx = AVX_OP(set1)(ray.directionX), dy = AVX_OP(set1)(ray.directionY), dz = AVX_OP(set1)(ray.directionZ);
+    const AvxReal zero = AVX_OP(setzero)();
+    const AvxReal one = AVX_OP(set1)(1);
+    const AvxReal minTime = AVX_OP(set1)(BATCH_MIN_TIME);
+    const AvxReal miss = AVX_OP(set1)(INFINITY);
+
+    int closest = -1;
+    Real times[BATCH_WIDTH];
+    for (unsigned i = 0; i < numberOfBatches; i++) {
+        const TriangleBatch &batch = batches[i];
+        AvxReal e1x = AVX_OP(load)(batch.edge1X), e1y = AVX_OP(load)(batch.edge1Y), e1z = AVX_OP(load)(batch.edge1Z);
+        AvxReal e2x = AVX_OP(load)(batch.edge2X), e2y = AVX_OP(load)(batch.edge2Y), e2z = AVX_OP(load)(batch.edge2Z);
+
+        AvxReal px = AVX_OP(sub)(AVX_OP(mul)(dy, e2z), AVX_OP(mul)(e2y, dz));
+        AvxReal py = AVX_OP(sub)(AVX_OP(mul)(dz, e2x), AVX_OP(mul)(dx, e2z));
+        AvxReal pz = AVX_OP(sub)(AVX_OP(mul)(dx, e2y), AVX_OP(mul)(dy, e2x));
+        AvxReal determinant = AVX_OP(add)(AVX_OP(add)(AVX_OP(mul)(e1x, px), AVX_OP(mul)(e1y, py)),
+                                            AVX_OP(mul)(e1z, pz));
+        AvxReal hit = AVX_OP(cmp)(determinant, zero, _CMP_NEQ_UQ);
+        if (AVX_OP(movemask)(hit) == 0)
+            continue;
+
+        AvxReal inverseDeterminant = AVX_OP(div)(one, determinant);
+        AvxReal tx = AVX_OP(sub)(ox, AVX_OP(load)(batch.vertex1X));
+        AvxReal ty = AVX_OP(sub)(oy, AVX_OP(load)(batch.vertex1Y));
+        AvxReal tz = AVX_OP(sub)(oz, AVX_OP(load)(batch.vertex1Z));
+        AvxReal u = AVX_OP(mul)(AVX_OP(add)(AVX_OP(add)(AVX_OP(mul)(tx, px), AVX_OP(mul)(ty, py)),
+                                                AVX_OP(mul)(tz, pz)),
+                                  inverseDeterminant);
+        hit = AVX_OP(and)(hit, AVX_OP(and)(AVX_OP(cmp)(u, zero, _CMP_GE_OQ), AVX_OP(cmp)(u, one, _CMP_LE_OQ)));
+        if (AVX_OP(movemask)(hit) == 0)
+            continue;
+
+        AvxReal qx = AVX_OP(sub)(AVX_OP(mul)(ty, e1z), AVX_OP(mul)(e1y, tz));
+        AvxReal qy = AVX_OP(sub)(AVX_OP(mul)(tz, e1x), AVX_OP(mul)(tx, e1z));
+        AvxReal qz = AVX_OP(sub)(AVX_OP(mul)(tx, e1y), AVX_OP(mul)(ty, e1x));
+        AvxReal v = AVX_OP(mul)(AVX_OP(add)(AVX_OP(add)(AVX_OP(mul)(dx, qx), AVX_OP(mul)(dy, qy)),
+                                                AVX_OP(mul)(dz, qz)),
+                                  inverseDeterminant);
+        AvxReal solution = AVX_OP(mul)(AVX_OP(add)(AVX_OP(add)(AVX_OP(mul)(e2x, qx), AVX_OP(mul)(e2y, qy)),
+                                                       AVX_OP(mul)(e2z, qz)),
+                                         inverseDeterminant);
+        hit = AVX_OP(and)(hit, AVX_OP(and)(AVX_OP(cmp)(v, zero, _CMP_GE_OQ),
+                                               AVX_OP(cmp)(AVX_OP(add)(u, v), one, _CMP_LE_OQ)));
+        hit = AVX_OP(and)(hit, AVX_OP(cmp)(solution, minTime, _CMP_GT_OQ));
+        if (AVX_OP(movemask)(hit) == 0)
+            continue;
+
+        AVX_OP(storeu)(times, AVX_OP(blendv)(miss, solution, hit));
+        closest = closestLane(times, i * BATCH_WIDTH, BATCH_WIDTH, closestTime, closest);
+    }
+    return closest;
+}
+#endif
+
+//- Kernel selection -//
+SimdLevel detectSimdLevel() {
+#ifdef PRIMITIVEBATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE2;
+#endif
+    return SIMD_SCALAR;
+}
+
+/* Returns the kernels for level, or for the best level below it that the CPU supports */
+BatchKernels getBatchKernels(SimdLevel level) {
+    SimdLevel supported = detectSimdLevel();
+    if (level > supported)
+        level = supported;
+
+    BatchKernels kernels;
+    kernels.level = level;
+    kernels.intersectSpheres = intersectSpheresScalar;
+    kernels.intersectTriangles = intersectTrianglesScalar;
+#ifdef PRIMITIVEBATCH_X86
+    if (level == SIMD_SSE2) {
+        kernels.intersectSpheres = intersectSpheresSse2;
+        kernels.intersectTriangles = intersectTrianglesSse2;
+    } else if (level == SIMD_AVX2) {
+        kernels.intersectSpheres = intersectSpheresAvx2;
+        kernels.intersectTriangles = intersectTrianglesAvx2;
+    }
+#endif
+    return kernels;
+}
+
+#endif
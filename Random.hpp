@@ -0,0 +1,78 @@
+/* Counter based random numbers (Philox4x32-10). A number is a pure
+ * function of where it is used: the pixel, the sample within the pixel,
+ * the bounce along the path and the dimension within the bounce. There is
+ * no generator state to lock or to advance, so every thread, tile order
+ * and machine draws the same numbers and renders the same image.
+ */
+#ifndef RANDOM_HPP
+#define RANDOM_HPP
+
+#include "Real.hpp"
+#include <stdint.h>
+
+class RandomSequence {
+public:
+    RandomSequence(uint32_t pixel, uint32_t sample, uint32_t seed);
+
+    //- Uniform in [0, 1) -//
+    Real get(uint32_t bounce, uint32_t dimension) const;
+    //- 128 uniform random bits -//
+    void getBits(uint32_t bounce, uint32_t dimension, uint32_t bits[4]) const;
+
+    //- The raw Philox block for a counter and key -//
+    static void philox(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4]);
+private:
+    uint32_t pixel;
+    uint32_t sample;
+    uint32_t seed;
+};
+
+RandomSequence::RandomSequence(uint32_t pixel, uint32_t sample, uint32_t seed) {
+    this->pixel = pixel;
+    this->sample = sample;
+    this->seed = seed;
+}
+
+Real RandomSequence::get(uint32_t bounce, uint32_t dimension) const {
+    uint32_t bits[4];
+    getBits(bounce, dimension, bits);
+
+    //- As many random bits as the mantissa holds, so the result never rounds up to 1 -//
+    if (REAL_IS_FLOAT)
+        return (Real) ((bits[0] >> 8) * (1.0f / 16777216.0f));
+    uint64_t mantissa = ((uint64_t) (bits[0] >> 5) << 26) | (bits[1] >> 6);
+    return (Real) (mantissa * (1.0 / 9007199254740992.0));
+}
+
+void RandomSequence::getBits(uint32_t bounce, uint32_t dimension, uint32_t bits[4]) const {
+    const uint32_t counter[4] = {pixel, sample, bounce, dimension};
+    const uint32_t key[2] = {seed, 0};
+    philox(counter, key, bits);
+}
+
+void RandomSequence::philox(const uint32_t counter[4], const uint32_t key[2], uint32_t result[4]) {
+    const uint32_t multiplier0 = 0xD2511F53, multiplier1 = 0xCD9E8D57;
+    const uint32_t weyl0 = 0x9E3779B9, weyl1 = 0xBB67AE85;
+
+    uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; round++) {
+        uint64_t product0 = (uint64_t) multiplier0 * c0;
+        uint64_t product1 = (uint64_t) multiplier1 * c2;
+        uint32_t next0 = (uint32_t) (product1 >> 32) ^ c1 ^ k0;
+        uint32_t next2 = (uint32_t) (product0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t) product1;
+        c3 = (uint32_t) product0;
+        c0 = next0;
+        c2 = next2;
+        k0 += weyl0;
+        k1 += weyl1;
+    }
+
+    result[0] = c0;
+    result[1] = c1;
+    result[2] = c2;
+    result[3] = c3;
+}
+
+#endif
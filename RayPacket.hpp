@@ -0,0 +1,151 @@
+/* A packet of up to RAY_PACKET_SIZE coherent rays that are traced
+ * through a BVH together, such as the camera rays of an 8x8 pixel block.
+ *
+ * When every ray of the packet starts at the same point, the packet also
+ * builds a frustum around its rays: four planes through the origin that
+ * enclose every ray. A node whose box lies outside the frustum cannot be
+ * hit by any ray of the packet and is skipped without testing the rays.
+ */
+#ifndef RAYPACKET_HPP
+#define RAYPACKET_HPP
+
+#include "BoundingBox.hpp"
+#include "PrimitiveBatch.hpp"
+#include "Shape.hpp"
+#include "Vector3.hpp"
+#include <math.h>
+#include <limits>
+
+const unsigned RAY_PACKET_SIZE = 64;
+
+struct RayPacket {
+    RayPacket();
+    void addRay(const Ray &ray);
+    void prepare();
+    bool frustumMisses(const BoundingBox &box) const;
+
+    unsigned numberOfRays;
+    Ray rays[RAY_PACKET_SIZE];
+
+    //- Filled in by prepare -//
+    Vector3 inverseDirections[RAY_PACKET_SIZE];
+    BatchRay batchRays[RAY_PACKET_SIZE];
+
+    //- Results of tracing the packet. closestShapes is NULL for rays that hit nothing -//
+    Real closestTimes[RAY_PACKET_SIZE];
+    const Shape *closestShapes[RAY_PACKET_SIZE];
+    unsigned closestPrimitives[RAY_PACKET_SIZE];
+private:
+    bool hasFrustum;
+    Real origin[3];
+    //- Points p inside the frustum have planes[i] * (p - origin) >= 0 for every plane -//
+    Real planes[4][3];
+    //- Axis the rays travel along, and which way -//
+    int axis;
+    Real axisSign;
+};
+
+RayPacket::RayPacket() {
+    numberOfRays = 0;
+    hasFrustum = false;
+}
+
+void RayPacket::addRay(const Ray &ray) {
+    rays[numberOfRays] = ray;
+    numberOfRays++;
+}
+
+/* Precomputes per ray data and the frustum. Call after adding the rays */
+void RayPacket::prepare() {
+    for (unsigned i = 0; i < numberOfRays; i++) {
+        inverseDirections[i] = Vector3(1 / rays[i].direction[0], 1 / rays[i].direction[1], 1 / rays[i].direction[2]);
+        batchRays[i] = BatchRay(rays[i]);
+        closestTimes[i] = INFINITY;
+        closestShapes[i] = NULL;
+        closestPrimitives[i] = 0;
+    }
+
+    hasFrustum = false;
+    if (numberOfRays == 0)
+        return;
+
+    //- The frustum needs a shared origin and every ray heading the same way along one axis -//
+    for (unsigned i = 1; i < numberOfRays; i++) {
+        if (rays[i].position != rays[0].position)
+            return;
+    }
+
+    Vector3 total(0, 0, 0);
+    for (unsigned i = 0; i < numberOfRays; i++)
+        total = total + rays[i].direction;
+
+    axis = 0;
+    for (int i = 1; i < 3; i++) {
+        if (fabs(total[i]) > fabs(total[axis]))
+            axis = i;
+    }
+    axisSign = total[axis] >= 0 ? 1 : -1;
+
+    //- Bound the slopes of the rays against the two other axes -//
+    int uAxis = (axis + 1) % 3;
+    int vAxis = (axis + 2) % 3;
+    Real uMin = INFINITY, uMax = -INFINITY, vMin = INFINITY, vMax = -INFINITY;
+    for (unsigned i = 0; i < numberOfRays; i++) {
+        const Vector3 &direction = rays[i].direction;
+        if (direction[axis] * axisSign <= 0)
+            return;
+
+        Real u = direction[uAxis] / direction[axis];
+        Real v = direction[vAxis] / direction[axis];
+        uMin = fmin(uMin, u);
+        uMax = fmax(uMax, u);
+        vMin = fmin(vMin, v);
+        vMax = fmax(vMax, v);
+    }
+
+    //- Widen by half the digits of Real so rays on the boundary are not lost to rounding -//
+    Real slack = sqrt(std::numeric_limits<Real>::epsilon()) * (1 + fmax(fmax(fabs(uMin), fabs(uMax)), fmax(fabs(vMin), fabs(vMax))));
+    uMin -= slack;
+    uMax += slack;
+    vMin -= slack;
+    vMax += slack;
+
+    //- p - origin = r is inside when uMin <= r[uAxis] / r[axis] <= uMax, and the same for v -//
+    Real bounds[4] = {uMin, -uMax, vMin, -vMax};
+    int planeAxes[4] = {uAxis, uAxis, vAxis, vAxis};
+    for (int i = 0; i < 4; i++) {
+        Real sign = i % 2 == 0 ? 1 : -1;
+        planes[i][0] = planes[i][1] = planes[i][2] = 0;
+        planes[i][planeAxes[i]] = sign * axisSign;
+        planes[i][axis] = -bounds[i] * axisSign;
+    }
+
+    for (int i = 0; i < 3; i++)
+        origin[i] = rays[0].position[i];
+    hasFrustum = true;
+}
+
+/* True if no ray of the packet can hit box */
+bool RayPacket::frustumMisses(const BoundingBox &box) const {
+    if (!hasFrustum)
+        return false;
+
+    //- Entirely behind the origin -//
+    Real nearest = axisSign > 0 ? box.max[axis] - origin[axis] : origin[axis] - box.min[axis];
+    if (nearest < 0)
+        return true;
+
+    //- Entirely outside one of the side planes: test the corner furthest along its normal -//
+    for (int i = 0; i < 4; i++) {
+        Real distance = 0;
+        for (int j = 0; j < 3; j++) {
+            Real corner = planes[i][j] >= 0 ? box.max[j] : box.min[j];
+            distance += planes[i][j] * (corner - origin[j]);
+        }
+        if (distance < 0)
+            return true;
+    }
+    return false;
+}
+
+#endif
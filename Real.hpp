@@ -0,0 +1,41 @@
+/* The scalar type the whole renderer computes in. Builds use double by
+ * default, which is what validation renders should use; compile with
+ * -DRAYTRACER_FLOAT for a float renderer with half the geometry footprint
+ * and twice as many lanes per SIMD register.
+ *
+ * Fixed tolerances are given here for both precisions, so code comparing
+ * against them stays correct whichever one is built.
+ */
+#ifndef REAL_HPP
+#define REAL_HPP
+
+#include <limits>
+
+#ifdef RAYTRACER_FLOAT
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+const bool REAL_IS_FLOAT = sizeof(Real) == sizeof(float);
+
+//- Largest finite Real, for empty bounds -//
+const Real REAL_MAX = std::numeric_limits<Real>::max();
+
+/* Hits closer than this along a ray are ignored, so rays leaving a
+ * surface do not hit it again through rounding. Rays leaving a surface,
+ * shadow and reflection rays alike, have a unit direction, so this is a
+ * distance in scene units, and occluders nearer than it cast no shadow.
+ * On scenes a few thousand units across, a ray leaving a sphere at a
+ * grazing angle can hit it again a few hundredths of a unit away in
+ * float, and about 1e-9 units away in double.
+ */
+const Real HIT_EPSILON = REAL_IS_FLOAT ? 1e-1f : 1e-7;
+
+/* Relative slack for conservative tests such as the box slab test and
+ * packet frustums: a few units in the last place, so rounding never culls
+ * something a ray actually hits.
+ */
+const Real REAL_ROUNDING = 4 * std::numeric_limits<Real>::epsilon();
+
+#endif
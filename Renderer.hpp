@@ -0,0 +1,821 @@
+/* Renders a Scene into a ColorBuffer using every core.
+ * The image is cut into square tiles which are scheduled on a
+ * work-stealing ThreadPool. Each tile renders into its own block of
+ * memory, and tiles are only copied into the shared ColorBuffer once all
+ * of them are done, so workers never write to the same cache lines.
+ *
+ * Every pixel averages samplesPerPixel samples. A sample is one camera
+ * ray through its own point in the pixel, shaded with its own point on
+ * the area light, both chosen by the scene's Sampler, so anti-aliasing
+ * and soft shadows share the same samples.
+ *
+ * With packetTracing on, tiles are further cut into PACKET_WIDTH square
+ * blocks whose camera rays are traced through the scene as one packet.
+ *
+ * Alongside the colors the renderer can keep what each pixel's camera
+ * rays hit first (depth, normal, albedo and shape), to write out and to
+ * guide the Denoiser.
+ *
+ * In progressive mode the whole image is refined a pass at a time instead,
+ * so a usable image exists from the first seconds of the render and the
+ * render can be stopped at any point.
+ *
+ * Rendering into an ImageStream instead goes a band of tiles at a time,
+ * writing each finished band to the file while the next one renders.
+ */
+#ifndef RENDERER_HPP
+#define RENDERER_HPP
+
+#include "AsyncImageWriter.hpp"
+#include "ColorBuffer.hpp"
+#include "Denoiser.hpp"
+#include "ImageStream.hpp"
+#include "Sampler.hpp"
+#include "Scene.hpp"
+#include "ThreadPool.hpp"
+#include "Vector3.hpp"
+#include <signal.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//- Blocks of PACKET_WIDTH * PACKET_WIDTH pixels fill one RayPacket -//
+const unsigned PACKET_WIDTH = 8;
+//- The first progressive preview samples every PREVIEW_STEP-th pixel of every PREVIEW_STEP-th row -//
+const unsigned PREVIEW_STEP = 8;
+
+class Renderer {
+public:
+    Renderer(Scene &scene, unsigned width, unsigned height);
+    void render(ColorBuffer &colorBuffer);
+    /* Renders straight into image, which must be open and width by
+     * height, a band of tileSize rows at a time. Only the band rendering
+     * and the band being written are in memory, so the image can be far
+     * larger than RAM. Progressive rendering, denoising and the extra
+     * images need the whole image and are skipped. Returns false if the
+     * rows could not be written; image is left open for the caller to
+     * close.
+     */
+    bool render(ImageStream &image);
+
+    unsigned tileSize;
+    //- 0 uses every hardware thread -//
+    unsigned numberOfThreads;
+    bool showProgress;
+    //- Trace camera rays in packets instead of one at a time -//
+    bool packetTracing;
+    unsigned samplesPerPixel;
+    /* Adaptive sampling replaces samplesPerPixel: pixels take from
+     * minimumSamples to maximumSamples samples, stopping once the
+     * standard error of their mean luminance (Welford's running variance)
+     * falls to adaptiveThreshold color levels (0 to 255).
+     */
+    bool adaptiveSampling;
+    unsigned minimumSamples;
+    unsigned maximumSamples;
+    Real adaptiveThreshold;
+    /* When set, render also fills it with each pixel's number of samples
+     * as gray levels, 255 being the most any pixel took. Useful for tuning
+     * adaptive sampling. Must be width by height.
+     */
+    ColorBuffer *sampleCountImage;
+    /* When denoising is on the final image is filtered by denoiser, which
+     * lets soft shadows get by with 4 to 8 samples per pixel.
+     */
+    bool denoising;
+    Denoiser denoiser;
+    /* When set, render also fills these with what each pixel's camera
+     * rays hit first: inverse depth as gray levels (white nearest, black
+     * for nothing), normals mapped from [-1, 1] to [0, 255], material colors,
+     * and a color per shape. Each must be width by height.
+     */
+    ColorBuffer *depthImage;
+    ColorBuffer *normalImage;
+    ColorBuffer *albedoImage;
+    ColorBuffer *shapeIdImage;
+    /* Progressive rendering first traces coarse previews, one sample at
+     * every 8th, 4th and then 2nd pixel, each pixel standing in for the
+     * block around it. Every pass after that adds one more sample to each
+     * pixel. The final image is the same as without progressive mode.
+     *
+     * If snapshotFile is not empty, the image so far is written there
+     * after every preview and then every snapshotSamples passes or every
+     * snapshotInterval seconds, whichever is set, in the format its
+     * extension names. Snapshots are encoded on a background thread while
+     * the next pass renders, and are written beside the file and renamed
+     * over it, so a viewer never sees half an image.
+     */
+    bool progressive;
+    std::string snapshotFile;
+    unsigned snapshotSamples;
+    Real snapshotInterval;
+
+    /* Makes a progressive render finish its current packets and return
+     * with the image so far. Safe to call from a signal handler.
+     */
+    static void requestStop();
+    //- Makes Ctrl-C call requestStop -//
+    static void stopOnInterrupt();
+    //- Whether the last render was stopped early -//
+    bool wasStopped() const;
+private:
+    //- The samples a pixel has taken so far -//
+    struct PixelEstimate {
+        PixelEstimate();
+        void add(const Vector3 &color);
+        Vector3 getColor() const;
+        //- Variance of the mean luminance, -1 below two samples -//
+        Real getVariance() const;
+
+        Vector3 totalColor;
+        Real meanLuminance;
+        Real squaredDeviations;
+        unsigned numberOfSamples;
+    };
+
+    struct Tile {
+        unsigned x;
+        unsigned y;
+        unsigned width;
+        unsigned height;
+        std::vector<PixelEstimate> estimates;
+        //- Sums of the samples' surfaces, only kept if needsSurfaces() -//
+        std::vector<Scene::SurfaceInfo> surfaces;
+    };
+
+    //- A band of tiles across the image, rendering into its own rows while streaming -//
+    struct Band {
+        unsigned y;
+        unsigned height;
+        std::vector<Tile> tiles;
+        std::vector<float, CacheAlignedAllocator<float> > colors;
+        ThreadPool::TaskGroup group;
+    };
+
+    Scene &scene;
+    unsigned width;
+    unsigned height;
+    std::atomic<size_t> pixelsDone;
+    std::mutex progressMutex;
+    unsigned lastPercentage;
+    //- Every pixel's samples so far, once the tiles are done or while rendering progressively -//
+    std::vector<PixelEstimate> estimates;
+    std::vector<Scene::SurfaceInfo> surfaces;
+    //- Step of the finest preview finished, 0 if none -//
+    unsigned previewStep;
+    bool stopped;
+    //- Whether rendering into an ImageStream, which keeps no surfaces -//
+    bool streaming;
+    static std::atomic<bool> stopRequested;
+
+    std::vector<Tile> makeTiles(unsigned firstRow, unsigned endRow) const;
+    void renderTile(Tile &tile);
+    void startBand(ThreadPool &pool, Band &band, unsigned y);
+    void storeTile(Tile &tile, Band &band) const;
+    void renderProgressive(ThreadPool &pool, ColorBuffer &colorBuffer);
+    void progressivePass(ThreadPool &pool, std::vector<Tile> &tiles, unsigned step, unsigned targetSamples);
+    void progressiveTile(const Tile &tile, unsigned step, unsigned targetSamples);
+    void samplePixels(const unsigned *pixels, unsigned count);
+    unsigned shownPixel(unsigned column, unsigned row) const;
+    void writeColors(ThreadPool *pool, ColorBuffer &colorBuffer) const;
+    void writeSnapshot(AsyncImageWriter &writer) const;
+    static void interruptHandler(int signal);
+    std::vector<Scene::SurfaceInfo> averageSurfaces() const;
+    void writeSurfaceImages() const;
+    void writeSampleCounts(ColorBuffer &image) const;
+    void renderBlock(Tile &tile, unsigned x, unsigned y, unsigned blockWidth, unsigned blockHeight) const;
+    void renderPixel(unsigned column, unsigned row, PixelEstimate &estimate, Scene::SurfaceInfo *surface) const;
+    bool needsSurfaces() const;
+    static void addSurface(Scene::SurfaceInfo &total, const Scene::SurfaceInfo &surface, unsigned samplesBefore);
+    unsigned sampleLimit() const;
+    bool isConverged(const PixelEstimate &estimate) const;
+    SampleIndex getSampleIndex(unsigned column, unsigned row, unsigned sample) const;
+    void getSamplePosition(const SampleIndex &sample, unsigned column, unsigned row, Real &x, Real &y) const;
+    Real lensX(unsigned column) const;
+    Real lensY(unsigned row) const;
+    unsigned pixelIndex(unsigned column, unsigned row) const;
+    void reportProgress(unsigned pixels);
+};
+
+Renderer::Renderer(Scene &scene, unsigned width, unsigned height) : scene(scene) {
+    this->width = width;
+    this->height = height;
+    tileSize = 32;
+    numberOfThreads = 0;
+    showProgress = true;
+    packetTracing = true;
+    samplesPerPixel = 16;
+    adaptiveSampling = false;
+    minimumSamples = 8;
+    maximumSamples = 256;
+    adaptiveThreshold = 0.5;
+    sampleCountImage = NULL;
+    denoising = false;
+    depthImage = NULL;
+    normalImage = NULL;
+    albedoImage = NULL;
+    shapeIdImage = NULL;
+    progressive = false;
+    snapshotSamples = 0;
+    snapshotInterval = 0;
+    previewStep = 0;
+    stopped = false;
+    streaming = false;
+}
+
+std::atomic<bool> Renderer::stopRequested(false);
+
+void Renderer::render(ColorBuffer &colorBuffer) {
+    scene.build();
+    stopRequested = false;
+    stopped = false;
+    previewStep = 0;
+
+    ThreadPool pool(numberOfThreads);
+    if (progressive) {
+        renderProgressive(pool, colorBuffer);
+        return;
+    }
+
+    std::vector<Tile> tiles = makeTiles(0, height);
+    pixelsDone = 0;
+    lastPercentage = 0;
+
+    ThreadPool::TaskGroup group;
+    for (unsigned i = 0; i < tiles.size(); i++) {
+        Tile *tile = &tiles[i];
+        pool.submit(group, [this, tile] { renderTile(*tile); });
+    }
+    pool.wait(group);
+
+    if (showProgress)
+        std::cout << "\n";
+
+    //- Gather the finished tiles into one image -//
+    estimates.resize(width * height);
+    if (needsSurfaces())
+        surfaces.resize(width * height);
+    for (unsigned i = 0; i < tiles.size(); i++) {
+        const Tile &tile = tiles[i];
+        for (unsigned row = 0; row < tile.height; row++) {
+            for (unsigned column = 0; column < tile.width; column++) {
+                unsigned index = pixelIndex(tile.x + column, tile.y + row);
+                estimates[index] = tile.estimates[row * tile.width + column];
+                if (needsSurfaces())
+                    surfaces[index] = tile.surfaces[row * tile.width + column];
+            }
+        }
+    }
+    std::vector<Tile>().swap(tiles);
+
+    writeColors(&pool, colorBuffer);
+    writeSurfaceImages();
+    if (sampleCountImage != NULL)
+        writeSampleCounts(*sampleCountImage);
+
+    std::vector<PixelEstimate>().swap(estimates);
+    std::vector<Scene::SurfaceInfo>().swap(surfaces);
+}
+
+bool Renderer::render(ImageStream &image) {
+    if (image.getWidth() != width || image.getHeight() != height)
+        return false;
+
+    scene.build();
+    stopRequested = false;
+    stopped = false;
+    previewStep = 0;
+    streaming = true;
+    pixelsDone = 0;
+    lastPercentage = 0;
+
+    //- Each band is written while the one after it renders -//
+    ThreadPool pool(numberOfThreads);
+    Band bands[2];
+    unsigned numberOfBands = (height + tileSize - 1) / tileSize;
+    bool written = true;
+    for (unsigned i = 0; i <= numberOfBands && written; i++) {
+        if (i < numberOfBands)
+            startBand(pool, bands[i % 2], i * tileSize);
+        if (i > 0) {
+            Band &finished = bands[(i - 1) % 2];
+            pool.wait(finished.group);
+            written = image.writeRows(finished.colors.data(), finished.y, finished.height);
+        }
+    }
+
+    //- Once a write fails no more bands are started, the one still rendering is left to finish -//
+    pool.wait(bands[0].group);
+    pool.wait(bands[1].group);
+
+    if (showProgress)
+        std::cout << "\n";
+    streaming = false;
+    return written;
+}
+
+void Renderer::requestStop() {
+    stopRequested = true;
+}
+
+void Renderer::stopOnInterrupt() {
+    signal(SIGINT, interruptHandler);
+}
+
+void Renderer::interruptHandler(int) {
+    requestStop();
+}
+
+bool Renderer::wasStopped() const {
+    return stopped;
+}
+
+//- The tiles covering rows firstRow to endRow -//
+std::vector<Renderer::Tile> Renderer::makeTiles(unsigned firstRow, unsigned endRow) const {
+    std::vector<Tile> tiles;
+    for (unsigned y = firstRow; y < endRow; y += tileSize) {
+        for (unsigned x = 0; x < width; x += tileSize) {
+            Tile tile;
+            tile.x = x;
+            tile.y = y;
+            tile.width = x + tileSize > width ? width - x : tileSize;
+            tile.height = y + tileSize > endRow ? endRow - y : tileSize;
+            tiles.push_back(tile);
+        }
+    }
+    return tiles;
+}
+
+/* Writes the image so far, each pixel averaging its samples. Denoises it
+ * too if denoising is on and pool is not NULL.
+ */
+void Renderer::writeColors(ThreadPool *pool, ColorBuffer &colorBuffer) const {
+    std::vector<Vector3> colors(width * height);
+    for (unsigned row = 0; row < height; row++) {
+        for (unsigned column = 0; column < width; column++)
+            colors[pixelIndex(column, row)] = estimates[shownPixel(column, row)].getColor();
+    }
+
+    if (denoising && pool != NULL) {
+        std::vector<Real> variances(width * height);
+        for (unsigned row = 0; row < height; row++) {
+            for (unsigned column = 0; column < width; column++)
+                variances[pixelIndex(column, row)] = estimates[shownPixel(column, row)].getVariance();
+        }
+        std::vector<Scene::SurfaceInfo> pixelSurfaces = averageSurfaces();
+        denoiser.denoise(*pool, width, height, colors.data(), variances.data(), pixelSurfaces.data(), colors.data());
+    }
+
+    for (unsigned row = 0; row < height; row++) {
+        for (unsigned column = 0; column < width; column++) {
+            const Vector3 &color = colors[pixelIndex(column, row)];
+            colorBuffer.setColorAt(column, row, color[0], color[1], color[2]);
+        }
+    }
+}
+
+//- Each pixel's surface averaged over its samples -//
+std::vector<Scene::SurfaceInfo> Renderer::averageSurfaces() const {
+    std::vector<Scene::SurfaceInfo> averages(width * height);
+    for (unsigned row = 0; row < height; row++) {
+        for (unsigned column = 0; column < width; column++) {
+            unsigned shown = shownPixel(column, row);
+            Scene::SurfaceInfo &average = averages[pixelIndex(column, row)];
+            unsigned samples = estimates[shown].numberOfSamples;
+            if (samples == 0) {
+                average.depth = 0;
+                average.normal(0, 0, 0);
+                average.albedo(0, 0, 0);
+                average.shapeId = 0;
+                continue;
+            }
+
+            Real scale = 1 / (Real) samples;
+            average.depth = surfaces[shown].depth * scale;
+            average.normal = surfaces[shown].normal * scale;
+            average.albedo = surfaces[shown].albedo * scale;
+            average.shapeId = surfaces[shown].shapeId;
+        }
+    }
+    return averages;
+}
+
+void Renderer::writeSurfaceImages() const {
+    if (depthImage == NULL && normalImage == NULL && albedoImage == NULL && shapeIdImage == NULL)
+        return;
+
+    std::vector<Scene::SurfaceInfo> pixelSurfaces = averageSurfaces();
+    Real nearest = REAL_MAX;
+    for (unsigned i = 0; i < pixelSurfaces.size(); i++) {
+        if (pixelSurfaces[i].depth > 0)
+            nearest = std::min(nearest, pixelSurfaces[i].depth);
+    }
+
+    for (unsigned row = 0; row < height; row++) {
+        for (unsigned column = 0; column < width; column++) {
+            const Scene::SurfaceInfo &surface = pixelSurfaces[pixelIndex(column, row)];
+            if (depthImage != NULL) {
+                //- Inverse depth, which keeps detail up close however far the scene reaches -//
+                unsigned level = surface.depth > 0 ? (unsigned) (255 * nearest / surface.depth) : 0;
+                depthImage->setColorAt(column, row, level, level, level);
+            }
+            if (normalImage != NULL) {
+                Vector3 color = (surface.normal + Vector3(1, 1, 1)) * 127.5;
+                normalImage->setColorAt(column, row, color[0], color[1], color[2]);
+            }
+            if (albedoImage != NULL) {
+                Vector3 color = surface.albedo * 255;
+                albedoImage->setColorAt(column, row, color[0], color[1], color[2]);
+            }
+            if (shapeIdImage != NULL) {
+                //- Scatter consecutive IDs over very different colors -//
+                unsigned hash = surface.shapeId * 0x9e3779b9u;
+                if (surface.shapeId == 0)
+                    hash = 0;
+                shapeIdImage->setColorAt(column, row, hash >> 24, (hash >> 16) & 255, (hash >> 8) & 255);
+            }
+        }
+    }
+}
+
+void Renderer::writeSampleCounts(ColorBuffer &image) const {
+    unsigned mostSamples = 1;
+    for (unsigned i = 0; i < estimates.size(); i++)
+        mostSamples = std::max(mostSamples, estimates[i].numberOfSamples);
+
+    for (unsigned row = 0; row < height; row++) {
+        for (unsigned column = 0; column < width; column++) {
+            unsigned level = 255 * estimates[pixelIndex(column, row)].numberOfSamples / mostSamples;
+            image.setColorAt(column, row, level, level, level);
+        }
+    }
+}
+
+void Renderer::renderTile(Tile &tile) {
+    //- Allocated here so the memory is first touched by the worker that fills it -//
+    tile.estimates.resize(tile.width * tile.height);
+    if (needsSurfaces())
+        tile.surfaces.resize(tile.width * tile.height);
+
+    if (packetTracing) {
+        for (unsigned y = 0; y < tile.height; y += PACKET_WIDTH) {
+            for (unsigned x = 0; x < tile.width; x += PACKET_WIDTH) {
+                unsigned blockWidth = x + PACKET_WIDTH > tile.width ? tile.width - x : PACKET_WIDTH;
+                unsigned blockHeight = y + PACKET_WIDTH > tile.height ? tile.height - y : PACKET_WIDTH;
+                renderBlock(tile, x, y, blockWidth, blockHeight);
+            }
+        }
+    } else {
+        for (unsigned row = 0; row < tile.height; row++) {
+            for (unsigned column = 0; column < tile.width; column++) {
+                unsigned index = row * tile.width + column;
+                Scene::SurfaceInfo *surface = needsSurfaces() ? &tile.surfaces[index] : NULL;
+                renderPixel(tile.x + column, tile.y + row, tile.estimates[index], surface);
+            }
+        }
+    }
+
+    reportProgress(tile.width * tile.height);
+}
+
+//- Queues the tiles of the band starting at row y -//
+void Renderer::startBand(ThreadPool &pool, Band &band, unsigned y) {
+    band.y = y;
+    band.height = std::min(tileSize, height - y);
+    band.tiles = makeTiles(y, y + band.height);
+    band.colors.resize((size_t) width * band.height * COLOR_CHANNELS);
+    for (unsigned i = 0; i < band.tiles.size(); i++) {
+        Tile *tile = &band.tiles[i];
+        Band *target = &band;
+        pool.submit(band.group, [this, tile, target] {
+            renderTile(*tile);
+            storeTile(*tile, *target);
+        });
+    }
+}
+
+//- Moves a finished tile's colors into its band, freeing its samples -//
+void Renderer::storeTile(Tile &tile, Band &band) const {
+    for (unsigned row = 0; row < tile.height; row++) {
+        float *pixel = &band.colors[((size_t) (tile.y - band.y + row) * width + tile.x) * COLOR_CHANNELS];
+        for (unsigned column = 0; column < tile.width; column++, pixel += COLOR_CHANNELS) {
+            Vector3 color = tile.estimates[row * tile.width + column].getColor();
+            pixel[0] = color[0];
+            pixel[1] = color[1];
+            pixel[2] = color[2];
+            pixel[3] = 1;
+        }
+    }
+    std::vector<PixelEstimate>().swap(tile.estimates);
+}
+
+/* Renders a block of tile pixels starting at (x, y) within the tile. Each
+ * round traces one more sample of every pixel that still needs one as a
+ * single packet. Gives the same colors as renderPixel.
+ */
+void Renderer::renderBlock(Tile &tile, unsigned x, unsigned y, unsigned blockWidth, unsigned blockHeight) const {
+    Real lensXs[RAY_PACKET_SIZE];
+    Real lensYs[RAY_PACKET_SIZE];
+    SampleIndex samples[RAY_PACKET_SIZE];
+    unsigned packetPixels[RAY_PACKET_SIZE];
+    Vector3 colors[RAY_PACKET_SIZE];
+    Scene::SurfaceInfo packetSurfaces[RAY_PACKET_SIZE];
+    Scene::SurfaceInfo *surfacesWanted = needsSurfaces() ? packetSurfaces : NULL;
+    unsigned count = blockWidth * blockHeight;
+
+    unsigned limit = sampleLimit();
+    for (unsigned sample = 0; sample < limit; sample++) {
+        unsigned packetSize = 0;
+        for (unsigned i = 0; i < count; i++) {
+            unsigned index = (y + i / blockWidth) * tile.width + x + i % blockWidth;
+            if (isConverged(tile.estimates[index]))
+                continue;
+
+            unsigned column = tile.x + x + i % blockWidth;
+            unsigned row = tile.y + y + i / blockWidth;
+            samples[packetSize] = getSampleIndex(column, row, sample);
+            getSamplePosition(samples[packetSize], column, row, lensXs[packetSize], lensYs[packetSize]);
+            packetPixels[packetSize] = index;
+            packetSize++;
+        }
+        if (packetSize == 0)
+            break;
+
+        scene.getColorsAt(lensXs, lensYs, samples, packetSize, colors, surfacesWanted);
+        for (unsigned i = 0; i < packetSize; i++) {
+            PixelEstimate &estimate = tile.estimates[packetPixels[i]];
+            if (surfacesWanted != NULL)
+                addSurface(tile.surfaces[packetPixels[i]], packetSurfaces[i], estimate.numberOfSamples);
+            estimate.add(colors[i]);
+        }
+    }
+}
+
+/* column and row are ColorBuffer coordinates, row 0 being the top of the
+ * image. The pixel's samples are added to estimate, and their surfaces
+ * to surface if it is not NULL.
+ */
+void Renderer::renderPixel(unsigned column, unsigned row, PixelEstimate &estimate, Scene::SurfaceInfo *surface) const {
+    unsigned limit = sampleLimit();
+    for (unsigned sample = 0; sample < limit && !isConverged(estimate); sample++) {
+        SampleIndex sampleIndex = getSampleIndex(column, row, sample);
+        Real x, y;
+        getSamplePosition(sampleIndex, column, row, x, y);
+        Scene::SurfaceInfo sampleSurface;
+        Vector3 color = scene.getColorAt(x, y, sampleIndex, surface != NULL ? &sampleSurface : NULL);
+        if (surface != NULL)
+            addSurface(*surface, sampleSurface, estimate.numberOfSamples);
+        estimate.add(color);
+    }
+}
+
+bool Renderer::needsSurfaces() const {
+    if (streaming)
+        return false;
+    return denoising || depthImage != NULL || normalImage != NULL || albedoImage != NULL || shapeIdImage != NULL;
+}
+
+/* Sums the surfaces of a pixel's samples. The pixel takes the shape of
+ * the first sample that hit one, so pixels on a silhouette are kept apart
+ * from the background by the denoiser.
+ */
+void Renderer::addSurface(Scene::SurfaceInfo &total, const Scene::SurfaceInfo &surface, unsigned samplesBefore) {
+    if (samplesBefore == 0) {
+        total = surface;
+        return;
+    }
+
+    total.depth += surface.depth;
+    total.normal = total.normal + surface.normal;
+    total.albedo = total.albedo + surface.albedo;
+    if (total.shapeId == 0)
+        total.shapeId = surface.shapeId;
+}
+
+//- Progressive -//
+void Renderer::renderProgressive(ThreadPool &pool, ColorBuffer &colorBuffer) {
+    typedef std::chrono::steady_clock Clock;
+
+    estimates.assign(width * height, PixelEstimate());
+    if (needsSurfaces())
+        surfaces.resize(width * height);
+    std::vector<Tile> tiles = makeTiles(0, height);
+    AsyncImageWriter snapshotWriter(numberOfThreads);
+
+    for (unsigned step = PREVIEW_STEP; step > 1 && !stopRequested; step /= 2) {
+        progressivePass(pool, tiles, step, 1);
+        if (stopRequested)
+            break;
+        previewStep = step;
+        writeSnapshot(snapshotWriter);
+    }
+
+    Clock::time_point lastSnapshot = Clock::now();
+    unsigned limit = sampleLimit();
+    for (unsigned pass = 1; pass <= limit && !stopRequested; pass++) {
+        progressivePass(pool, tiles, 1, pass);
+        if (showProgress)
+            std::cout << "\rpass " << pass << " of " << limit << std::flush;
+
+        Real secondsSinceSnapshot = std::chrono::duration<Real>(Clock::now() - lastSnapshot).count();
+        bool snapshotDue = (snapshotSamples > 0 && pass % snapshotSamples == 0)
+                           || (snapshotInterval > 0 && secondsSinceSnapshot >= snapshotInterval);
+        if (snapshotDue && pass < limit && !stopRequested) {
+            writeSnapshot(snapshotWriter);
+            lastSnapshot = Clock::now();
+        }
+    }
+
+    stopped = stopRequested;
+    if (showProgress)
+        std::cout << (stopped ? " (stopped)\n" : "\n");
+
+    writeColors(&pool, colorBuffer);
+    writeSnapshot(snapshotWriter);
+    writeSurfaceImages();
+    if (sampleCountImage != NULL)
+        writeSampleCounts(*sampleCountImage);
+
+    std::vector<PixelEstimate>().swap(estimates);
+    std::vector<Scene::SurfaceInfo>().swap(surfaces);
+}
+
+/* Brings every step-th pixel of every step-th row up to targetSamples
+ * samples, unless it has converged. Tiles are sampled in parallel and
+ * never share pixels.
+ */
+void Renderer::progressivePass(ThreadPool &pool, std::vector<Tile> &tiles, unsigned step, unsigned targetSamples) {
+    ThreadPool::TaskGroup group;
+    for (unsigned i = 0; i < tiles.size(); i++) {
+        const Tile *tile = &tiles[i];
+        pool.submit(group, [this, tile, step, targetSamples] { progressiveTile(*tile, step, targetSamples); });
+    }
+    pool.wait(group);
+}
+
+void Renderer::progressiveTile(const Tile &tile, unsigned step, unsigned targetSamples) {
+    //- Blocks of PACKET_WIDTH by PACKET_WIDTH sampled pixels, so a packet stays coherent -//
+    unsigned blockSize = PACKET_WIDTH * step;
+    unsigned pixels[RAY_PACKET_SIZE];
+    for (unsigned y = tile.y; y < tile.y + tile.height; y += blockSize) {
+        for (unsigned x = tile.x; x < tile.x + tile.width; x += blockSize) {
+            if (stopRequested)
+                return;
+
+            unsigned count = 0;
+            for (unsigned row = y; row < std::min(y + blockSize, tile.y + tile.height); row++) {
+                if (row % step != 0)
+                    continue;
+                for (unsigned column = x; column < std::min(x + blockSize, tile.x + tile.width); column++) {
+                    const PixelEstimate &estimate = estimates[pixelIndex(column, row)];
+                    if (column % step == 0 && estimate.numberOfSamples < targetSamples && !isConverged(estimate))
+                        pixels[count++] = pixelIndex(column, row);
+                }
+            }
+            samplePixels(pixels, count);
+        }
+    }
+}
+
+/* Adds the next sample of each of up to RAY_PACKET_SIZE pixels, given by
+ * their pixelIndex. The samples are the ones a normal render would take.
+ */
+void Renderer::samplePixels(const unsigned *pixels, unsigned count) {
+    Real lensXs[RAY_PACKET_SIZE];
+    Real lensYs[RAY_PACKET_SIZE];
+    SampleIndex samples[RAY_PACKET_SIZE];
+    Vector3 colors[RAY_PACKET_SIZE];
+    Scene::SurfaceInfo packetSurfaces[RAY_PACKET_SIZE];
+    Scene::SurfaceInfo *surfacesWanted = needsSurfaces() ? packetSurfaces : NULL;
+
+    for (unsigned i = 0; i < count; i++) {
+        unsigned column = pixels[i] % width;
+        unsigned row = pixels[i] / width;
+        samples[i] = getSampleIndex(column, row, estimates[pixels[i]].numberOfSamples);
+        getSamplePosition(samples[i], column, row, lensXs[i], lensYs[i]);
+    }
+
+    if (packetTracing && count > 0) {
+        scene.getColorsAt(lensXs, lensYs, samples, count, colors, surfacesWanted);
+    } else {
+        for (unsigned i = 0; i < count; i++)
+            colors[i] = scene.getColorAt(lensXs[i], lensYs[i], samples[i], surfacesWanted != NULL ? packetSurfaces + i : NULL);
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        PixelEstimate &estimate = estimates[pixels[i]];
+        if (surfacesWanted != NULL)
+            addSurface(surfaces[pixels[i]], packetSurfaces[i], estimate.numberOfSamples);
+        estimate.add(colors[i]);
+    }
+}
+
+/* The pixel whose samples a pixel shows: itself, or while it has none
+ * the preview pixel covering it.
+ */
+unsigned Renderer::shownPixel(unsigned column, unsigned row) const {
+    unsigned index = pixelIndex(column, row);
+    if (estimates[index].numberOfSamples > 0 || previewStep == 0)
+        return index;
+    return pixelIndex(column - column % previewStep, row - row % previewStep);
+}
+
+//- Queues the image so far to be written to snapshotFile -//
+void Renderer::writeSnapshot(AsyncImageWriter &writer) const {
+    if (snapshotFile.empty())
+        return;
+
+    ColorBuffer snapshot(width, height);
+    writeColors(NULL, snapshot);
+    writer.write(snapshot, snapshotFile, "");
+}
+
+unsigned Renderer::sampleLimit() const {
+    unsigned limit = adaptiveSampling ? maximumSamples : samplesPerPixel;
+    return limit > 0 ? limit : 1;
+}
+
+bool Renderer::isConverged(const PixelEstimate &estimate) const {
+    unsigned n = estimate.numberOfSamples;
+    if (!adaptiveSampling || n < minimumSamples || n < 2)
+        return false;
+
+    //- variance / n <= threshold^2, with variance = squaredDeviations / (n - 1) -//
+    return estimate.squaredDeviations <= adaptiveThreshold * adaptiveThreshold * n * (n - 1);
+}
+
+SampleIndex Renderer::getSampleIndex(unsigned column, unsigned row, unsigned sample) const {
+    SampleIndex sampleIndex = {pixelIndex(column, row), sample, sampleLimit(), scene.randomSeed};
+    return sampleIndex;
+}
+
+//- The point on the lens plane a sample's camera ray goes through, jittered within the pixel -//
+void Renderer::getSamplePosition(const SampleIndex &sample, unsigned column, unsigned row, Real &x, Real &y) const {
+    Real u, v;
+    scene.getSampler().get2D(sample, 0, SAMPLE_PIXEL, u, v);
+    x = lensX(column) + u;
+    y = lensY(row) + v;
+}
+
+//- Position of a pixel's corner on the lens plane, the image being centered on the camera -//
+Real Renderer::lensX(unsigned column) const {
+    return (int) column - (int) (width / 2);
+}
+
+Real Renderer::lensY(unsigned row) const {
+    return (int) (height / 2) - 1 - (int) row;
+}
+
+//- Pixel Estimates -//
+Renderer::PixelEstimate::PixelEstimate() : totalColor(0, 0, 0) {
+    meanLuminance = 0;
+    squaredDeviations = 0;
+    numberOfSamples = 0;
+}
+
+//- Welford's update of the running mean and variance of the luminance -//
+void Renderer::PixelEstimate::add(const Vector3 &color) {
+    totalColor = totalColor + color;
+    numberOfSamples++;
+
+    Real luminance = 0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2];
+    Real deviation = luminance - meanLuminance;
+    meanLuminance += deviation / numberOfSamples;
+    squaredDeviations += deviation * (luminance - meanLuminance);
+}
+
+Vector3 Renderer::PixelEstimate::getColor() const {
+    if (numberOfSamples == 0)
+        return totalColor;
+    return totalColor * (1 / ((Real) numberOfSamples));
+}
+
+Real Renderer::PixelEstimate::getVariance() const {
+    if (numberOfSamples < 2)
+        return -1;
+    return squaredDeviations / ((Real) numberOfSamples * (numberOfSamples - 1));
+}
+
+//- Keys the random numbers of a pixel, whichever tile or thread renders it -//
+unsigned Renderer::pixelIndex(unsigned column, unsigned row) const {
+    return row * width + column;
+}
+
+void Renderer::reportProgress(unsigned pixels) {
+    size_t done = pixelsDone += pixels;
+    if (!showProgress)
+        return;
+
+    unsigned percentage = (unsigned) (100 * (done / ((double) width * height)));
+    std::lock_guard<std::mutex> lock(progressMutex);
+    if (percentage > lastPercentage) {
+        lastPercentage = percentage;
+        std::cout << "\r" << percentage << "\% complete" << std::flush;
+    }
+}
+
+#endif
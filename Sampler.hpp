@@ -0,0 +1,256 @@
+/* Samplers choose the points that a pixel's samples use, such as where in
+ * the pixel a camera ray goes and where on the area light its shadow ray
+ * goes. RandomSampler draws independent points. The others spread each
+ * pixel's points evenly, so the same noise level needs fewer samples:
+ *
+ *   StratifiedSampler  correlated multi-jittered strata (Kensler 2013)
+ *   HaltonSampler      Halton points, shifted by a random offset per pixel
+ *   SobolSampler       Owen scrambled Sobol points (Burley 2020)
+ *
+ * Every sampler is a pure function of the SampleIndex, bounce and
+ * dimension, so rendering stays deterministic and thread safe.
+ */
+#ifndef SAMPLER_HPP
+#define SAMPLER_HPP
+
+#include "Random.hpp"
+#include "Real.hpp"
+#include <math.h>
+#include <stdint.h>
+
+//- Two dimensional points drawn at every bounce -//
+enum SampleDimension {
+    //- Where in its pixel a camera ray passes, at bounce 0 only -//
+    SAMPLE_PIXEL,
+    SAMPLE_AREA_LIGHT,
+    NUMBER_OF_SAMPLE_DIMENSIONS
+};
+
+/* Identifies one sample of one pixel. A pixel's samples come in
+ * consecutive sets of numberOfSamples (the Renderer uses a single set);
+ * StratifiedSampler spreads the points of each set evenly.
+ */
+struct SampleIndex {
+    uint32_t pixel;
+    uint32_t sample;
+    uint32_t numberOfSamples;
+    uint32_t seed;
+};
+
+class Sampler {
+public:
+    virtual ~Sampler() {}
+    //- The point in [0, 1) x [0, 1) used by a sample for a dimension at a bounce -//
+    virtual void get2D(const SampleIndex &index, uint32_t bounce, uint32_t dimension, Real &u, Real &v) const = 0;
+};
+
+class RandomSampler : public Sampler {
+public:
+    void get2D(const SampleIndex &index, uint32_t bounce, uint32_t dimension, Real &u, Real &v) const;
+};
+
+class StratifiedSampler : public Sampler {
+public:
+    void get2D(const SampleIndex &index, uint32_t bounce, uint32_t dimension, Real &u, Real &v) const;
+private:
+    static uint32_t permute(uint32_t i, uint32_t length, uint32_t pattern);
+};
+
+class HaltonSampler : public Sampler {
+public:
+    void get2D(const SampleIndex &index, uint32_t bounce, uint32_t dimension, Real &u, Real &v) const;
+private:
+    static Real radicalInverse(uint32_t base, uint32_t i);
+};
+
+class SobolSampler : public Sampler {
+public:
+    void get2D(const SampleIndex &index, uint32_t bounce, uint32_t dimension, Real &u, Real &v) const;
+private:
+    static uint32_t sobolSecondDimension(uint32_t i);
+    static uint32_t reverseBits(uint32_t x);
+    static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed);
+};
+
+//- Maps [0, 1)^2 uniformly onto the unit disk, keeping neighbouring points together -//
+void sampleDisk(Real u, Real v, Real &x, Real &y);
+//- 32 random bits as a Real in [0, 1) -//
+Real bitsToReal(uint32_t bits);
+
+//- Random -//
+void RandomSampler::get2D(const SampleIndex &index, uint32_t bounce, uint32_t dimension, Real &u, Real &v) const {
+    RandomSequence random(index.pixel, index.sample, index.seed);
+    u = random.get(bounce, 2 * dimension);
+    v = random.get(bounce, 2 * dimension + 1);
+}
+
+//- Stratified -//
+/* Correlated multi-jittered sampling. The set's points fall at most one
+ * to a cell of an m by n grid, and also at most one to a column and one
+ * to a row of an m * n by m * n grid. Each pixel, set, bounce and
+ * dimension shuffles the points differently, so dimensions are not
+ * correlated with each other.
+ */
+void StratifiedSampler::get2D(const SampleIndex &index, uint32_t bounce, uint32_t dimension, Real &u, Real &v) const {
+    uint32_t count = index.numberOfSamples > 0 ? index.numberOfSamples : 1;
+    uint32_t set = index.sample / count;
+
+    uint32_t patternBits[4];
+    RandomSequence(index.pixel, set, index.seed).getBits(bounce, dimension, patternBits);
+    uint32_t pattern = patternBits[0];
+
+    //- When count is not m * n the set takes a random subset of the cells, which keeps it unbiased -//
+    uint32_t m = (uint32_t) sqrt((double) count);
+    uint32_t n = (count + m - 1) / m;
+    uint32_t s = permute(index.sample % count, m * n, pattern * 0x51633e2d);
+    uint32_t sx = permute(s % m, m, pattern * 0xa511e9b3);
+    uint32_t sy = permute(s / m, n, pattern * 0x63d83595);
+
+    uint32_t jitterBits[4];
+    RandomSequence(index.pixel, index.sample, index.seed).getBits(bounce, dimension, jitterBits);
+    Real jitterX = bitsToReal(jitterBits[0]);
+    Real jitterY = bitsToReal(jitterBits[1]);
+
+    u = (s % m + (sy + jitterX) / n) / m;
+    v = (s / m + (sx + jitterY) / m) / n;
+}
+
+//- A pseudo random permutation of 0 to length - 1, chosen by pattern -//
+uint32_t StratifiedSampler::permute(uint32_t i, uint32_t length, uint32_t pattern) {
+    uint32_t mask = length - 1;
+    mask |= mask >> 1;
+    mask |= mask >> 2;
+    mask |= mask >> 4;
+    mask |= mask >> 8;
+    mask |= mask >> 16;
+
+    //- Permute within the next power of two, walking the cycle until back in range -//
+    do {
+        i ^= pattern;
+        i *= 0xe170893d;
+        i ^= pattern >> 16;
+        i ^= (i & mask) >> 4;
+        i ^= pattern >> 8;
+        i *= 0x0929eb3f;
+        i ^= pattern >> 23;
+        i ^= (i & mask) >> 1;
+        i *= 1 | pattern >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & mask) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & mask) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & mask) >> 2;
+        i *= 0xc860a3df;
+        i &= mask;
+        i ^= i >> 5;
+    } while (i >= length);
+    return (i + pattern) % length;
+}
+
+//- Halton -//
+const uint32_t HALTON_PRIMES[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53};
+const uint32_t NUMBER_OF_HALTON_PRIMES = sizeof(HALTON_PRIMES) / sizeof(HALTON_PRIMES[0]);
+
+/* Each dimension at each bounce takes the next two prime bases. Every
+ * pixel shifts its points by its own random offset, wrapping around, so
+ * neighbouring pixels do not repeat the same pattern.
+ */
+void HaltonSampler::get2D(const SampleIndex &index, uint32_t bounce, uint32_t dimension, Real &u, Real &v) const {
+    uint32_t pair = (bounce * NUMBER_OF_SAMPLE_DIMENSIONS + dimension) % (NUMBER_OF_HALTON_PRIMES / 2);
+    RandomSequence offsets(index.pixel, 0, index.seed);
+
+    u = radicalInverse(HALTON_PRIMES[2 * pair], index.sample) + offsets.get(bounce, 2 * dimension);
+    v = radicalInverse(HALTON_PRIMES[2 * pair + 1], index.sample) + offsets.get(bounce, 2 * dimension + 1);
+    if (u >= 1)
+        u -= 1;
+    if (v >= 1)
+        v -= 1;
+}
+
+//- The digits of i in base, mirrored around the point -//
+Real HaltonSampler::radicalInverse(uint32_t base, uint32_t i) {
+    double inverse = 0;
+    double digitValue = 1.0 / base;
+    while (i > 0) {
+        inverse += (i % base) * digitValue;
+        i /= base;
+        digitValue /= base;
+    }
+    return (Real) fmin(inverse, 1 - std::numeric_limits<Real>::epsilon() / 2);
+}
+
+//- Sobol -//
+/* The first two Sobol dimensions, Owen scrambled with a hash. Each
+ * pixel, bounce and dimension scrambles with its own seeds and also
+ * shuffles the order of the points, which decorrelates dimensions that
+ * all reuse the same two.
+ */
+void SobolSampler::get2D(const SampleIndex &index, uint32_t bounce, uint32_t dimension, Real &u, Real &v) const {
+    uint32_t seeds[4];
+    RandomSequence(index.pixel, 0, index.seed).getBits(bounce, dimension, seeds);
+
+    uint32_t shuffled = nestedUniformScramble(index.sample, seeds[0]);
+    u = bitsToReal(nestedUniformScramble(reverseBits(shuffled), seeds[1]));
+    v = bitsToReal(nestedUniformScramble(sobolSecondDimension(shuffled), seeds[2]));
+}
+
+uint32_t SobolSampler::sobolSecondDimension(uint32_t i) {
+    uint32_t result = 0;
+    for (uint32_t direction = 1u << 31; i > 0; i >>= 1, direction ^= direction >> 1) {
+        if (i & 1)
+            result ^= direction;
+    }
+    return result;
+}
+
+uint32_t SobolSampler::reverseBits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+    x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+//- Flips each bit based on the bits above it, like an Owen scramble -//
+uint32_t SobolSampler::nestedUniformScramble(uint32_t x, uint32_t seed) {
+    x = reverseBits(x);
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return reverseBits(x);
+}
+
+//- Helpers -//
+/* Shirley and Chiu's concentric mapping: squares around the center of
+ * [0, 1)^2 become circles around the center of the disk.
+ */
+void sampleDisk(Real u, Real v, Real &x, Real &y) {
+    Real a = 2 * u - 1;
+    Real b = 2 * v - 1;
+    if (a == 0 && b == 0) {
+        x = y = 0;
+        return;
+    }
+
+    Real radius, angle;
+    if (fabs(a) > fabs(b)) {
+        radius = a;
+        angle = (M_PI / 4) * (b / a);
+    } else {
+        radius = b;
+        angle = M_PI / 2 - (M_PI / 4) * (a / b);
+    }
+    x = radius * cos(angle);
+    y = radius * sin(angle);
+}
+
+Real bitsToReal(uint32_t bits) {
+    if (REAL_IS_FLOAT)
+        return (Real) ((bits >> 8) * (1.0f / 16777216.0f));
+    return (Real) (bits * (1.0 / 4294967296.0));
+}
+
+#endif
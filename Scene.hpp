@@ -1,29 +1,51 @@
 #ifndef SCENE_HPP
 #define SCENE_HPP
 
+#include "AlignedAllocator.hpp"
+#include "BVH.hpp"
+#include "BVHBuilder.hpp"
+#include "Sampler.hpp"
+#include "RayPacket.hpp"
 #include "Shape.hpp"
 #include "Vector3.hpp"
 #include <math.h>
 #include <time.h>
+#include <atomic>
 #include <iostream>
+#include <vector>
+
+//- Longest chain of reflections followed, counting the primary hit -//
+const unsigned MAX_PATH_LENGTH = 16;
 
 class Scene {
 public:
     struct Camera {
         Vector3 direction;
         Vector3 position;
-        double focalLength;
+        Real focalLength;
     };
 
     struct PointLight {
         Vector3 position;
-        double intensity;
+        Real intensity;
     };
 
     struct AreaLight {
         Vector3 position;
-        double radius;
-        double intensity;
+        Real radius;
+        Real intensity;
+    };
+
+    /* What a camera ray hits first, apart from its color. Used to guide
+     * the denoiser and written out as auxiliary images. A ray that hits
+     * nothing has everything 0.
+     */
+    struct SurfaceInfo {
+        Real depth;
+        Vector3 normal;
+        //- The material's color, from 0 to 1 -//
+        Vector3 albedo;
+        unsigned shapeId;
     };
 
     Camera camera;
@@ -31,30 +53,125 @@ public:
     Scene();
     ~Scene();
     void addShape(Shape *shape);
-    Vector3 getColorAt(double x, double y);
+    void transformShape(Shape *shape, Real translateX, Real translateY, Real translateZ,
+                        Real rotateX, Real rotateY, Real rotateZ);
+    void markChanged(Shape *shape);
+    unsigned getNumberOfShapes() const;
+    //- The shapes in the order they were added -//
+    Shape *getShape(unsigned index) const;
+    void setSampler(Sampler *sampler);
+    void build();
+    Vector3 getColorAt(Real x, Real y, const SampleIndex &sample, SurfaceInfo *surface = NULL) const;
+    void getColorsAt(const Real *x, const Real *y, const SampleIndex *samples,
+                     unsigned count, Vector3 *colors, SurfaceInfo *surfaces = NULL) const;
+    const Sampler &getSampler() const;
+    //- Reflections followed after the primary hit, at most MAX_PATH_LENGTH - 1 -//
     int reflectionDepth;
-    int numberOfCasts;
+    //- Light samples averaged per camera ray -//
+    unsigned numberOfCasts;
+    //- Changing the seed gives a different but equally deterministic image -//
+    unsigned randomSeed;
+    //- Settings for building the acceleration structure -//
+    BVHBuilder bvhBuilder;
 private:
     Shape** shapeBuffer;
+    //- Where samples go on the area light. Owned by the scene -//
+    Sampler *sampler;
     unsigned numberOfShapes;
     unsigned shapeBufferSize;
+    //- A plane copied out of its Plane, so planes sit in one contiguous array -//
+    struct PlaneRecord {
+        Real positionX;
+        Real positionY;
+        Real positionZ;
+        Real normalX;
+        Real normalY;
+        Real normalZ;
+        const Shape *shape;
+    };
+
+    //- Bounded shapes live in the BVH, whose leaves keep spheres and triangles in
+    //- per type batches. Planes are tested separately.
+    BVH boundingVolumeHierarchy;
+    std::vector<Plane*> planeShapes;
+    std::vector<PlaneRecord, CacheAlignedAllocator<PlaneRecord> > planes;
+    //- Unbounded shapes of other types -//
+    std::vector<Shape*> unboundedShapes;
+    //- Shapes moved since the last build, and whether shapes were added -//
+    std::vector<Shape*> changedShapes;
+    bool shapesAdded;
+
+    //- The last shape that blocked a shadow ray on this thread. Neighbouring
+    //- shadow rays tend to be blocked by the same shape, so it is tested first.
+    struct OccluderCache {
+        unsigned sceneId;
+        const Shape *shape;
+    };
+    static thread_local OccluderCache lastOccluder;
+    //- Tells apart the scenes sharing lastOccluder, never 0 -//
+    static std::atomic<unsigned> numberOfScenesCreated;
+    unsigned sceneId;
     void resizeShapeBuffer(unsigned newSize);
-    Vector3 castRay(const Ray &ray, unsigned numberOfTimesRecursed, unsigned numberOfCasts) const;
+    void packPlanes();
+    static bool intersectPlane(const PlaneRecord &plane, const Ray &ray, Real &time);
+    bool intersect(const Ray &ray, Shape::Intersection &closestIntersection, const Shape *&closestShape) const;
+    bool intersectUnbounded(const Ray &ray, Shape::Intersection &closestIntersection, const Shape *&closestShape, bool hit) const;
+    bool occluded(const Ray &ray, Real maxTime) const;
+    Ray getCameraRay(Real x, Real y) const;
+
+    //- What a ray sees at one bounce: its hit point and everything shading
+    //- needs there that does not depend on the light sample.
+    struct SurfacePoint {
+        Real distance;
+        Vector3 direction;
+        Vector3 position;
+        Vector3 normal;
+        Vector3 directionToViewer;
+        const Shape *shape;
+    };
+
+    /* The G-buffer of one camera ray: its primary hit followed by the hits
+     * of its reflection rays. Reflection rays do not depend on the light
+     * sample either, so each is traced the first time a cast needs it and
+     * reused by every later cast.
+     */
+    struct SurfacePath {
+        SurfacePoint points[MAX_PATH_LENGTH];
+        //- Points traced so far; the last is a miss if its shape is NULL -//
+        unsigned length;
+    };
+
+    void describeHit(const Ray &ray, const Shape::Intersection &shapeIntersection, const Shape *closestShape,
+                     SurfacePoint &point) const;
+    void startPath(SurfacePath &path, const Ray &ray, const Shape::Intersection &shapeIntersection,
+                   const Shape *closestShape) const;
+    bool tracePath(SurfacePath &path, unsigned bounce) const;
+    static void describeSurface(const SurfacePath *path, SurfaceInfo &surface);
+    Vector3 averageCasts(SurfacePath &path, const SampleIndex &cameraSample) const;
+    Vector3 shade(SurfacePath &path, unsigned bounce, const SampleIndex &sample) const;
 };
 
+thread_local Scene::OccluderCache Scene::lastOccluder = {0, NULL};
+std::atomic<unsigned> Scene::numberOfScenesCreated(0);
+
 Scene::Scene() {
     shapeBufferSize = 2;
     shapeBuffer = new Shape*[shapeBufferSize];
     numberOfShapes = 0;
+    shapesAdded = false;
     reflectionDepth = 3;
-    numberOfCasts = 50;
+    numberOfCasts = 1;
+    randomSeed = 0;
+    sampler = new SobolSampler();
+    sceneId = ++numberOfScenesCreated;
 }
 
 Scene::~Scene() {
-    for (unsigned i = 0; i < shapeBufferSize; i++)
+    for (unsigned i = 0; i < numberOfShapes; i++)
         delete shapeBuffer[i];
 
     delete[] shapeBuffer;
+    delete sampler;
 }
 
 void Scene::addShape(Shape *shape) {
@@ -64,137 +181,381 @@ void Scene::addShape(Shape *shape) {
 
     shapeBuffer[numberOfShapes] = shape;
     numberOfShapes++;
+    shape->id = numberOfShapes;
+    shapesAdded = true;
+    shape->precompute();
+}
+
+/* Transforms a shape that is already in the scene, so that the next
+ * build only refits the acceleration structure around it. Every
+ * Shape::transform precomputes already, which for a mesh means
+ * rebuilding its BVH, so it is not done again here.
+ */
+void Scene::transformShape(Shape *shape, Real translateX, Real translateY, Real translateZ,
+                           Real rotateX, Real rotateY, Real rotateZ) {
+    shape->transform(translateX, translateY, translateZ, rotateX, rotateY, rotateZ);
+    changedShapes.push_back(shape);
+}
+
+/* Tells the scene a shape was changed without going through transformShape */
+void Scene::markChanged(Shape *shape) {
+    shape->precompute();
+    changedShapes.push_back(shape);
+}
+
+unsigned Scene::getNumberOfShapes() const {
+    return numberOfShapes;
+}
+
+Shape *Scene::getShape(unsigned index) const {
+    return shapeBuffer[index];
+}
+
+/* Replaces the sampler, which the scene then owns. SobolSampler is the
+ * default; RandomSampler reproduces plain independent sampling.
+ */
+void Scene::setSampler(Sampler *sampler) {
+    delete this->sampler;
+    this->sampler = sampler;
+}
+
+/* Builds the acceleration structure, or refits it if shapes have only
+ * moved since the last build. Must be called after changing the scene
+ * and before rendering.
+ */
+void Scene::build() {
+    if (!shapesAdded) {
+        bvhBuilder.refit(boundingVolumeHierarchy, changedShapes.data(), changedShapes.size());
+        changedShapes.clear();
+        packPlanes();
+        return;
+    }
+
+    shapesAdded = false;
+    changedShapes.clear();
+
+    std::vector<Shape*> boundedShapes;
+    planeShapes.clear();
+    unboundedShapes.clear();
+    for (unsigned i = 0; i < numberOfShapes; i++) {
+        if (shapeBuffer[i]->isBounded())
+            boundedShapes.push_back(shapeBuffer[i]);
+        else if (shapeBuffer[i]->getType() == SHAPE_PLANE)
+            planeShapes.push_back(static_cast<Plane*>(shapeBuffer[i]));
+        else
+            unboundedShapes.push_back(shapeBuffer[i]);
+    }
+
+    bvhBuilder.build(boundingVolumeHierarchy, boundedShapes.data(), boundedShapes.size());
+    packPlanes();
+}
+
+/* Copies the current geometry of every plane into its record */
+void Scene::packPlanes() {
+    planes.resize(planeShapes.size());
+    for (unsigned i = 0; i < planeShapes.size(); i++) {
+        const Plane &plane = *planeShapes[i];
+        planes[i].positionX = plane.position[0];
+        planes[i].positionY = plane.position[1];
+        planes[i].positionZ = plane.position[2];
+        planes[i].normalX = plane.normal[0];
+        planes[i].normalY = plane.normal[1];
+        planes[i].normalZ = plane.normal[2];
+        planes[i].shape = &plane;
+    }
+}
+
+/* The color seen through (x, y) on the lens plane by one camera sample.
+ * The same sample always gives the same color. If surface is not NULL it
+ * is set to what the camera ray hit.
+ */
+Vector3 Scene::getColorAt(Real x, Real y, const SampleIndex &sample, SurfaceInfo *surface) const {
+    Ray rayFromCameraToLens = getCameraRay(x, y);
+
+    Shape::Intersection shapeIntersection;
+    const Shape *closestShape;
+    if (!intersect(rayFromCameraToLens, shapeIntersection, closestShape)) {
+        if (surface != NULL)
+            describeSurface(NULL, *surface);
+        return Vector3(0, 0, 0);
+    }
+
+    SurfacePath path;
+    startPath(path, rayFromCameraToLens, shapeIntersection, closestShape);
+    if (surface != NULL)
+        describeSurface(&path, *surface);
+    return averageCasts(path, sample);
+}
+
+/* Same as calling getColorAt(x[i], y[i], samples[i], surfaces + i) for each of up to
+ * RAY_PACKET_SIZE points, but the camera rays are traced through the BVH
+ * as one packet. Points close together on the lens plane make the packet
+ * fast.
+ */
+void Scene::getColorsAt(const Real *x, const Real *y, const SampleIndex *samples,
+                        unsigned count, Vector3 *colors, SurfaceInfo *surfaces) const {
+    RayPacket packet;
+    for (unsigned i = 0; i < count; i++)
+        packet.addRay(getCameraRay(x[i], y[i]));
+    packet.prepare();
+    boundingVolumeHierarchy.intersectPacket(packet);
+
+    for (unsigned i = 0; i < count; i++) {
+        const Ray &ray = packet.rays[i];
+        Shape::Intersection shapeIntersection;
+        const Shape *closestShape = packet.closestShapes[i];
+        bool hit = closestShape != NULL;
+        if (hit) {
+            shapeIntersection.time = packet.closestTimes[i];
+            shapeIntersection.intersection = packet.closestTimes[i] * ray.direction + ray.position;
+            shapeIntersection.hit = true;
+            shapeIntersection.primitive = packet.closestPrimitives[i];
+        }
+        hit = intersectUnbounded(ray, shapeIntersection, closestShape, hit);
+
+        colors[i] = Vector3(0, 0, 0);
+        if (hit) {
+            SurfacePath path;
+            startPath(path, ray, shapeIntersection, closestShape);
+            colors[i] = averageCasts(path, samples[i]);
+            if (surfaces != NULL)
+                describeSurface(&path, surfaces[i]);
+        } else if (surfaces != NULL) {
+            describeSurface(NULL, surfaces[i]);
+        }
+    }
 }
 
-Vector3 Scene::getColorAt(double x, double y) {
+/* Averages numberOfCasts casts shading a camera ray's path, which is
+ * traced once and shared by all of them. Cast i of camera sample s shades
+ * as sample s * numberOfCasts + i, so the casts of all the pixel's camera
+ * samples form one sequence.
+ */
+Vector3 Scene::averageCasts(SurfacePath &path, const SampleIndex &cameraSample) const {
+    Vector3 averageColor(0, 0, 0);
+    SampleIndex sample = cameraSample;
+    sample.numberOfSamples = cameraSample.numberOfSamples * numberOfCasts;
+    for (unsigned castsSoFar = 0; castsSoFar < numberOfCasts; castsSoFar++) {
+        sample.sample = cameraSample.sample * numberOfCasts + castsSoFar;
+        averageColor = averageColor + shade(path, 0, sample);
+    }
+
+    averageColor = averageColor * (1 / ((Real) numberOfCasts));
+    return averageColor;
+}
+
+const Sampler &Scene::getSampler() const {
+    return *sampler;
+}
+
+/* The ray from the camera through the point (x, y) on the lens plane */
+Ray Scene::getCameraRay(Real x, Real y) const {
     //- current point on lens plane -//
     Vector3 pointOnLensPlane(x, y, -camera.focalLength);
 
-    //- cast ray -//
     Ray rayFromCameraToLens;
     rayFromCameraToLens.position = camera.position;
     rayFromCameraToLens.direction = pointOnLensPlane.normalise();
+    return rayFromCameraToLens;
+}
 
-    Vector3 averageColor(0, 0, 0);
-    for(unsigned castsSoFar = 0; castsSoFar < numberOfCasts; castsSoFar++) {
-        averageColor = averageColor + castRay(rayFromCameraToLens, 0, castsSoFar);
+/* Fills in point for ray, which hits closestShape at shapeIntersection */
+void Scene::describeHit(const Ray &ray, const Shape::Intersection &shapeIntersection, const Shape *closestShape,
+                        SurfacePoint &point) const {
+    point.distance = shapeIntersection.time;
+    point.direction = ray.direction;
+    point.position = shapeIntersection.intersection;
+    point.normal = getShapeNormalAt(*closestShape, point.position, shapeIntersection.primitive);
+    point.directionToViewer = (camera.position - point.position).normalise();
+    point.shape = closestShape;
+}
+
+/* Starts a path at the primary hit of a camera ray */
+void Scene::startPath(SurfacePath &path, const Ray &ray, const Shape::Intersection &shapeIntersection,
+                      const Shape *closestShape) const {
+    describeHit(ray, shapeIntersection, closestShape, path.points[0]);
+    path.length = 1;
+}
+
+/* Makes sure the path reaches the given bounce by tracing the reflection
+ * ray off the bounce before it. Returns false if that ray hits nothing.
+ */
+bool Scene::tracePath(SurfacePath &path, unsigned bounce) const {
+    if (bounce < path.length)
+        return path.points[bounce].shape != NULL;
+
+    const SurfacePoint &previous = path.points[bounce - 1];
+    Ray rayReflected;
+    rayReflected.position = previous.position;
+    rayReflected.direction = (previous.direction * (-1)).reflectOver(previous.normal);
+
+    SurfacePoint &point = path.points[bounce];
+    path.length = bounce + 1;
+    Shape::Intersection shapeIntersection;
+    const Shape *closestShape;
+    if (!intersect(rayReflected, shapeIntersection, closestShape)) {
+        point.shape = NULL;
+        return false;
     }
 
-    averageColor = averageColor * (1 / ((double) numberOfCasts));
-    return averageColor;
+    describeHit(rayReflected, shapeIntersection, closestShape, point);
+    return true;
+}
+
+/* The primary hit of a path, or a miss if path is NULL */
+void Scene::describeSurface(const SurfacePath *path, SurfaceInfo &surface) {
+    if (path == NULL) {
+        surface.depth = 0;
+        surface.normal(0, 0, 0);
+        surface.albedo(0, 0, 0);
+        surface.shapeId = 0;
+        return;
+    }
+
+    const SurfacePoint &point = path->points[0];
+    const Shape::Material &material = point.shape->material;
+    surface.depth = point.distance;
+    surface.normal = point.normal;
+    surface.albedo(material.red / (Real) 255, material.green / (Real) 255, material.blue / (Real) 255);
+    surface.shapeId = point.shape->id;
 }
 
-//- returns a vector representing color -//
-Vector3 Scene::castRay(const Ray &mainRay, unsigned numberOfTimesRecursed, unsigned numberOfCastsSoFar) const {
-    double disToCenter = areaLight.radius * ((double) rand() / RAND_MAX);
+/* The color of one light sample seen at a bounce along the path */
+Vector3 Scene::shade(SurfacePath &path, unsigned bounce, const SampleIndex &sample) const {
+    //- A point spread uniformly over the light's disk -//
+    Real u, v, diskX, diskZ;
+    sampler->get2D(sample, bounce, SAMPLE_AREA_LIGHT, u, v);
+    sampleDisk(u, v, diskX, diskZ);
     PointLight pointLight;
-    pointLight.position(disToCenter * cos(M_PI * 2 * ((double) rand() / RAND_MAX)),
-                        0,
-                        disToCenter * sin(M_PI * 2 * ((double) rand() / RAND_MAX)));
+    pointLight.position(areaLight.radius * diskX, 0, areaLight.radius * diskZ);
     pointLight.position = pointLight.position + areaLight.position;
     pointLight.intensity = areaLight.intensity;
-    //-find closest intersection/closest shape-//
-    Shape::Intersection shapeIntersection;
-    Shape *closestShape;
-    double distanceFromIntersectionToRay;
-
-    unsigned closestIndex;
-    for (unsigned i = 0; i < numberOfShapes && shapeBuffer[i] != NULL; i++) {
-
-        Shape::Intersection currentShapeIntersection = shapeBuffer[i]->intersect(mainRay);
-
-        if (!currentShapeIntersection.intersection) {
-            //- Do nothing if currentShapeIntersection is undefined. The ray intersected nothing -//
-        } else {
-            double currentDistanceFromIntersectionToRay = (currentShapeIntersection.intersection - mainRay.position) 
-                                                        * (currentShapeIntersection.intersection - mainRay.position);
-
-            if (!shapeIntersection.intersection || currentDistanceFromIntersectionToRay < distanceFromIntersectionToRay) {
-                shapeIntersection = currentShapeIntersection;
-                closestShape = shapeBuffer[i];
-                distanceFromIntersectionToRay = currentDistanceFromIntersectionToRay;
-                closestIndex = i;
-            }
-        }
-    }
 
-    //- if intersected, set cBuffColor -//
-    if (!shapeIntersection.intersection.isUndefined()) {
-        //- We mustn't normalize the directionToLight vector yet, as we need its full length
-        //- to test for shadows.
-        Vector3 directionToLight = (pointLight.position - shapeIntersection.intersection);
-        Ray rayFromShapeToLight;
-        rayFromShapeToLight.position = shapeIntersection.intersection;
-        rayFromShapeToLight.direction = directionToLight;
-
-        bool inShadow = false;
-
-        //- See if light ray intersects with another shape. If so, a shadow must be cast -//
-        for (unsigned i = 0; i < numberOfShapes && shapeBuffer[i] != NULL; i++) {
-            Shape::Intersection lightRayIntersection = shapeBuffer[i]->intersect(rayFromShapeToLight);
-            if (!lightRayIntersection.intersection.isUndefined() && lightRayIntersection.time < 1) {
-                inShadow = true;
-                break;
-            }
-        }
+    const SurfacePoint &point = path.points[bounce];
 
-        //- Now we can normalise the vector from the light to the shapeIntersection -//
-        directionToLight = directionToLight.normalise();
+    //- The shadow ray has a unit direction like every other ray, so HIT_EPSILON is a
+    //- distance for it too, and it ends at the light's distance.
+    Vector3 toLight = (pointLight.position - point.position);
+    Real distanceToLight = sqrt(toLight * toLight);
+    Vector3 directionToLight = toLight.normalise();
+    Ray rayFromShapeToLight;
+    rayFromShapeToLight.position = point.position;
+    rayFromShapeToLight.direction = directionToLight;
 
-        //- if there is no shadow, set cBuffColor -//
-        if (!inShadow) {
-            Vector3 normal = closestShape->getNormalAt(shapeIntersection.intersection);
-            Vector3 lightRayReflected = directionToLight.reflectOver(normal);
-            Vector3 directionToViewer = (camera.position - shapeIntersection.intersection).normalise();
-            Shape::Material material = closestShape->material;
+    //- See if light ray intersects with another shape. If so, a shadow must be cast -//
+    bool inShadow = occluded(rayFromShapeToLight, distanceToLight);
 
-            double diffuseComponent = directionToLight * normal;
+    //- if there is no shadow, set cBuffColor -//
+    if (!inShadow) {
+        Vector3 lightRayReflected = directionToLight.reflectOver(point.normal);
+        const Shape::Material &material = point.shape->material;
 
-            //- using phong illumination -//
-            double illumination = 0;
+        Real diffuseComponent = directionToLight * point.normal;
 
-            if (diffuseComponent > 0) {
-                illumination += material.diffusion * (diffuseComponent) 
-                             +  material.specularity * pow(directionToViewer * lightRayReflected, material.shininess);
-            }
+        //- using phong illumination -//
+        Real illumination = 0;
 
-            illumination *= pointLight.intensity;
+        if (diffuseComponent > 0) {
+            illumination += material.diffusion * (diffuseComponent) 
+                         +  material.specularity * pow(point.directionToViewer * lightRayReflected, material.shininess);
+        }
 
-            double r = material.red * illumination;
-            double g = material.green * illumination;
-            double b = material.blue * illumination;
+        illumination *= pointLight.intensity;
 
-            if (r > 255)
-                r = 255;
-            if (g > 255)
-                g = 255;
-            if (b > 255)
-                b = 255;
+        Real r = material.red * illumination;
+        Real g = material.green * illumination;
+        Real b = material.blue * illumination;
 
-            Vector3 colorVector(r, g, b);
+        //- Not clamped: highlights above 255 are kept until the image is tone mapped -//
+        Vector3 colorVector(r, g, b);
 
-            if (numberOfTimesRecursed < reflectionDepth && material.reflectivity != 0) {
-                Vector3 directionToViewerReflected;
-                directionToViewerReflected = mainRay.direction * (-1);
-                directionToViewerReflected = directionToViewerReflected.reflectOver(normal);
+        if ((int) bounce < reflectionDepth && bounce + 1 < MAX_PATH_LENGTH && material.reflectivity != 0) {
+            Vector3 reflectionColor(0, 0, 0);
+            if (tracePath(path, bounce + 1))
+                reflectionColor = shade(path, bounce + 1, sample);
 
-                Ray rayReflected = mainRay;
-                rayReflected.position = shapeIntersection.intersection;
-                rayReflected.direction = directionToViewerReflected;
+            reflectionColor = reflectionColor * material.reflectivity;
+            colorVector = colorVector * (1 - material.reflectivity);
+            colorVector = colorVector + reflectionColor;
+        }
+
+        return colorVector;
+    } else {
+        Vector3 colorVector(0, 0, 0);
+        return colorVector;
+    }
+}
+
+/* Finds the closest shape hit by ray, returns false if there is none */
+bool Scene::intersect(const Ray &ray, Shape::Intersection &closestIntersection, const Shape *&closestShape) const {
+    bool hit = boundingVolumeHierarchy.intersect(ray, closestIntersection, closestShape);
+    return intersectUnbounded(ray, closestIntersection, closestShape, hit);
+}
 
-                Vector3 reflectionColor = castRay(rayReflected, ++numberOfTimesRecursed, numberOfCastsSoFar) * material.reflectivity;
-                colorVector = colorVector * (1 - material.reflectivity);
-                colorVector = colorVector + reflectionColor;
-            }
+/* Tests the shapes outside the BVH against a hit found so far, if hit is true */
+bool Scene::intersectUnbounded(const Ray &ray, Shape::Intersection &closestIntersection, const Shape *&closestShape, bool hit) const {
+    for (unsigned i = 0; i < planes.size(); i++) {
+        Real time;
+        if (intersectPlane(planes[i], ray, time) && (!hit || time < closestIntersection.time)) {
+            closestIntersection.time = time;
+            closestIntersection.intersection = time * ray.direction + ray.position;
+            closestIntersection.hit = true;
+            closestIntersection.primitive = 0;
+            closestShape = planes[i].shape;
+            hit = true;
+        }
+    }
 
-            return colorVector;
-        } else {
-            Vector3 colorVector(0, 0, 0);
-            return colorVector;
+    for (unsigned i = 0; i < unboundedShapes.size(); i++) {
+        Shape::Intersection intersection = unboundedShapes[i]->intersect(ray);
+        if (intersection.hit && (!hit || intersection.time < closestIntersection.time)) {
+            closestIntersection = intersection;
+            closestShape = unboundedShapes[i];
+            hit = true;
         }
     }
-    Vector3 backgroundVector(0, 0, 0);
-    return backgroundVector;
+    return hit;
+}
+
+/* Returns true if any shape is hit by ray before maxTime. Stops at the
+ * first shape found, and starts with the last one found on this thread.
+ */
+bool Scene::occluded(const Ray &ray, Real maxTime) const {
+    OccluderCache &cache = lastOccluder;
+    if (cache.sceneId == sceneId && occludedByShape(*cache.shape, ray, maxTime))
+        return true;
+
+    const Shape *occluder = NULL;
+    for (unsigned i = 0; i < planes.size() && occluder == NULL; i++) {
+        Real time;
+        if (intersectPlane(planes[i], ray, time) && time < maxTime)
+            occluder = planes[i].shape;
+    }
+
+    for (unsigned i = 0; i < unboundedShapes.size() && occluder == NULL; i++) {
+        if (unboundedShapes[i]->occluded(ray, maxTime))
+            occluder = unboundedShapes[i];
+    }
+
+    if (occluder == NULL && !boundingVolumeHierarchy.occluded(ray, maxTime, occluder))
+        return false;
+
+    cache.sceneId = sceneId;
+    cache.shape = occluder;
+    return true;
+}
+
+/* Plane::intersect on a PlaneRecord, doing the same arithmetic in the same order */
+bool Scene::intersectPlane(const PlaneRecord &plane, const Ray &ray, Real &time) {
+    Real denominator = plane.normalX * ray.direction[0] + plane.normalY * ray.direction[1] + plane.normalZ * ray.direction[2];
+    if (denominator == 0)
+        return false;
+
+    Real distance = plane.normalX * (ray.position[0] - plane.positionX)
+                    + plane.normalY * (ray.position[1] - plane.positionY)
+                    + plane.normalZ * (ray.position[2] - plane.positionZ);
+    time = -distance / denominator;
+    return time > HIT_EPSILON;
 }
 
 void Scene::resizeShapeBuffer(unsigned newSize) {
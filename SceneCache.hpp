@@ -0,0 +1,508 @@
+/* Saves a parsed scene to a binary file that later runs load instead of
+ * the scene file, for scenes rendered again and again. The file is mapped
+ * with a single mmap and meshes use their vertices, indices and built BVH
+ * straight from it, so loading does no parsing or building and costs the
+ * same for a mesh of a million triangles as for one of ten.
+ *
+ * Every reference in the file is an offset from its start, so it can be
+ * mapped anywhere. It holds:
+ * -a Header, with the camera, light and image size
+ * -a ShapeRecord per shape, in the order the shapes were added
+ * -a ShapeRecord per mesh that instances share, which they refer to by index
+ * -the paths of the mesh files the scene loaded
+ * -every mesh's vertices, indices and BVH nodes, each 64 byte aligned
+ *
+ * Spheres, planes, triangles and instances are stored as records and made
+ * again, since shapes are objects with virtual functions; the scene's own
+ * BVH is rebuilt over them. Heavy geometry belongs in meshes, and a mesh
+ * shared by many instances is stored once.
+ *
+ * A cache is only loaded if it was saved by this version of the format,
+ * on a machine of the same byte order, from the scene file as it is now.
+ * The header holds a hash of the scene file's contents and of the path,
+ * size and modification time of each mesh file, which is compared first.
+ */
+#ifndef SCENECACHE_HPP
+#define SCENECACHE_HPP
+
+#include "Instance.hpp"
+#include "MappedFile.hpp"
+#include "Scene.hpp"
+#include "SceneParser.hpp"
+#include "Shape.hpp"
+#include "TriangleMesh.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+class SceneCache {
+public:
+    SceneCache();
+
+    /* Adds the shapes saved in cachePath to scene and sets its camera and
+     * light, if the cache was saved from sceneFile as it is now. Returns
+     * false, leaving scene as it was, if there is no such cache; getError
+     * then says why.
+     */
+    bool load(const std::string &cachePath, const std::string &sceneFile, Scene &scene);
+    //- Saves scene, just loaded from sceneFile by parser, to cachePath -//
+    bool save(const std::string &cachePath, const std::string &sceneFile, const SceneParser &parser, const Scene &scene);
+    const std::string &getError() const;
+
+    //- The image size saved with the scene, set by load as SceneParser sets it -//
+    unsigned width;
+    unsigned height;
+private:
+    enum RecordType {
+        RECORD_SPHERE,
+        RECORD_PLANE,
+        RECORD_TRIANGLE,
+        RECORD_MESH,
+        RECORD_INSTANCE
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        //- SCENE_CACHE_BYTE_ORDER, in the byte order of the machine that saved it -//
+        uint32_t byteOrder;
+        uint64_t sourceHash;
+        uint64_t fileSize;
+        uint32_t width;
+        uint32_t height;
+        uint32_t numberOfShapes;
+        uint32_t numberOfMeshFiles;
+        uint32_t numberOfObjects;
+        uint32_t padding;
+        uint64_t shapesOffset;
+        uint64_t objectsOffset;
+        uint64_t meshFilesOffset;
+        double cameraPosition[3];
+        double cameraDirection[3];
+        double focalLength;
+        double lightPosition[3];
+        double lightRadius;
+        double lightIntensity;
+    };
+
+    struct ShapeRecord {
+        uint32_t type;
+        uint32_t color[3];
+        double specularity;
+        double diffusion;
+        double shininess;
+        double reflectivity;
+        double center[3];
+        //- Spheres: position and radius. Planes: position and normal. Triangles: their vertices -//
+        double geometry[9];
+        //- Meshes only -//
+        uint32_t numberOfVertices;
+        uint32_t numberOfTriangles;
+        uint32_t numberOfNodes;
+        //- Instances only: the index of their object's record, and the top three rows of objectToWorld -//
+        uint32_t object;
+        uint64_t verticesOffset;
+        uint64_t indicesOffset;
+        uint64_t nodesOffset;
+        double transform[12];
+    };
+
+    std::string error;
+
+    bool fail(const std::string &message);
+    bool hashSource(const std::string &sceneFile, const std::vector<std::string> &meshFiles, uint64_t &sourceHash);
+    bool checkRecord(const ShapeRecord &record, size_t fileSize, unsigned numberOfObjects) const;
+
+    static uint64_t layoutMesh(const TriangleMesh &mesh, ShapeRecord &record, uint64_t offset);
+    static bool writeMesh(FILE *file, uint64_t &position, const ShapeRecord &record, const TriangleMesh &mesh);
+    static TriangleMesh *loadMesh(const ShapeRecord &record, const std::shared_ptr<MappedFile> &file);
+    static bool writeAt(FILE *file, uint64_t &position, uint64_t offset, const void *data, size_t size);
+    static uint64_t align(uint64_t offset);
+    static uint64_t hash(const void *data, size_t length, uint64_t seed);
+    static void storeVector(const Vector3 &vector, double *values);
+    static Vector3 loadVector(const double *values);
+};
+
+const char SCENE_CACHE_MAGIC[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+//- Bump whenever the layout of the file or of anything stored in it changes -//
+const uint32_t SCENE_CACHE_VERSION = 2;
+const uint32_t SCENE_CACHE_BYTE_ORDER = 0x01020304;
+const uint64_t SCENE_CACHE_ALIGNMENT = 64;
+
+SceneCache::SceneCache() {
+    width = 0;
+    height = 0;
+}
+
+bool SceneCache::load(const std::string &cachePath, const std::string &sceneFile, Scene &scene) {
+    error.clear();
+    std::shared_ptr<MappedFile> file(new MappedFile);
+    if (!file->open(cachePath))
+        return fail("could not open " + cachePath);
+
+    //- The mapping starts on a page boundary, so the header can be read in place -//
+    const unsigned char *data = file->getData();
+    size_t size = file->getSize();
+    if (size < sizeof(Header) || memcmp(data, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC)) != 0)
+        return fail(cachePath + " is not a scene cache");
+
+    const Header &header = *(const Header*) data;
+    if (header.version != SCENE_CACHE_VERSION || header.byteOrder != SCENE_CACHE_BYTE_ORDER)
+        return fail(cachePath + " was saved by another version or machine");
+    if (header.fileSize != size || header.shapesOffset % 8 != 0
+        || header.shapesOffset > size || header.numberOfShapes > (size - header.shapesOffset) / sizeof(ShapeRecord)
+        || header.objectsOffset % 8 != 0
+        || header.objectsOffset > size || header.numberOfObjects > (size - header.objectsOffset) / sizeof(ShapeRecord)
+        || header.meshFilesOffset > size)
+        return fail(cachePath + " is damaged");
+
+    std::vector<std::string> meshFiles;
+    uint64_t position = header.meshFilesOffset;
+    for (unsigned i = 0; i < header.numberOfMeshFiles; i++) {
+        uint32_t length;
+        if (size - position < sizeof(length))
+            return fail(cachePath + " is damaged");
+        memcpy(&length, data + position, sizeof(length));
+        position += sizeof(length);
+        if (size - position < length)
+            return fail(cachePath + " is damaged");
+        meshFiles.push_back(std::string((const char*) data + position, length));
+        position += length;
+    }
+
+    uint64_t sourceHash;
+    if (!hashSource(sceneFile, meshFiles, sourceHash))
+        return false;
+    if (sourceHash != header.sourceHash)
+        return fail(cachePath + " is out of date");
+
+    const ShapeRecord *records = (const ShapeRecord*) (data + header.shapesOffset);
+    const ShapeRecord *objectRecords = (const ShapeRecord*) (data + header.objectsOffset);
+    for (unsigned i = 0; i < header.numberOfShapes; i++) {
+        if (!checkRecord(records[i], size, header.numberOfObjects))
+            return fail(cachePath + " is damaged");
+    }
+    for (unsigned i = 0; i < header.numberOfObjects; i++) {
+        if (objectRecords[i].type != RECORD_MESH || !checkRecord(objectRecords[i], size, 0))
+            return fail(cachePath + " is damaged");
+    }
+
+    //- Everything checks out, only now is the scene touched -//
+    std::vector<std::shared_ptr<const TriangleMesh> > objects(header.numberOfObjects);
+    for (unsigned i = 0; i < header.numberOfObjects; i++)
+        objects[i].reset(loadMesh(objectRecords[i], file));
+
+    for (unsigned i = 0; i < header.numberOfShapes; i++) {
+        const ShapeRecord &record = records[i];
+        const double *geometry = record.geometry;
+        Shape *shape;
+        if (record.type == RECORD_SPHERE) {
+            shape = new Sphere(loadVector(geometry), geometry[3]);
+        } else if (record.type == RECORD_PLANE) {
+            shape = new Plane(loadVector(geometry), loadVector(geometry + 3));
+        } else if (record.type == RECORD_TRIANGLE) {
+            shape = new Triangle(loadVector(geometry), loadVector(geometry + 3), loadVector(geometry + 6));
+        } else if (record.type == RECORD_INSTANCE) {
+            const double *t = record.transform;
+            Instance *instance = new Instance(objects[record.object]);
+            instance->objectToWorld = Matrix(t[0], t[1], t[2], t[3],
+                                             t[4], t[5], t[6], t[7],
+                                             t[8], t[9], t[10], t[11],
+                                             0, 0, 0, 1);
+            shape = instance;
+        } else {
+            shape = loadMesh(record, file);
+        }
+
+        shape->material.red = record.color[0];
+        shape->material.green = record.color[1];
+        shape->material.blue = record.color[2];
+        shape->material.specularity = record.specularity;
+        shape->material.diffusion = record.diffusion;
+        shape->material.shininess = record.shininess;
+        shape->material.reflectivity = record.reflectivity;
+        shape->center = loadVector(record.center);
+        scene.addShape(shape);
+    }
+
+    scene.camera.position = loadVector(header.cameraPosition);
+    scene.camera.direction = loadVector(header.cameraDirection);
+    scene.camera.focalLength = header.focalLength;
+    scene.areaLight.position = loadVector(header.lightPosition);
+    scene.areaLight.radius = header.lightRadius;
+    scene.areaLight.intensity = header.lightIntensity;
+    width = header.width;
+    height = header.height;
+    return true;
+}
+
+bool SceneCache::save(const std::string &cachePath, const std::string &sceneFile, const SceneParser &parser,
+                      const Scene &scene) {
+    error.clear();
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC));
+    header.version = SCENE_CACHE_VERSION;
+    header.byteOrder = SCENE_CACHE_BYTE_ORDER;
+    if (!hashSource(sceneFile, parser.meshFiles, header.sourceHash))
+        return false;
+
+    header.width = parser.width;
+    header.height = parser.height;
+    header.numberOfShapes = scene.getNumberOfShapes();
+    header.numberOfMeshFiles = parser.meshFiles.size();
+
+    //- Each mesh that instances share is stored once, in the order first used -//
+    std::vector<const TriangleMesh*> objects;
+    std::map<const Shape*, unsigned> objectIndices;
+    for (unsigned i = 0; i < header.numberOfShapes; i++) {
+        const Instance *instance = dynamic_cast<const Instance*>(scene.getShape(i));
+        if (instance == NULL || objectIndices.count(instance->object.get()) > 0)
+            continue;
+
+        const TriangleMesh *mesh = dynamic_cast<const TriangleMesh*>(instance->object.get());
+        if (mesh == NULL)
+            return fail("the scene has shapes that cannot be cached");
+        objectIndices[mesh] = objects.size();
+        objects.push_back(mesh);
+    }
+    header.numberOfObjects = objects.size();
+    storeVector(scene.camera.position, header.cameraPosition);
+    storeVector(scene.camera.direction, header.cameraDirection);
+    header.focalLength = scene.camera.focalLength;
+    storeVector(scene.areaLight.position, header.lightPosition);
+    header.lightRadius = scene.areaLight.radius;
+    header.lightIntensity = scene.areaLight.intensity;
+
+    //- Lay the file out first, so it can be written front to back -//
+    uint64_t offset = align(sizeof(Header));
+    header.shapesOffset = offset;
+    offset += header.numberOfShapes * sizeof(ShapeRecord);
+    header.objectsOffset = offset;
+    offset += header.numberOfObjects * sizeof(ShapeRecord);
+    header.meshFilesOffset = offset;
+    for (size_t i = 0; i < parser.meshFiles.size(); i++)
+        offset += sizeof(uint32_t) + parser.meshFiles[i].size();
+
+    std::vector<ShapeRecord> records(header.numberOfShapes);
+    for (unsigned i = 0; i < header.numberOfShapes; i++) {
+        const Shape *shape = scene.getShape(i);
+        ShapeRecord &record = records[i];
+        memset(&record, 0, sizeof(record));
+        record.color[0] = shape->material.red;
+        record.color[1] = shape->material.green;
+        record.color[2] = shape->material.blue;
+        record.specularity = shape->material.specularity;
+        record.diffusion = shape->material.diffusion;
+        record.shininess = shape->material.shininess;
+        record.reflectivity = shape->material.reflectivity;
+        storeVector(shape->center, record.center);
+
+        if (const Sphere *sphere = dynamic_cast<const Sphere*>(shape)) {
+            record.type = RECORD_SPHERE;
+            storeVector(sphere->position, record.geometry);
+            record.geometry[3] = sphere->radius;
+        } else if (const Plane *plane = dynamic_cast<const Plane*>(shape)) {
+            record.type = RECORD_PLANE;
+            storeVector(plane->position, record.geometry);
+            storeVector(plane->normal, record.geometry + 3);
+        } else if (const Triangle *triangle = dynamic_cast<const Triangle*>(shape)) {
+            record.type = RECORD_TRIANGLE;
+            storeVector(triangle->getVertex1(), record.geometry);
+            storeVector(triangle->getVertex2(), record.geometry + 3);
+            storeVector(triangle->getVertex3(), record.geometry + 6);
+        } else if (const TriangleMesh *mesh = dynamic_cast<const TriangleMesh*>(shape)) {
+            offset = layoutMesh(*mesh, record, offset);
+        } else if (const Instance *instance = dynamic_cast<const Instance*>(shape)) {
+            record.type = RECORD_INSTANCE;
+            record.object = objectIndices[instance->object.get()];
+            for (int row = 0; row < 3; row++) {
+                Vector4 values = instance->objectToWorld.getRowVector(row);
+                for (int column = 0; column < 4; column++)
+                    record.transform[4 * row + column] = values[column];
+            }
+        } else {
+            return fail("the scene has shapes that cannot be cached");
+        }
+    }
+
+    std::vector<ShapeRecord> objectRecords(header.numberOfObjects);
+    for (unsigned i = 0; i < header.numberOfObjects; i++) {
+        memset(&objectRecords[i], 0, sizeof(ShapeRecord));
+        offset = layoutMesh(*objects[i], objectRecords[i], offset);
+    }
+    header.fileSize = offset;
+
+    //- Written beside the cache and renamed over it, so a failed save leaves the old one -//
+    std::string partialPath = cachePath + ".partial";
+    FILE *file = fopen(partialPath.c_str(), "wb");
+    if (file == NULL)
+        return fail("could not write " + cachePath);
+
+    uint64_t position = 0;
+    bool written = writeAt(file, position, 0, &header, sizeof(header))
+                   && writeAt(file, position, header.shapesOffset, records.data(), records.size() * sizeof(ShapeRecord))
+                   && writeAt(file, position, header.objectsOffset, objectRecords.data(),
+                              objectRecords.size() * sizeof(ShapeRecord));
+    for (size_t i = 0; i < parser.meshFiles.size() && written; i++) {
+        uint32_t length = parser.meshFiles[i].size();
+        written = writeAt(file, position, position, &length, sizeof(length))
+                  && writeAt(file, position, position, parser.meshFiles[i].data(), length);
+    }
+    for (unsigned i = 0; i < header.numberOfShapes && written; i++) {
+        if (records[i].type == RECORD_MESH)
+            written = writeMesh(file, position, records[i], *static_cast<const TriangleMesh*>(scene.getShape(i)));
+    }
+    for (unsigned i = 0; i < header.numberOfObjects && written; i++)
+        written = writeMesh(file, position, objectRecords[i], *objects[i]);
+
+    written = fclose(file) == 0 && written && position == header.fileSize;
+    if (!written || rename(partialPath.c_str(), cachePath.c_str()) != 0) {
+        remove(partialPath.c_str());
+        return fail("could not write " + cachePath);
+    }
+    return true;
+}
+
+const std::string &SceneCache::getError() const {
+    return error;
+}
+
+bool SceneCache::fail(const std::string &message) {
+    error = message;
+    return false;
+}
+
+/* Hashes the scene file's contents, and the path, size and modification
+ * time of every mesh file, which are too large to read on every load.
+ */
+bool SceneCache::hashSource(const std::string &sceneFile, const std::vector<std::string> &meshFiles, uint64_t &sourceHash) {
+    MappedFile scene;
+    if (!scene.open(sceneFile))
+        return fail("could not read " + sceneFile);
+    sourceHash = hash(scene.getData(), scene.getSize(), SCENE_CACHE_VERSION);
+
+    for (size_t i = 0; i < meshFiles.size(); i++) {
+        struct stat status;
+        if (stat(meshFiles[i].c_str(), &status) != 0)
+            return fail("could not read " + meshFiles[i]);
+
+        uint64_t stamp[3] = {(uint64_t) status.st_size, (uint64_t) status.st_mtim.tv_sec, (uint64_t) status.st_mtim.tv_nsec};
+        sourceHash = hash(meshFiles[i].data(), meshFiles[i].size(), sourceHash);
+        sourceHash = hash(stamp, sizeof(stamp), sourceHash);
+    }
+    return true;
+}
+
+/* Whether a record's type is known, its mesh data lies inside the file,
+ * aligned, and an instance's object is one of the numberOfObjects saved.
+ */
+bool SceneCache::checkRecord(const ShapeRecord &record, size_t fileSize, unsigned numberOfObjects) const {
+    if (record.type == RECORD_INSTANCE)
+        return record.object < numberOfObjects;
+    if (record.type != RECORD_MESH)
+        return record.type <= RECORD_TRIANGLE;
+
+    uint64_t verticesSize = 3 * (uint64_t) record.numberOfVertices * sizeof(float);
+    uint64_t indicesSize = 3 * (uint64_t) record.numberOfTriangles * sizeof(uint32_t);
+    uint64_t nodesSize = (uint64_t) record.numberOfNodes * sizeof(TriangleMesh::Node);
+    return record.verticesOffset % SCENE_CACHE_ALIGNMENT == 0 && record.indicesOffset % SCENE_CACHE_ALIGNMENT == 0
+           && record.nodesOffset % SCENE_CACHE_ALIGNMENT == 0
+           && record.verticesOffset <= fileSize && verticesSize <= fileSize - record.verticesOffset
+           && record.indicesOffset <= fileSize && indicesSize <= fileSize - record.indicesOffset
+           && record.nodesOffset <= fileSize && nodesSize <= fileSize - record.nodesOffset
+           && (record.numberOfNodes > 0) == (record.numberOfTriangles > 0);
+}
+
+//- Fills in a mesh's record, placing its data from offset on, and returns the offset after it -//
+uint64_t SceneCache::layoutMesh(const TriangleMesh &mesh, ShapeRecord &record, uint64_t offset) {
+    record.type = RECORD_MESH;
+    record.numberOfVertices = mesh.numberOfVertices;
+    record.numberOfTriangles = mesh.numberOfTriangles;
+    record.numberOfNodes = mesh.numberOfNodes;
+    record.verticesOffset = align(offset);
+    offset = record.verticesOffset + 3 * (uint64_t) record.numberOfVertices * sizeof(float);
+    record.indicesOffset = align(offset);
+    offset = record.indicesOffset + 3 * (uint64_t) record.numberOfTriangles * sizeof(uint32_t);
+    record.nodesOffset = align(offset);
+    return record.nodesOffset + (uint64_t) record.numberOfNodes * sizeof(TriangleMesh::Node);
+}
+
+bool SceneCache::writeMesh(FILE *file, uint64_t &position, const ShapeRecord &record, const TriangleMesh &mesh) {
+    return writeAt(file, position, record.verticesOffset, mesh.vertexData,
+                   3 * (size_t) record.numberOfVertices * sizeof(float))
+           && writeAt(file, position, record.indicesOffset, mesh.indexData,
+                      3 * (size_t) record.numberOfTriangles * sizeof(uint32_t))
+           && writeAt(file, position, record.nodesOffset, mesh.nodeData,
+                      (size_t) record.numberOfNodes * sizeof(TriangleMesh::Node));
+}
+
+//- A mesh reading its data in place from file, which it keeps mapped -//
+TriangleMesh *SceneCache::loadMesh(const ShapeRecord &record, const std::shared_ptr<MappedFile> &file) {
+    const unsigned char *data = file->getData();
+    TriangleMesh *mesh = new TriangleMesh;
+    mesh->vertexData = (const float*) (data + record.verticesOffset);
+    mesh->indexData = (const uint32_t*) (data + record.indicesOffset);
+    mesh->nodeData = (const TriangleMesh::Node*) (data + record.nodesOffset);
+    mesh->numberOfVertices = record.numberOfVertices;
+    mesh->numberOfTriangles = record.numberOfTriangles;
+    mesh->numberOfNodes = record.numberOfNodes;
+    mesh->mappedData = file;
+    return mesh;
+}
+
+//- Writes data at offset, padding with zeros from position, which it moves past the data -//
+bool SceneCache::writeAt(FILE *file, uint64_t &position, uint64_t offset, const void *data, size_t size) {
+    static const char zeros[SCENE_CACHE_ALIGNMENT] = {0};
+    if (offset < position || offset - position > SCENE_CACHE_ALIGNMENT)
+        return false;
+    if (fwrite(zeros, 1, offset - position, file) != offset - position)
+        return false;
+    if (size > 0 && fwrite(data, 1, size, file) != size)
+        return false;
+    position = offset + size;
+    return true;
+}
+
+uint64_t SceneCache::align(uint64_t offset) {
+    return (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT * SCENE_CACHE_ALIGNMENT;
+}
+
+/* Hashes eight bytes at a step, so even a large scene file hashes at
+ * several gigabytes a second, and finishes with the SplitMix64 mixer.
+ */
+uint64_t SceneCache::hash(const void *data, size_t length, uint64_t seed) {
+    const unsigned char *bytes = (const unsigned char*) data;
+    uint64_t state = seed ^ (length * 0x9e3779b97f4a7c15ULL);
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        state = (state ^ word * 0xc2b2ae3d27d4eb4fULL) * 0x9e3779b97f4a7c15ULL;
+        state = (state << 31) | (state >> 33);
+    }
+    uint64_t last = 0;
+    if (i < length)
+        memcpy(&last, bytes + i, length - i);
+    state = (state ^ last * 0xc2b2ae3d27d4eb4fULL) * 0x9e3779b97f4a7c15ULL;
+
+    state = (state ^ (state >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    state = (state ^ (state >> 27)) * 0x94d049bb133111ebULL;
+    return state ^ (state >> 31);
+}
+
+void SceneCache::storeVector(const Vector3 &vector, double *values) {
+    for (int i = 0; i < 3; i++)
+        values[i] = vector[i];
+}
+
+Vector3 SceneCache::loadVector(const double *values) {
+    return Vector3(values[0], values[1], values[2]);
+}
+
+#endif
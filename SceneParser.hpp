@@ -0,0 +1,471 @@
+/* Reads scenes from text files, one statement per line. Everything after
+ * a '#' is a comment. Angles are in radians.
+ *
+ *   image <width> <height>
+ *   camera <x y z> <direction x y z> <focal length>
+ *   light <x y z> <radius> <intensity>
+ *   material <name> <red> <green> <blue> [specularity <s>] [diffusion <d>]
+ *            [shininess <n>] [reflectivity <r>]
+ *   use <material name>
+ *   sphere <x y z> <radius>
+ *   plane <x y z> <normal x y z>
+ *   triangle <x1 y1 z1> <x2 y2 z2> <x3 y3 z3>
+ *   mesh <.obj or .ply file, relative to the scene file>
+ *   object <name>
+ *   end
+ *   instance <object name>
+ *   center <x y z>
+ *   transform <translate x y z> <rotate x y z>
+ *
+ * Shapes take the material last named by use, or the default Material.
+ * center and transform apply to the shape defined last, as Shape::center
+ * and Shape::transform do; a mesh's center starts at the middle of its bounds.
+ *
+ * The triangle and mesh statements between object and end make up one
+ * TriangleMesh, which is not drawn itself but by each instance of it: an
+ * Instance shares the object's geometry and places it with a matrix, so
+ * copies of an object cost no more memory however large it is. An
+ * instance's center starts at the middle of the object's bounds, and its
+ * material is the one in use, as for other shapes.
+ *
+ * The file is mapped into memory and parsed in place: tokens are pointers
+ * into the mapping and numbers are converted without copying them, so the
+ * only allocations are the shapes themselves.
+ */
+#ifndef SCENEPARSER_HPP
+#define SCENEPARSER_HPP
+
+#include "DecimalParser.hpp"
+#include "Instance.hpp"
+#include "MappedFile.hpp"
+#include "MeshLoader.hpp"
+#include "Scene.hpp"
+#include "Shape.hpp"
+#include "TriangleMesh.hpp"
+#include "Vector3.hpp"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+class SceneParser {
+public:
+    SceneParser();
+
+    /* Adds the file's shapes to scene and sets its camera and light.
+     * Returns false if the file could not be read or has an error, which
+     * getError then describes.
+     */
+    bool load(const std::string &path, Scene &scene);
+    //- As load, for a scene already in memory. fileName is used in errors and to find mesh files -//
+    bool parse(const char *text, size_t length, Scene &scene, const std::string &fileName = "scene");
+    const std::string &getError() const;
+
+    //- Set by the image statement, 0 if there was none -//
+    unsigned width;
+    unsigned height;
+    //- The mesh files the scene loaded, as they were opened -//
+    std::vector<std::string> meshFiles;
+private:
+    //- A piece of the text, not terminated -//
+    struct Token {
+        const char *begin;
+        const char *end;
+
+        bool operator==(const char *word) const;
+    };
+
+    struct NamedMaterial {
+        std::string name;
+        Shape::Material material;
+    };
+
+    struct NamedObject {
+        std::string name;
+        std::shared_ptr<const TriangleMesh> mesh;
+    };
+
+    const char *cursor;
+    const char *lineEnd;
+    unsigned lineNumber;
+    std::string fileName;
+    std::string error;
+    std::vector<NamedMaterial> materials;
+    Shape::Material currentMaterial;
+    Shape *lastShape;
+    std::vector<NamedObject> objects;
+    //- The object between object and end, NULL outside of one -//
+    std::shared_ptr<TriangleMesh> openObject;
+    std::string openObjectName;
+
+    bool parseStatement(const Token &keyword, Scene &scene);
+    bool parseObjectStatement(const Token &keyword);
+    bool parseMaterial();
+    bool parseMesh(Scene &scene);
+    bool parseInstance(Scene &scene);
+    bool loadMesh(TriangleMesh &mesh);
+    bool nextToken(Token &token);
+    bool readReal(Real &value);
+    bool readVector(Vector3 &vector);
+    bool readUnsigned(unsigned &value);
+    bool fail(const std::string &message);
+    void addShape(Shape *shape, Scene &scene);
+    static bool parseReal(const Token &token, Real &value);
+};
+
+SceneParser::SceneParser() {
+    width = 0;
+    height = 0;
+    cursor = NULL;
+    lineEnd = NULL;
+    lineNumber = 0;
+    lastShape = NULL;
+}
+
+bool SceneParser::load(const std::string &path, Scene &scene) {
+    MappedFile file;
+    if (!file.open(path))
+        return fail("could not read " + path);
+    if (file.getSize() == 0)
+        return parse("", 0, scene, path);
+
+    file.advise(MADV_SEQUENTIAL);
+    return parse((const char*) file.getData(), file.getSize(), scene, path);
+}
+
+bool SceneParser::parse(const char *text, size_t length, Scene &scene, const std::string &fileName) {
+    this->fileName = fileName;
+    error.clear();
+    materials.clear();
+    meshFiles.clear();
+    objects.clear();
+    openObject.reset();
+    currentMaterial = Shape::Material();
+    lastShape = NULL;
+    lineNumber = 0;
+
+    const char *end = text + length;
+    for (const char *line = text; line < end; line = lineEnd + 1) {
+        lineNumber++;
+        lineEnd = (const char*) memchr(line, '\n', end - line);
+        if (lineEnd == NULL)
+            lineEnd = end;
+        cursor = line;
+
+        Token keyword;
+        if (!nextToken(keyword))
+            continue;
+        if (!parseStatement(keyword, scene))
+            return false;
+
+        Token extra;
+        if (nextToken(extra))
+            return fail("unexpected '" + std::string(extra.begin, extra.end) + "'");
+    }
+
+    if (openObject != NULL)
+        return fail("object '" + openObjectName + "' has no end");
+    return true;
+}
+
+const std::string &SceneParser::getError() const {
+    return error;
+}
+
+bool SceneParser::parseStatement(const Token &keyword, Scene &scene) {
+    if (openObject != NULL)
+        return parseObjectStatement(keyword);
+
+    if (keyword == "sphere") {
+        Vector3 position;
+        Real radius;
+        if (!readVector(position) || !readReal(radius))
+            return false;
+        addShape(new Sphere(position, radius), scene);
+    } else if (keyword == "triangle") {
+        Vector3 vertex1, vertex2, vertex3;
+        if (!readVector(vertex1) || !readVector(vertex2) || !readVector(vertex3))
+            return false;
+        addShape(new Triangle(vertex1, vertex2, vertex3), scene);
+    } else if (keyword == "mesh") {
+        return parseMesh(scene);
+    } else if (keyword == "instance") {
+        return parseInstance(scene);
+    } else if (keyword == "object") {
+        Token name;
+        if (!nextToken(name))
+            return fail("expected an object name");
+        openObjectName.assign(name.begin, name.end);
+        openObject.reset(new TriangleMesh);
+    } else if (keyword == "end") {
+        return fail("end outside of an object");
+    } else if (keyword == "plane") {
+        Vector3 position, normal;
+        if (!readVector(position) || !readVector(normal))
+            return false;
+        addShape(new Plane(position, normal), scene);
+    } else if (keyword == "use") {
+        Token name;
+        if (!nextToken(name))
+            return fail("expected a material name");
+        unsigned i = 0;
+        while (i < materials.size() && !(name == materials[i].name.c_str()))
+            i++;
+        if (i == materials.size())
+            return fail("unknown material '" + std::string(name.begin, name.end) + "'");
+        currentMaterial = materials[i].material;
+    } else if (keyword == "center") {
+        Vector3 center;
+        if (!readVector(center))
+            return false;
+        if (lastShape == NULL)
+            return fail("center before any shape");
+        lastShape->center = center;
+    } else if (keyword == "transform") {
+        Vector3 translation, rotation;
+        if (!readVector(translation) || !readVector(rotation))
+            return false;
+        if (lastShape == NULL)
+            return fail("transform before any shape");
+        scene.transformShape(lastShape, translation[0], translation[1], translation[2],
+                             rotation[0], rotation[1], rotation[2]);
+    } else if (keyword == "material") {
+        return parseMaterial();
+    } else if (keyword == "camera") {
+        Scene::Camera camera;
+        if (!readVector(camera.position) || !readVector(camera.direction) || !readReal(camera.focalLength))
+            return false;
+        scene.camera = camera;
+    } else if (keyword == "light") {
+        Scene::AreaLight light;
+        if (!readVector(light.position) || !readReal(light.radius) || !readReal(light.intensity))
+            return false;
+        scene.areaLight = light;
+    } else if (keyword == "image") {
+        if (!readUnsigned(width) || !readUnsigned(height))
+            return false;
+    } else {
+        return fail("unknown statement '" + std::string(keyword.begin, keyword.end) + "'");
+    }
+    return true;
+}
+
+bool SceneParser::parseMaterial() {
+    NamedMaterial named;
+    Token name;
+    if (!nextToken(name))
+        return fail("expected a material name");
+    named.name.assign(name.begin, name.end);
+    if (!readUnsigned(named.material.red) || !readUnsigned(named.material.green) || !readUnsigned(named.material.blue))
+        return false;
+
+    Token property;
+    while (nextToken(property)) {
+        Real *value;
+        if (property == "specularity")
+            value = &named.material.specularity;
+        else if (property == "diffusion")
+            value = &named.material.diffusion;
+        else if (property == "shininess")
+            value = &named.material.shininess;
+        else if (property == "reflectivity")
+            value = &named.material.reflectivity;
+        else
+            return fail("unknown material property '" + std::string(property.begin, property.end) + "'");
+        if (!readReal(*value))
+            return false;
+    }
+
+    //- A later definition replaces an earlier one of the same name -//
+    for (unsigned i = 0; i < materials.size(); i++) {
+        if (materials[i].name == named.name) {
+            materials[i] = named;
+            return true;
+        }
+    }
+    materials.push_back(named);
+    return true;
+}
+
+//- The statements allowed between object and end, which add to the open object -//
+bool SceneParser::parseObjectStatement(const Token &keyword) {
+    std::vector<float> &vertices = openObject->vertices;
+    std::vector<uint32_t> &indices = openObject->indices;
+
+    if (keyword == "triangle") {
+        Vector3 corners[3];
+        if (!readVector(corners[0]) || !readVector(corners[1]) || !readVector(corners[2]))
+            return false;
+
+        //- The last two are swapped, so the triangle faces the way a Triangle shape would -//
+        uint32_t first = vertices.size() / 3;
+        for (int i = 0; i < 3; i++) {
+            for (int axis = 0; axis < 3; axis++)
+                vertices.push_back(corners[i][axis]);
+        }
+        indices.push_back(first);
+        indices.push_back(first + 2);
+        indices.push_back(first + 1);
+    } else if (keyword == "mesh") {
+        TriangleMesh mesh;
+        if (!loadMesh(mesh))
+            return false;
+
+        //- A mesh's indices count from its own first vertex -//
+        uint32_t first = vertices.size() / 3;
+        if (first == 0) {
+            vertices.swap(mesh.vertices);
+            indices.swap(mesh.indices);
+        } else {
+            vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+            for (size_t i = 0; i < mesh.indices.size(); i++)
+                indices.push_back(first + mesh.indices[i]);
+        }
+    } else if (keyword == "end") {
+        if (indices.empty())
+            return fail("object '" + openObjectName + "' has no triangles");
+        openObject->precompute();
+
+        //- A later definition replaces an earlier one, instances made already keep the old one -//
+        NamedObject named;
+        named.name = openObjectName;
+        named.mesh = openObject;
+        openObject.reset();
+        for (unsigned i = 0; i < objects.size(); i++) {
+            if (objects[i].name == named.name) {
+                objects[i] = named;
+                return true;
+            }
+        }
+        objects.push_back(named);
+    } else {
+        return fail("'" + std::string(keyword.begin, keyword.end) + "' cannot be inside an object");
+    }
+    return true;
+}
+
+bool SceneParser::parseMesh(Scene &scene) {
+    TriangleMesh *mesh = new TriangleMesh;
+    if (!loadMesh(*mesh)) {
+        delete mesh;
+        return false;
+    }
+
+    mesh->center = mesh->getBounds().centroid();
+    addShape(mesh, scene);
+    return true;
+}
+
+bool SceneParser::parseInstance(Scene &scene) {
+    Token name;
+    if (!nextToken(name))
+        return fail("expected an object name");
+
+    unsigned i = 0;
+    while (i < objects.size() && !(name == objects[i].name.c_str()))
+        i++;
+    if (i == objects.size())
+        return fail("unknown object '" + std::string(name.begin, name.end) + "'");
+    addShape(new Instance(objects[i].mesh), scene);
+    return true;
+}
+
+//- Loads the file named by the next token into mesh, which it must not leave empty -//
+bool SceneParser::loadMesh(TriangleMesh &mesh) {
+    Token file;
+    if (!nextToken(file))
+        return fail("expected a mesh file");
+
+    //- Relative paths are taken from the scene file's directory -//
+    std::string path(file.begin, file.end);
+    size_t slash = fileName.rfind('/');
+    if (path[0] != '/' && slash != std::string::npos)
+        path = fileName.substr(0, slash + 1) + path;
+
+    MeshLoader loader;
+    if (!loader.load(path, mesh))
+        return fail(loader.getError());
+    if (mesh.indices.empty())
+        return fail(path + " has no triangles");
+
+    meshFiles.push_back(path);
+    return true;
+}
+
+void SceneParser::addShape(Shape *shape, Scene &scene) {
+    shape->material = currentMaterial;
+    scene.addShape(shape);
+    lastShape = shape;
+}
+
+//- The next token on the current line, false at its end or at a comment -//
+bool SceneParser::nextToken(Token &token) {
+    while (cursor < lineEnd && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+        cursor++;
+    if (cursor == lineEnd || *cursor == '#')
+        return false;
+
+    token.begin = cursor;
+    while (cursor < lineEnd && *cursor != ' ' && *cursor != '\t' && *cursor != '\r' && *cursor != '#')
+        cursor++;
+    token.end = cursor;
+    return true;
+}
+
+bool SceneParser::readReal(Real &value) {
+    Token token;
+    if (!nextToken(token))
+        return fail("expected a number");
+    if (!parseReal(token, value))
+        return fail("'" + std::string(token.begin, token.end) + "' is not a number");
+    return true;
+}
+
+bool SceneParser::readVector(Vector3 &vector) {
+    Real x, y, z;
+    if (!readReal(x) || !readReal(y) || !readReal(z))
+        return false;
+    vector(x, y, z);
+    return true;
+}
+
+bool SceneParser::readUnsigned(unsigned &value) {
+    Token token;
+    if (!nextToken(token))
+        return fail("expected a whole number");
+
+    uint64_t number = 0;
+    for (const char *c = token.begin; c < token.end; c++) {
+        if (*c < '0' || *c > '9' || number > UINT32_MAX)
+            return fail("'" + std::string(token.begin, token.end) + "' is not a whole number");
+        number = number * 10 + (*c - '0');
+    }
+    if (number > UINT32_MAX)
+        return fail("'" + std::string(token.begin, token.end) + "' is too large");
+    value = number;
+    return true;
+}
+
+bool SceneParser::fail(const std::string &message) {
+    error = lineNumber > 0 ? fileName + ":" + std::to_string(lineNumber) + ": " + message : message;
+    return false;
+}
+
+bool SceneParser::parseReal(const Token &token, Real &value) {
+    double number;
+    if (!parseDecimal(token.begin, token.end, number))
+        return false;
+    value = number;
+    return true;
+}
+
+bool SceneParser::Token::operator==(const char *word) const {
+    size_t length = strlen(word);
+    return (size_t) (end - begin) == length && memcmp(begin, word, length) == 0;
+}
+
+#endif
@@ -9,15 +9,28 @@
  * -Intersection Functions
  * -Normal Functions
  * -Translation Functions
+ * -Precompute Functions
+ * -Bounding Functions
+ * -Type Dispatch Functions
  */
 #ifndef SHAPE_HPP
 #define SHAPE_HPP
 
+#include "BoundingBox.hpp"
 #include "Vector3.hpp"
 #include "Matrix.hpp"
 #include <math.h>
 #include <time.h>
 
+//- Tags for the built in shapes, so hot paths can dispatch without virtual calls -//
+enum ShapeType {
+    SHAPE_SPHERE,
+    SHAPE_PLANE,
+    SHAPE_TRIANGLE,
+    //- Any other subclass of Shape, only reached through virtual calls -//
+    SHAPE_OTHER
+};
+
 //-Shape SuperClass-//
 class Shape {
 public:
@@ -32,28 +45,51 @@ public:
             blue = 128;
         }
 
-        double specularity;
-        double diffusion;
-        double shininess;
-        double reflectivity;
+        Real specularity;
+        Real diffusion;
+        Real shininess;
+        Real reflectivity;
         unsigned red;
         unsigned green;
         unsigned blue;
     };
 
     struct Intersection {
+        Intersection() : time(INFINITY), hit(false), primitive(0) {}
+
         Vector3 intersection;
-        double time;
+        Real time;
+        //- intersection and time are only set when hit is true -//
+        bool hit;
+        //- Which part of a shape made of several was hit, 0 for the others -//
+        unsigned primitive;
     };
 
     virtual ~Shape(){};
     Material material;
+    //- Set by Scene::addShape, counting from 1 in the order shapes are added -//
+    unsigned id;
     //The shape will be rotated with respect to the center
     Vector3 center;
     virtual Shape::Intersection intersect(const Ray &ray) const = 0;
+    //- True if ray hits the shape before maxTime, without working out where -//
+    virtual bool occluded(const Ray &ray, Real maxTime) const;
     virtual Vector3 getNormalAt(const Vector3 &point) const = 0;
-    virtual void transform(double translateX, double translateY, double translateZ, 
-                           double rotateX, double rotateY, double rotateZ) = 0;
+    //- The normal at a point of the given part, for shapes whose intersections set primitive -//
+    virtual Vector3 getPrimitiveNormalAt(const Vector3 &point, unsigned primitive) const { return getNormalAt(point); }
+    virtual void transform(Real translateX, Real translateY, Real translateZ, 
+                           Real rotateX, Real rotateY, Real rotateZ) = 0;
+    virtual BoundingBox getBounds() const = 0;
+    //- Recomputes the data intersect and getNormalAt derive from the shape's fields.
+    //- Constructors and transform already do this, call it after setting fields directly.
+    virtual void precompute() {}
+    //- Unbounded shapes (planes) are kept out of the acceleration structure -//
+    virtual bool isBounded() const { return true; }
+    ShapeType getType() const { return type; }
+protected:
+    Shape(ShapeType type = SHAPE_OTHER) : id(0), type(type) {}
+private:
+    ShapeType type;
 };
 
 //- Shape Type Headers -//
@@ -61,14 +97,24 @@ public:
 class Sphere: public Shape {
 public:
     Vector3 position;
-    double radius;
+    Real radius;
 
-    Sphere(double posX, double posY, double posZ, double radius);
-    Sphere(Vector3 pos, double radius);
+    Sphere(Real posX, Real posY, Real posZ, Real radius);
+    Sphere(Vector3 pos, Real radius);
     Shape::Intersection intersect(const Ray &ray) const;
+    bool occluded(const Ray &ray, Real maxTime) const;
+    //- Sets time to the first hit along ray, returns false if there is none -//
+    bool hitTime(const Ray &ray, Real &time) const;
     Vector3 getNormalAt(const Vector3 &point) const;
-    void transform(double translateX, double translateY, double translateZ, 
-                   double rotateX, double rotateY, double rotateZ);
+    void transform(Real translateX, Real translateY, Real translateZ, 
+                   Real rotateX, Real rotateY, Real rotateZ);
+    void precompute();
+    BoundingBox getBounds() const;
+
+    Real getRadiusSquared() const { return radiusSquared; }
+
+private:
+    Real radiusSquared;
 };
 
 //Plane
@@ -77,12 +123,21 @@ public:
     Vector3 position;
     Vector3 normal;
 
-    Plane(double posX, double posY, double posZ, Vector3 norm);
+    Plane(Real posX, Real posY, Real posZ, Vector3 norm);
     Plane(Vector3 pos, Vector3 norm);
     Shape::Intersection intersect(const Ray &ray) const;
+    bool occluded(const Ray &ray, Real maxTime) const;
+    //- Sets time to the first hit along ray, returns false if there is none -//
+    bool hitTime(const Ray &ray, Real &time) const;
     Vector3 getNormalAt(const Vector3 &point) const;
-    void transform(double translateX, double translateY, double translateZ, 
-                   double rotateX, double rotateY, double rotateZ);
+    void transform(Real translateX, Real translateY, Real translateZ, 
+                   Real rotateX, Real rotateY, Real rotateZ);
+    void precompute();
+    BoundingBox getBounds() const;
+    bool isBounded() const;
+
+private:
+    Vector3 unitNormal;
 };
 
 //Triangle
@@ -90,56 +145,76 @@ class Triangle: public Shape {
 public:
     Triangle(const Vector3 &vert1, const Vector3 &vert2, const Vector3 &vert3);
 
-    Triangle(double x1, double y1, double z1, 
-             double x2, double y2, double z2, 
-             double x3, double y3, double z3);
+    Triangle(Real x1, Real y1, Real z1, 
+             Real x2, Real y2, Real z2, 
+             Real x3, Real y3, Real z3);
 
     void init(const Vector3 &vert1, const Vector3 &vert2, const Vector3 &vert3);
 
     Shape::Intersection intersect(const Ray &ray) const;
+    bool occluded(const Ray &ray, Real maxTime) const;
+    //- Sets time to the first hit along ray, returns false if there is none -//
+    bool hitTime(const Ray &ray, Real &time) const;
     Vector3 getNormalAt(const Vector3 &point) const;
-    void transform(double translateX, double translateY, double translateZ, 
-                   double rotateX, double rotateY, double rotateZ);
+    void transform(Real translateX, Real translateY, Real translateZ, 
+                   Real rotateX, Real rotateY, Real rotateZ);
+    void precompute();
+    BoundingBox getBounds() const;
+
+    //- Read access for the batched intersection kernels -//
+    const Vector3 &getVertex1() const { return vertex1; }
+    const Vector3 &getVertex2() const { return vertex2; }
+    const Vector3 &getVertex3() const { return vertex3; }
+    //- vertex2 - vertex1 and vertex3 - vertex1 -//
+    const Vector3 &getEdge1() const { return edge1; }
+    const Vector3 &getEdge2() const { return edge2; }
 
 private:
     Vector3 vertex1;
     Vector3 vertex2;
     Vector3 vertex3;
+    Vector3 edge1;
+    Vector3 edge2;
+    //- Normalised -//
     Vector3 normal;
     Vector3 position;
 };
 
 //- Shape Constructors -//
 //Sphere
-Sphere::Sphere(double posX, double posY, double posZ, double radius) {
+Sphere::Sphere(Real posX, Real posY, Real posZ, Real radius) : Shape(SHAPE_SPHERE) {
     this->radius = radius;
     position(posX, posY, posZ);
     center(posX, posY, posZ);
+    precompute();
 }
-Sphere::Sphere(Vector3 pos, double radius) {
+Sphere::Sphere(Vector3 pos, Real radius) : Shape(SHAPE_SPHERE) {
     this->radius = radius;
     position = pos;
     center = pos;
+    precompute();
 }
 //Plane
-Plane::Plane(double posX, double posY, double posZ, Vector3 norm) {
+Plane::Plane(Real posX, Real posY, Real posZ, Vector3 norm) : Shape(SHAPE_PLANE) {
     normal = norm;
     position(posX, posY, posZ);
     center(posX, posY, posZ);
+    precompute();
 }
-Plane::Plane(Vector3 pos, Vector3 norm) {
+Plane::Plane(Vector3 pos, Vector3 norm) : Shape(SHAPE_PLANE) {
     normal = norm;
     position = pos;
     center = pos;
+    precompute();
 }
 //Triangle
-Triangle::Triangle(const Vector3 &vert1, const Vector3 &vert2, const Vector3 &vert3) {
+Triangle::Triangle(const Vector3 &vert1, const Vector3 &vert2, const Vector3 &vert3) : Shape(SHAPE_TRIANGLE) {
     init(vert1, vert2, vert3);
 }
 
-Triangle::Triangle(double x1, double y1, double z1, 
-                   double x2, double y2, double z2, 
-                   double x3, double y3, double z3) {
+Triangle::Triangle(Real x1, Real y1, Real z1, 
+                   Real x2, Real y2, Real z2, 
+                   Real x3, Real y3, Real z3) : Shape(SHAPE_TRIANGLE) {
     Vector3 vert1(x1, y1, z1);
     Vector3 vert2(x2, y2, z2);
     Vector3 vert3(x3, y3, z3);
@@ -153,87 +228,119 @@ void Triangle::init(const Vector3 &vert1, const Vector3 &vert2, const Vector3 &v
 
     position = (1 / 3.0) * (vertex1 + vertex2 + vertex3);
     center = position;
-
-    Vector3 side1 = vertex1 - vertex2;
-    Vector3 side2 = vertex3 - vertex2;
-    normal = side1.cross(side2);
+    precompute();
 };
 
 //- Shape Intersection Functions -//
+//Shape
+bool Shape::occluded(const Ray &ray, Real maxTime) const {
+    Shape::Intersection intersection = intersect(ray);
+    return intersection.hit && intersection.time < maxTime;
+}
+
 //Sphere
+bool Sphere::hitTime(const Ray &ray, Real &time) const {
+    //- The quadratic with b halved, which cancels the factors of 2 and 4 -//
+    Vector3 toRay = ray.position - position;
+    Real a = ray.direction * ray.direction;
+    Real b = toRay * ray.direction;
+    Real c = toRay * toRay - radiusSquared;
+
+    Real descriminant = b * b - a * c;
+    if (descriminant < 0)
+        return false;
+
+    time = (-b - sqrt(descriminant)) / a;
+    return time > HIT_EPSILON;
+}
+
 Shape::Intersection Sphere::intersect(const Ray &ray) const {
     Shape::Intersection intersect;
-    double a = ray.direction * ray.direction;
-    double b = (ray.position - position) * ray.direction * 2;
-    double c = ray.position * ray.position
-               - 2 * position * ray.position 
-               + position * position 
-               - radius * radius;
-
-    double descriminant = b * b - 4 * a * c;
-    if (descriminant >= 0) {
-        double solution = (-b - sqrt(descriminant)) / (2 * a);
-        if (solution > 1e-10) {
-            Vector3 intersection = solution * ray.direction + ray.position;
-            intersect.intersection = intersection;
-            intersect.time = solution;
-        }
+    Real solution;
+    if (hitTime(ray, solution)) {
+        intersect.intersection = solution * ray.direction + ray.position;
+        intersect.time = solution;
+        intersect.hit = true;
     }
     return intersect;
 }
 
+bool Sphere::occluded(const Ray &ray, Real maxTime) const {
+    Real time;
+    return hitTime(ray, time) && time < maxTime;
+}
+
 //Plane
+bool Plane::hitTime(const Ray &ray, Real &time) const {
+    Real denominator = (normal * ray.direction);
+    if (denominator == 0)
+        return false;
+
+    //-- Checking if the ray intersects the plane using the equation for a plane --//
+    time = -(normal * (ray.position - position)) / denominator;
+    return time > HIT_EPSILON;
+}
+
 Shape::Intersection Plane::intersect(const Ray &ray) const {
     Shape::Intersection intersect;
-    double denominator = (normal * ray.direction);
-    if (denominator != 0) {
-        //-- Checking if the ray intersects the plane that the triangle is on
-        //   using the equation for a plane--//
-        double solution = -(normal * (ray.position - position)) / denominator;
-        if (solution > 1e-10) {
-            Vector3 intersection = solution * ray.direction + ray.position;
-            intersect.intersection = intersection;
-            intersect.time = solution;
-        }
+    Real solution;
+    if (hitTime(ray, solution)) {
+        intersect.intersection = solution * ray.direction + ray.position;
+        intersect.time = solution;
+        intersect.hit = true;
     }
     return intersect;
 }
 
+bool Plane::occluded(const Ray &ray, Real maxTime) const {
+    Real time;
+    return hitTime(ray, time) && time < maxTime;
+}
+
 //Triangle
+/* Moller-Trumbore: solves for the hit time and the barycentric coordinates
+ * (u, v) of the hit at once. Points on an edge count as inside, so a ray
+ * through an edge shared by two triangles hits at least one of them.
+ */
+bool Triangle::hitTime(const Ray &ray, Real &time) const {
+    Vector3 p = ray.direction.cross(edge2);
+    Real determinant = edge1 * p;
+
+    //- The ray is parallel to the triangle -//
+    if (determinant == 0)
+        return false;
+
+    Real inverseDeterminant = 1 / determinant;
+    Vector3 toRay = ray.position - vertex1;
+    Real u = (toRay * p) * inverseDeterminant;
+    if (!(u >= 0 && u <= 1))
+        return false;
+
+    Vector3 q = toRay.cross(edge1);
+    Real v = (ray.direction * q) * inverseDeterminant;
+    if (!(v >= 0 && u + v <= 1))
+        return false;
+
+    time = (edge2 * q) * inverseDeterminant;
+    return time > HIT_EPSILON;
+}
+
 Shape::Intersection Triangle::intersect(const Ray &ray) const {
     Shape::Intersection intersect;
-    double denominator = (normal * ray.direction);
-
-    if (denominator != 0) {
-        //-- Checking if the ray intersects the plane that the triangle is on
-        //   using the equation for a plane--//
-        double solution = -(normal * (ray.position - vertex1)) / denominator;
-        if (solution > 1e-10) {
-            Vector3 intersection = solution * ray.direction + ray.position;
-
-            double triangleArea = sqrt(normal * normal) / 2;
-
-            //-- Checking to see if the intersection is inside the triangle using area method --//
-            Vector3 triSegment1Normal = (intersection - vertex1).cross(vertex2 - vertex1);
-            double areaOfTriSegment1 = sqrt(triSegment1Normal * triSegment1Normal) / 2;
-
-            Vector3 triSegment2Normal = (intersection - vertex2).cross(vertex3 - vertex2);
-            double areaOfTriSegment2 = sqrt(triSegment2Normal * triSegment2Normal) / 2;
-
-            Vector3 triSegment3Normal = (intersection - vertex3).cross(vertex1 - vertex3);
-            double areaOfTriSegment3 = sqrt(triSegment3Normal * triSegment3Normal) / 2;
-
-            double totalArea = areaOfTriSegment1 + areaOfTriSegment2 + areaOfTriSegment3;
-            if (totalArea <= triangleArea + 1e-10 && totalArea >= triangleArea - 1e-10) {
-                intersect.intersection = intersection;
-                intersect.time = solution;
-            }
-        }
+    Real solution;
+    if (hitTime(ray, solution)) {
+        intersect.intersection = solution * ray.direction + ray.position;
+        intersect.time = solution;
+        intersect.hit = true;
     }
-
     return intersect;
 }
 
+bool Triangle::occluded(const Ray &ray, Real maxTime) const {
+    Real time;
+    return hitTime(ray, time) && time < maxTime;
+}
+
 //- Normal Functions -//
 //Sphere
 Vector3 Sphere::getNormalAt(const Vector3 &point) const {
@@ -244,19 +351,18 @@ Vector3 Sphere::getNormalAt(const Vector3 &point) const {
 
 //Plane
 Vector3 Plane::getNormalAt(const Vector3 &point) const {
-        return normal.normalise();
+        return unitNormal;
 }
 
 //Triangle
 Vector3 Triangle::getNormalAt(const Vector3 &point) const {
-    return normal.normalise();
-
+    return normal;
 }
 
 //- Shape Translation Functions -//
 //Sphere
-void Sphere::transform(double translateX, double translateY, double translateZ, 
-                       double rotateX, double rotateY, double rotateZ) {
+void Sphere::transform(Real translateX, Real translateY, Real translateZ, 
+                       Real rotateX, Real rotateY, Real rotateZ) {
     position = position - center;
     Matrix transform = Matrix::createTransformationMatrix(translateX, translateY, translateZ, 
                                                           rotateX, rotateY, rotateZ);
@@ -264,11 +370,12 @@ void Sphere::transform(double translateX, double translateY, double translateZ,
     Vector4 position4 = transform * Vector4::vec3ToVec4(position, 1);
     position = position + center;
     position(position4[0], position4[1], position4[2]);
+    precompute();
 }
 
 //Plane
-void Plane::transform(double translateX, double translateY, double translateZ, 
-                      double rotateX, double rotateY, double rotateZ) {
+void Plane::transform(Real translateX, Real translateY, Real translateZ, 
+                      Real rotateX, Real rotateY, Real rotateZ) {
 
     position = position - center;
     Matrix transform = Matrix::createTransformationMatrix(translateX, translateY, translateZ, 
@@ -279,11 +386,12 @@ void Plane::transform(double translateX, double translateY, double translateZ,
     position(position4[0], position4[1], position4[2]);
     position = position + center;
     normal(normal4[0], normal4[1], normal4[2]);
+    precompute();
 }
 
 //Triangle
-void Triangle::transform(double translateX, double translateY, double translateZ, 
-                         double rotateX, double rotateY, double rotateZ) {
+void Triangle::transform(Real translateX, Real translateY, Real translateZ, 
+                         Real rotateX, Real rotateY, Real rotateZ) {
 
     vertex1 = vertex1 - center;
     vertex2 = vertex2 - center;
@@ -301,4 +409,95 @@ void Triangle::transform(double translateX, double translateY, double translateZ
 
     init(vertex1 + center, vertex2 + center, vertex3 + center);
 }
+
+//- Precompute Functions -//
+//Sphere
+void Sphere::precompute() {
+    radiusSquared = radius * radius;
+}
+
+//Plane
+void Plane::precompute() {
+    unitNormal = normal.normalise();
+}
+
+//Triangle
+void Triangle::precompute() {
+    edge1 = vertex2 - vertex1;
+    edge2 = vertex3 - vertex1;
+
+    Vector3 side1 = vertex1 - vertex2;
+    Vector3 side2 = vertex3 - vertex2;
+    normal = side1.cross(side2).normalise();
+}
+
+//- Bounding Functions -//
+//Sphere
+BoundingBox Sphere::getBounds() const {
+    Vector3 extent(radius, radius, radius);
+    return BoundingBox(position - extent, position + extent);
+}
+
+//Plane
+BoundingBox Plane::getBounds() const {
+    return BoundingBox::infinite();
+}
+
+bool Plane::isBounded() const {
+    return false;
+}
+
+//Triangle
+BoundingBox Triangle::getBounds() const {
+    BoundingBox bounds;
+    bounds.expand(vertex1);
+    bounds.expand(vertex2);
+    bounds.expand(vertex3);
+    return bounds;
+}
+
+//- Type Dispatch Functions -//
+/* Same as shape.intersect(ray), but the built in shapes are called
+ * directly through their type tag so the call can be inlined.
+ */
+inline Shape::Intersection intersectShape(const Shape &shape, const Ray &ray) {
+    switch (shape.getType()) {
+    case SHAPE_SPHERE:
+        return static_cast<const Sphere&>(shape).Sphere::intersect(ray);
+    case SHAPE_PLANE:
+        return static_cast<const Plane&>(shape).Plane::intersect(ray);
+    case SHAPE_TRIANGLE:
+        return static_cast<const Triangle&>(shape).Triangle::intersect(ray);
+    default:
+        return shape.intersect(ray);
+    }
+}
+
+/* Same as shape.occluded(ray, maxTime), dispatched like intersectShape */
+inline bool occludedByShape(const Shape &shape, const Ray &ray, Real maxTime) {
+    switch (shape.getType()) {
+    case SHAPE_SPHERE:
+        return static_cast<const Sphere&>(shape).Sphere::occluded(ray, maxTime);
+    case SHAPE_PLANE:
+        return static_cast<const Plane&>(shape).Plane::occluded(ray, maxTime);
+    case SHAPE_TRIANGLE:
+        return static_cast<const Triangle&>(shape).Triangle::occluded(ray, maxTime);
+    default:
+        return shape.occluded(ray, maxTime);
+    }
+}
+
+/* Same as shape.getPrimitiveNormalAt(point, primitive), dispatched like intersectShape */
+inline Vector3 getShapeNormalAt(const Shape &shape, const Vector3 &point, unsigned primitive) {
+    switch (shape.getType()) {
+    case SHAPE_SPHERE:
+        return static_cast<const Sphere&>(shape).Sphere::getNormalAt(point);
+    case SHAPE_PLANE:
+        return static_cast<const Plane&>(shape).Plane::getNormalAt(point);
+    case SHAPE_TRIANGLE:
+        return static_cast<const Triangle&>(shape).Triangle::getNormalAt(point);
+    default:
+        return shape.getPrimitiveNormalAt(point, primitive);
+    }
+}
 #endif
@@ -0,0 +1,197 @@
+/* A small work-stealing thread pool.
+ * Every worker owns a deque of tasks. A worker pushes the tasks it spawns
+ * onto the back of its own deque and pops from the back as well, so
+ * recently spawned (cache-warm) work is run first. When a worker's deque
+ * is empty it steals from the front of another worker's deque, which is
+ * where the oldest and usually largest pieces of work sit.
+ *
+ * Tasks are grouped with a TaskGroup. Waiting on a group does not block
+ * the waiting thread; it keeps running queued tasks until the group is
+ * finished, so tasks may themselves spawn and wait on subtasks.
+ */
+#ifndef THREADPOOL_HPP
+#define THREADPOOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+    typedef std::function<void()> Task;
+
+    struct TaskGroup {
+        TaskGroup() : pending(0) {}
+        std::atomic<unsigned> pending;
+    };
+
+    //- numberOfThreads == 0 uses one worker per hardware thread -//
+    ThreadPool(unsigned numberOfThreads = 0);
+    ~ThreadPool();
+
+    void submit(TaskGroup &group, const Task &task);
+    void wait(TaskGroup &group);
+    unsigned getNumberOfThreads() const;
+
+private:
+    struct QueuedTask {
+        Task task;
+        TaskGroup *group;
+    };
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<QueuedTask> tasks;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<WorkQueue*> queues;
+    std::atomic<unsigned> queuedTasks;
+    std::atomic<unsigned> nextQueue;
+    std::atomic<bool> stopping;
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+
+    //- index of the queue owned by the current thread, or -1 if it is not a worker -//
+    static thread_local int workerIndex;
+
+    void workerLoop(unsigned index);
+    bool popOrSteal(unsigned firstQueue, QueuedTask &queued);
+    void run(QueuedTask &queued);
+};
+
+thread_local int ThreadPool::workerIndex = -1;
+
+ThreadPool::ThreadPool(unsigned numberOfThreads) {
+    if (numberOfThreads == 0)
+        numberOfThreads = std::thread::hardware_concurrency();
+    if (numberOfThreads == 0)
+        numberOfThreads = 1;
+
+    queuedTasks = 0;
+    nextQueue = 0;
+    stopping = false;
+
+    for (unsigned i = 0; i < numberOfThreads; i++)
+        queues.push_back(new WorkQueue);
+
+    for (unsigned i = 0; i < numberOfThreads; i++)
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    sleepCondition.notify_all();
+
+    for (unsigned i = 0; i < workers.size(); i++)
+        workers[i].join();
+
+    for (unsigned i = 0; i < queues.size(); i++)
+        delete queues[i];
+}
+
+/* Queues a task as part of group. Tasks submitted from a worker go to
+ * that worker's own deque, everything else is spread round-robin.
+ */
+void ThreadPool::submit(TaskGroup &group, const Task &task) {
+    group.pending++;
+
+    unsigned index;
+    if (workerIndex >= 0)
+        index = workerIndex;
+    else
+        index = nextQueue++ % queues.size();
+
+    QueuedTask queued;
+    queued.task = task;
+    queued.group = &group;
+    {
+        std::lock_guard<std::mutex> lock(queues[index]->mutex);
+        queues[index]->tasks.push_back(queued);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        queuedTasks++;
+    }
+    sleepCondition.notify_one();
+}
+
+/* Runs queued tasks on the calling thread until every task of group
+ * has finished.
+ */
+void ThreadPool::wait(TaskGroup &group) {
+    unsigned firstQueue = workerIndex >= 0 ? workerIndex : 0;
+    while (group.pending > 0) {
+        QueuedTask queued;
+        if (popOrSteal(firstQueue, queued))
+            run(queued);
+        else
+            std::this_thread::yield();
+    }
+}
+
+unsigned ThreadPool::getNumberOfThreads() const {
+    return workers.size();
+}
+
+void ThreadPool::workerLoop(unsigned index) {
+    workerIndex = index;
+    while (true) {
+        QueuedTask queued;
+        if (popOrSteal(index, queued)) {
+            run(queued);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleepCondition.wait(lock, [this] { return stopping || queuedTasks > 0; });
+        if (stopping && queuedTasks == 0)
+            return;
+    }
+}
+
+/* Pops from the back of the queue at firstQueue, otherwise steals from
+ * the front of the other queues in turn.
+ */
+bool ThreadPool::popOrSteal(unsigned firstQueue, QueuedTask &queued) {
+    if (queuedTasks == 0)
+        return false;
+
+    {
+        WorkQueue &own = *queues[firstQueue];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            queued = own.tasks.back();
+            own.tasks.pop_back();
+            queuedTasks--;
+            return true;
+        }
+    }
+
+    for (unsigned i = 1; i < queues.size(); i++) {
+        WorkQueue &victim = *queues[(firstQueue + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            queued = victim.tasks.front();
+            victim.tasks.pop_front();
+            queuedTasks--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::run(QueuedTask &queued) {
+    queued.task();
+    queued.group->pending--;
+}
+
+#endif
@@ -0,0 +1,518 @@
+/* A mesh of triangles sharing one vertex buffer. A Triangle shape keeps
+ * its own copy of every vertex along with derived data, about 200 bytes
+ * each, where a mesh keeps 12 bytes of indices a triangle and 12 bytes
+ * per shared vertex, plus its own BVH.
+ *
+ * The scene sees a mesh as one shape with one material, which sits in the
+ * scene's BVH as a single primitive. Its triangles are found through a
+ * BVH of the mesh's own, built by precompute with the scene's BinnedSAH,
+ * whose nodes hold float bounds in 32 bytes. Building it reorders the triangles so every leaf
+ * covers a contiguous run of them. Intersections report the index of the
+ * triangle hit as their primitive.
+ *
+ * Triangles face the side from which their vertices run counter-clockwise,
+ * as in OBJ and PLY files.
+ *
+ * A mesh loaded from a SceneCache reads its vertices, indices and tree in
+ * place from the cache file, and its vectors stay empty until it is
+ * transformed, which copies them out first.
+ */
+#ifndef TRIANGLEMESH_HPP
+#define TRIANGLEMESH_HPP
+
+#include "BinnedSAH.hpp"
+#include "BoundingBox.hpp"
+#include "Matrix.hpp"
+#include "Shape.hpp"
+#include "ThreadPool.hpp"
+#include "Vector3.hpp"
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class TriangleMesh: public Shape {
+public:
+    TriangleMesh();
+
+    Shape::Intersection intersect(const Ray &ray) const;
+    bool occluded(const Ray &ray, Real maxTime) const;
+    //- Searches every triangle for the one nearest point, use getPrimitiveNormalAt where possible -//
+    Vector3 getNormalAt(const Vector3 &point) const;
+    Vector3 getPrimitiveNormalAt(const Vector3 &point, unsigned primitive) const;
+    void transform(Real translateX, Real translateY, Real translateZ,
+                   Real rotateX, Real rotateY, Real rotateZ);
+    //- Builds the mesh's BVH, reordering the triangles -//
+    void precompute();
+    BoundingBox getBounds() const;
+
+    unsigned getNumberOfVertices() const;
+    unsigned getNumberOfTriangles() const;
+    //- Bytes held by the vertices, indices and BVH -//
+    size_t getMemoryUsage() const;
+
+    //- x, y and z of every vertex. Call precompute after changing them -//
+    std::vector<float> vertices;
+    //- Three indices into the vertices per triangle -//
+    std::vector<uint32_t> indices;
+    //- Threads building the BVH of large meshes, 0 uses every hardware thread -//
+    unsigned numberOfThreads;
+private:
+    friend class SceneCache;
+
+    struct Node {
+        float min[3];
+        //- Interior nodes: index of the left child, the right child follows it.
+        //- Leaves: index of the first triangle.
+        uint32_t firstIndex;
+        float max[3];
+        //- 0 for interior nodes -//
+        uint32_t triangleCount;
+    };
+
+    //- Bounds in float, as the vertices are, while the tree is built -//
+    struct Bounds {
+        Bounds();
+        void expand(const Bounds &bounds);
+        void expand(const float *point);
+        double surfaceArea() const;
+
+        float min[3];
+        float max[3];
+    };
+
+    struct BuildTriangle {
+        Bounds bounds;
+        float centroid[3];
+        uint32_t triangle;
+    };
+
+    typedef BinnedSAH<Bounds, float> SAH;
+
+    std::vector<Node> nodes;
+
+    //- What intersection reads: the vectors once precompute has built the tree,
+    //- or memory in a SceneCache's file, which mappedData then keeps alive.
+    const float *vertexData;
+    const uint32_t *indexData;
+    const Node *nodeData;
+    unsigned numberOfVertices;
+    unsigned numberOfTriangles;
+    unsigned numberOfNodes;
+    std::shared_ptr<const void> mappedData;
+
+    //- State of the build in progress -//
+    std::vector<BuildTriangle> buildTriangles;
+    std::atomic<unsigned> nodeCount;
+    ThreadPool *pool;
+    ThreadPool::TaskGroup *subtreeTasks;
+
+    bool hitTime(unsigned triangle, const Ray &ray, Real &time) const;
+    Vector3 getVertex(uint32_t index) const;
+    void useVectors();
+    void buildNode(unsigned nodeIndex, unsigned begin, unsigned end,
+                   const Bounds &bounds, const Bounds &centroidBounds, unsigned depth);
+    void boundRange(unsigned begin, unsigned end, Bounds &bounds, Bounds &centroidBounds) const;
+
+    static bool intersectNode(const Node &node, const Ray &ray, const Vector3 &inverseDirection,
+                              Real maxTime, Real &entryTime);
+};
+
+const unsigned MESH_MAX_LEAF_SIZE = 16;
+const unsigned MESH_BINS = 16;
+/* Cost of visiting a node, where a triangle test costs 1. Higher than the
+ * time it takes, because every node also costs 32 bytes: this makes
+ * leaves of about ten triangles, for about 6 bytes of tree per triangle
+ * and traversal within a few percent of the fastest setting.
+ */
+const double MESH_TRAVERSAL_COST = 8;
+const unsigned MESH_MAX_DEPTH = 62;
+const unsigned MESH_STACK_SIZE = MESH_MAX_DEPTH + 2;
+//- Meshes with at least this many triangles build subtrees of this size as separate tasks -//
+const unsigned MESH_SUBTREE_TASK_THRESHOLD = 4096;
+
+TriangleMesh::TriangleMesh() {
+    numberOfThreads = 0;
+    nodeCount = 0;
+    pool = NULL;
+    subtreeTasks = NULL;
+    useVectors();
+}
+
+/* Möller-Trumbore, as Triangle::hitTime, on the shared vertices */
+bool TriangleMesh::hitTime(unsigned triangle, const Ray &ray, Real &time) const {
+    Vector3 vertex1 = getVertex(indexData[3 * triangle]);
+    Vector3 edge1 = getVertex(indexData[3 * triangle + 1]) - vertex1;
+    Vector3 edge2 = getVertex(indexData[3 * triangle + 2]) - vertex1;
+
+    Vector3 p = ray.direction.cross(edge2);
+    Real determinant = edge1 * p;
+
+    //- The ray is parallel to the triangle -//
+    if (determinant == 0)
+        return false;
+
+    Real inverseDeterminant = 1 / determinant;
+    Vector3 toRay = ray.position - vertex1;
+    Real u = (toRay * p) * inverseDeterminant;
+    if (!(u >= 0 && u <= 1))
+        return false;
+
+    Vector3 q = toRay.cross(edge1);
+    Real v = (ray.direction * q) * inverseDeterminant;
+    if (!(v >= 0 && u + v <= 1))
+        return false;
+
+    time = (edge2 * q) * inverseDeterminant;
+    return time > HIT_EPSILON;
+}
+
+Shape::Intersection TriangleMesh::intersect(const Ray &ray) const {
+    Shape::Intersection intersection;
+    if (numberOfNodes == 0)
+        return intersection;
+
+    Vector3 inverseDirection(1 / ray.direction[0], 1 / ray.direction[1], 1 / ray.direction[2]);
+    Real closestTime = INFINITY;
+    unsigned closestTriangle = 0;
+
+    unsigned stack[MESH_STACK_SIZE];
+    unsigned stackSize = 0;
+    Real entryTime;
+    if (intersectNode(nodeData[0], ray, inverseDirection, closestTime, entryTime))
+        stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        const Node &node = nodeData[stack[--stackSize]];
+
+        if (node.triangleCount > 0) {
+            for (unsigned i = node.firstIndex; i < node.firstIndex + node.triangleCount; i++) {
+                Real time;
+                if (hitTime(i, ray, time) && time < closestTime) {
+                    closestTime = time;
+                    closestTriangle = i;
+                    intersection.hit = true;
+                }
+            }
+            continue;
+        }
+
+        //- Push the farther child first so the nearer one is visited first -//
+        Real leftTime, rightTime;
+        bool hitLeft = intersectNode(nodeData[node.firstIndex], ray, inverseDirection, closestTime, leftTime);
+        bool hitRight = intersectNode(nodeData[node.firstIndex + 1], ray, inverseDirection, closestTime, rightTime);
+        if (hitLeft && hitRight) {
+            if (leftTime < rightTime) {
+                stack[stackSize++] = node.firstIndex + 1;
+                stack[stackSize++] = node.firstIndex;
+            } else {
+                stack[stackSize++] = node.firstIndex;
+                stack[stackSize++] = node.firstIndex + 1;
+            }
+        } else if (hitLeft) {
+            stack[stackSize++] = node.firstIndex;
+        } else if (hitRight) {
+            stack[stackSize++] = node.firstIndex + 1;
+        }
+    }
+
+    if (intersection.hit) {
+        intersection.time = closestTime;
+        intersection.intersection = closestTime * ray.direction + ray.position;
+        intersection.primitive = closestTriangle;
+    }
+    return intersection;
+}
+
+bool TriangleMesh::occluded(const Ray &ray, Real maxTime) const {
+    if (numberOfNodes == 0)
+        return false;
+
+    Vector3 inverseDirection(1 / ray.direction[0], 1 / ray.direction[1], 1 / ray.direction[2]);
+    unsigned stack[MESH_STACK_SIZE];
+    unsigned stackSize = 0;
+    stack[stackSize++] = 0;
+
+    while (stackSize > 0) {
+        const Node &node = nodeData[stack[--stackSize]];
+        Real entryTime;
+        if (!intersectNode(node, ray, inverseDirection, maxTime, entryTime))
+            continue;
+
+        if (node.triangleCount > 0) {
+            for (unsigned i = node.firstIndex; i < node.firstIndex + node.triangleCount; i++) {
+                Real time;
+                if (hitTime(i, ray, time) && time < maxTime)
+                    return true;
+            }
+            continue;
+        }
+
+        stack[stackSize++] = node.firstIndex + 1;
+        stack[stackSize++] = node.firstIndex;
+    }
+    return false;
+}
+
+Vector3 TriangleMesh::getNormalAt(const Vector3 &point) const {
+    unsigned nearest = 0;
+    Real nearestDistance = INFINITY;
+    for (unsigned i = 0; i < numberOfTriangles; i++) {
+        Vector3 normal = getPrimitiveNormalAt(point, i);
+        Real distance = fabs((point - getVertex(indexData[3 * i])) * normal);
+        if (distance < nearestDistance) {
+            nearestDistance = distance;
+            nearest = i;
+        }
+    }
+    return getPrimitiveNormalAt(point, nearest);
+}
+
+Vector3 TriangleMesh::getPrimitiveNormalAt(const Vector3 &point, unsigned primitive) const {
+    Vector3 vertex1 = getVertex(indexData[3 * primitive]);
+    Vector3 edge1 = getVertex(indexData[3 * primitive + 1]) - vertex1;
+    Vector3 edge2 = getVertex(indexData[3 * primitive + 2]) - vertex1;
+    return edge1.cross(edge2).normalise();
+}
+
+void TriangleMesh::transform(Real translateX, Real translateY, Real translateZ,
+                             Real rotateX, Real rotateY, Real rotateZ) {
+    if (mappedData != NULL) {
+        vertices.assign(vertexData, vertexData + 3 * (size_t) numberOfVertices);
+        indices.assign(indexData, indexData + 3 * (size_t) numberOfTriangles);
+    }
+
+    Matrix transform = Matrix::createTransformationMatrix(translateX, translateY, translateZ,
+                                                          rotateX, rotateY, rotateZ);
+
+    for (size_t i = 0; i + 2 < vertices.size(); i += 3) {
+        Vector3 vertex(vertices[i], vertices[i + 1], vertices[i + 2]);
+        Vector4 vertex4 = transform * Vector4::vec3ToVec4(vertex - center, 1);
+        vertices[i] = vertex4[0] + center[0];
+        vertices[i + 1] = vertex4[1] + center[1];
+        vertices[i + 2] = vertex4[2] + center[2];
+    }
+    precompute();
+}
+
+void TriangleMesh::precompute() {
+    //- A mesh used in place from a SceneCache is built already -//
+    if (mappedData != NULL && vertices.empty() && indices.empty())
+        return;
+
+    mappedData.reset();
+    unsigned count = indices.size() / 3;
+    nodes.clear();
+    if (count == 0) {
+        useVectors();
+        return;
+    }
+
+    buildTriangles.resize(count);
+    for (unsigned i = 0; i < count; i++) {
+        BuildTriangle &built = buildTriangles[i];
+        built.triangle = i;
+        built.bounds = Bounds();
+        for (int corner = 0; corner < 3; corner++)
+            built.bounds.expand(&vertices[3 * (size_t) indices[3 * i + corner]]);
+        for (int axis = 0; axis < 3; axis++)
+            built.centroid[axis] = (built.bounds.min[axis] + built.bounds.max[axis]) * 0.5f;
+    }
+
+    Bounds bounds, centroidBounds;
+    boundRange(0, count, bounds, centroidBounds);
+
+    //- Small meshes are not worth starting threads for -//
+    ThreadPool *threadPool = NULL;
+    if (count >= MESH_SUBTREE_TASK_THRESHOLD)
+        threadPool = new ThreadPool(numberOfThreads);
+    pool = threadPool;
+
+    nodes.resize(2 * count - 1);
+    nodeCount = 1;
+    ThreadPool::TaskGroup tasks;
+    subtreeTasks = &tasks;
+    buildNode(0, 0, count, bounds, centroidBounds, 0);
+    if (pool != NULL)
+        pool->wait(tasks);
+    nodes.resize(nodeCount);
+    nodes.shrink_to_fit();
+
+    //- Put the triangles in the order the leaves refer to them -//
+    std::vector<uint32_t> ordered(indices.size());
+    for (unsigned i = 0; i < count; i++) {
+        uint32_t triangle = buildTriangles[i].triangle;
+        ordered[3 * i] = indices[3 * triangle];
+        ordered[3 * i + 1] = indices[3 * triangle + 1];
+        ordered[3 * i + 2] = indices[3 * triangle + 2];
+    }
+    indices.swap(ordered);
+
+    std::vector<BuildTriangle>().swap(buildTriangles);
+    delete threadPool;
+    pool = NULL;
+    useVectors();
+}
+
+BoundingBox TriangleMesh::getBounds() const {
+    BoundingBox bounds;
+    if (numberOfNodes > 0) {
+        bounds.expand(Vector3(nodeData[0].min[0], nodeData[0].min[1], nodeData[0].min[2]));
+        bounds.expand(Vector3(nodeData[0].max[0], nodeData[0].max[1], nodeData[0].max[2]));
+        return bounds;
+    }
+
+    //- Before the tree is built -//
+    for (size_t i = 0; i < indices.size(); i++) {
+        const float *vertex = &vertices[3 * (size_t) indices[i]];
+        bounds.expand(Vector3(vertex[0], vertex[1], vertex[2]));
+    }
+    return bounds;
+}
+
+unsigned TriangleMesh::getNumberOfVertices() const {
+    return mappedData != NULL ? numberOfVertices : vertices.size() / 3;
+}
+
+unsigned TriangleMesh::getNumberOfTriangles() const {
+    return mappedData != NULL ? numberOfTriangles : indices.size() / 3;
+}
+
+size_t TriangleMesh::getMemoryUsage() const {
+    return (size_t) getNumberOfVertices() * 3 * sizeof(float) + (size_t) getNumberOfTriangles() * 3 * sizeof(uint32_t)
+           + (size_t) numberOfNodes * sizeof(Node);
+}
+
+Vector3 TriangleMesh::getVertex(uint32_t index) const {
+    const float *vertex = vertexData + 3 * (size_t) index;
+    return Vector3(vertex[0], vertex[1], vertex[2]);
+}
+
+void TriangleMesh::useVectors() {
+    vertexData = vertices.data();
+    indexData = indices.data();
+    nodeData = nodes.data();
+    numberOfVertices = vertices.size() / 3;
+    numberOfTriangles = indices.size() / 3;
+    numberOfNodes = nodes.size();
+}
+
+/* Builds the subtree rooted at nodeIndex over buildTriangles[begin, end)
+ * with BinnedSAH, as BVHBuilder does for the scene. bounds and
+ * centroidBounds bound the triangles in the range and their centroids.
+ */
+void TriangleMesh::buildNode(unsigned nodeIndex, unsigned begin, unsigned end,
+                             const Bounds &bounds, const Bounds &centroidBounds, unsigned depth) {
+    //- The bounds are unions of float vertices, so they are exact as floats -//
+    Node &node = nodes[nodeIndex];
+    for (int axis = 0; axis < 3; axis++) {
+        node.min[axis] = bounds.min[axis];
+        node.max[axis] = bounds.max[axis];
+    }
+    node.firstIndex = begin;
+    node.triangleCount = end - begin;
+
+    unsigned count = end - begin;
+    if (count <= 1 || depth == MESH_MAX_DEPTH)
+        return;
+
+    SAH sah(centroidBounds, MESH_BINS);
+    SAH::Bin bins[3 * MESH_BINS];
+    sah.addToBins(&buildTriangles[begin], count, bins);
+
+    //- Small nodes only split when that is cheaper than a leaf -//
+    SAH::Split split;
+    unsigned middle = begin;
+    double leafCost = count <= MESH_MAX_LEAF_SIZE ? count : INFINITY;
+    if (sah.findSplit(bins, count, bounds, MESH_TRAVERSAL_COST, leafCost, split)) {
+        int axis = split.axis;
+        unsigned lastLeftBin = split.position;
+        middle = std::partition(buildTriangles.begin() + begin, buildTriangles.begin() + end,
+                                [&sah, axis, lastLeftBin](const BuildTriangle &built) {
+                                    return sah.binIndex(built.centroid[axis], axis) <= lastLeftBin;
+                                }) - buildTriangles.begin();
+    } else if (count <= MESH_MAX_LEAF_SIZE) {
+        return;
+    }
+
+    //- Every centroid is in the same place, so any split is as good as another -//
+    if (middle == begin || middle == end) {
+        middle = begin + count / 2;
+        boundRange(begin, middle, split.leftBounds, split.leftCentroidBounds);
+        boundRange(middle, end, split.rightBounds, split.rightCentroidBounds);
+    }
+
+    unsigned leftIndex = nodeCount.fetch_add(2);
+    node.firstIndex = leftIndex;
+    node.triangleCount = 0;
+
+    //- The right subtree becomes a task if it is big enough, the left one is built here -//
+    if (pool != NULL && end - middle >= MESH_SUBTREE_TASK_THRESHOLD) {
+        Bounds rightBounds = split.rightBounds;
+        Bounds rightCentroidBounds = split.rightCentroidBounds;
+        pool->submit(*subtreeTasks, [this, leftIndex, middle, end, rightBounds, rightCentroidBounds, depth] {
+            buildNode(leftIndex + 1, middle, end, rightBounds, rightCentroidBounds, depth + 1);
+        });
+    } else {
+        buildNode(leftIndex + 1, middle, end, split.rightBounds, split.rightCentroidBounds, depth + 1);
+    }
+    buildNode(leftIndex, begin, middle, split.leftBounds, split.leftCentroidBounds, depth + 1);
+}
+
+void TriangleMesh::boundRange(unsigned begin, unsigned end, Bounds &bounds, Bounds &centroidBounds) const {
+    bounds = Bounds();
+    centroidBounds = Bounds();
+    for (unsigned i = begin; i < end; i++) {
+        bounds.expand(buildTriangles[i].bounds);
+        centroidBounds.expand(buildTriangles[i].centroid);
+    }
+}
+
+TriangleMesh::Bounds::Bounds() {
+    for (int axis = 0; axis < 3; axis++) {
+        min[axis] = INFINITY;
+        max[axis] = -INFINITY;
+    }
+}
+
+void TriangleMesh::Bounds::expand(const Bounds &bounds) {
+    for (int axis = 0; axis < 3; axis++) {
+        min[axis] = std::min(min[axis], bounds.min[axis]);
+        max[axis] = std::max(max[axis], bounds.max[axis]);
+    }
+}
+
+void TriangleMesh::Bounds::expand(const float *point) {
+    for (int axis = 0; axis < 3; axis++) {
+        min[axis] = std::min(min[axis], point[axis]);
+        max[axis] = std::max(max[axis], point[axis]);
+    }
+}
+
+double TriangleMesh::Bounds::surfaceArea() const {
+    if (min[0] > max[0])
+        return 0;
+
+    double x = max[0] - min[0], y = max[1] - min[1], z = max[2] - min[2];
+    return 2 * (x * y + y * z + z * x);
+}
+
+/* BoundingBox::intersect on a node's float bounds */
+bool TriangleMesh::intersectNode(const Node &node, const Ray &ray, const Vector3 &inverseDirection,
+                                 Real maxTime, Real &entryTime) {
+    Real tMin = 0;
+    Real tMax = maxTime;
+    for (int axis = 0; axis < 3; axis++) {
+        Real t1 = (node.min[axis] - ray.position[axis]) * inverseDirection[axis];
+        Real t2 = (node.max[axis] - ray.position[axis]) * inverseDirection[axis];
+        tMin = fmax(tMin, fmin(t1, t2));
+        tMax = fmin(tMax, fmax(t1, t2) * (1 + REAL_ROUNDING));
+    }
+
+    entryTime = tMin;
+    return tMin <= tMax;
+}
+
+#endif
@@ -1,163 +1,223 @@
+/* Vector3T is plain data: three scalars of type T and nothing else,
+ * trivially copyable, so rays and hits stay small and loops over them can
+ * be vectorised. The renderer uses Vector3, which is Vector3T over Real.
+ * Debug builds (without NDEBUG) also track whether each vector was ever
+ * given a value, and throw when an uninitialized one is used.
+ */
 #ifndef VECTOR_HPP
 #define VECTOR_HPP
 
 #include <math.h>
 #include <time.h>
+#include <cstdlib>
+#include <iostream>
+#include <type_traits>
+#include "Random.hpp"
+#include "Real.hpp"
+
+#ifndef NDEBUG
+#define VECTOR_CHECKS
+#include <stdexcept>
+#endif
 
-class Vector3 {
+template <typename T>
+class Vector3T {
 public:
     //- Constructors -//
-    Vector3(double a, double b, double c);
-    Vector3();
+    Vector3T(T a, T b, T c);
+    Vector3T();
 
     //- Operator overloads -//
-    friend Vector3 operator*(double b, const Vector3 &a);
-    bool operator==(const Vector3 &b) const;
-    bool operator!=(const Vector3 &b) const;
-    Vector3 operator+(const Vector3 &b) const;
-    Vector3 operator-(const Vector3 &b) const;
-    double operator*(const Vector3 &b) const;
-    Vector3 operator*(double b) const;
-    double operator[](int i) const;
-    void operator()(double a, double b, double c);
+    friend Vector3T operator*(T b, const Vector3T &a) {
+        a.throwErrorIfUndefined();
+        return a * b;
+    }
+    bool operator==(const Vector3T &b) const;
+    bool operator!=(const Vector3T &b) const;
+    Vector3T operator+(const Vector3T &b) const;
+    Vector3T operator-(const Vector3T &b) const;
+    T operator*(const Vector3T &b) const;
+    Vector3T operator*(T b) const;
+    T operator[](int i) const;
+    void operator()(T a, T b, T c);
     bool operator!() const;
 
     //- Methods -//
     void print() const;
-    Vector3 normalise() const;
+    Vector3T normalise() const;
+    //- Always false unless VECTOR_CHECKS is on -//
     bool isUndefined() const;
-    Vector3 reflectOver(const Vector3 &vec) const;
-    Vector3 cross(const Vector3 &b) const;
-    void setAt(int i, double value);
+    Vector3T reflectOver(const Vector3T &vec) const;
+    Vector3T cross(const Vector3T &b) const;
+    void setAt(int i, T value);
 
     //- Static Methods -//
-    static Vector3 rand();
+    static Vector3T rand();
 private:
-    void throwErrorIfUndefined(const Vector3 &b) const;
+    void throwErrorIfUndefined(const Vector3T &b) const;
     void throwErrorIfUndefined() const;
 
-    double vectorArray[3];
+    T vectorArray[3];
+#ifdef VECTOR_CHECKS
     bool undefined;
+#endif
 };
 
+typedef Vector3T<Real> Vector3;
+
 struct Ray {
     Vector3 direction;
     Vector3 position;
 };
 
+static_assert(std::is_trivially_copyable<Vector3>::value, "Vector3 must stay plain data");
+static_assert(std::is_trivially_copyable<Ray>::value, "Ray must stay plain data");
+
 //-Constructors-//
-Vector3::Vector3(double a, double b, double c) {
+template <typename T>
+Vector3T<T>::Vector3T(T a, T b, T c) {
     vectorArray[0] = a;
     vectorArray[1] = b;
     vectorArray[2] = c;
+#ifdef VECTOR_CHECKS
     undefined = false;
+#endif
 }
 
-Vector3::Vector3() {
+//- Leaves the components uninitialized -//
+template <typename T>
+Vector3T<T>::Vector3T() {
+#ifdef VECTOR_CHECKS
     undefined = true;
+#endif
 }
 
 //-Operator Overloads-//
-bool Vector3::operator==(const Vector3 &b) const {
+template <typename T>
+bool Vector3T<T>::operator==(const Vector3T &b) const {
     throwErrorIfUndefined(b);
     return ((*this)[0] == b[0] && (*this)[1] == b[1] && (*this)[2] == b[2]);
 }
 
-bool Vector3::operator!=(const Vector3 &b) const {
+template <typename T>
+bool Vector3T<T>::operator!=(const Vector3T &b) const {
     throwErrorIfUndefined(b);
     return !((*this) == b);
 }
 
-Vector3 Vector3::operator+(const Vector3 &b) const {
+template <typename T>
+Vector3T<T> Vector3T<T>::operator+(const Vector3T &b) const {
     throwErrorIfUndefined(b);
-    Vector3 result(vectorArray[0] + b[0], vectorArray[1] + b[1], vectorArray[2] + b[2]);
+    Vector3T result(vectorArray[0] + b[0], vectorArray[1] + b[1], vectorArray[2] + b[2]);
     return result;
 }
 
-Vector3 Vector3::operator-(const Vector3 &b) const {
+template <typename T>
+Vector3T<T> Vector3T<T>::operator-(const Vector3T &b) const {
     throwErrorIfUndefined(b);
-    Vector3 result(vectorArray[0] - b[0], vectorArray[1] - b[1], vectorArray[2] - b[2]);
+    Vector3T result(vectorArray[0] - b[0], vectorArray[1] - b[1], vectorArray[2] - b[2]);
     return result;
 }
 
-double Vector3::operator*(const Vector3 &b) const {
+template <typename T>
+T Vector3T<T>::operator*(const Vector3T &b) const {
     throwErrorIfUndefined(b);
-    double result = vectorArray[0]*b[0] + vectorArray[1]*b[1] + vectorArray[2]*b[2];
+    T result = vectorArray[0]*b[0] + vectorArray[1]*b[1] + vectorArray[2]*b[2];
     return result;
 }
 
-Vector3 Vector3::operator*(double b) const {
+template <typename T>
+Vector3T<T> Vector3T<T>::operator*(T b) const {
     throwErrorIfUndefined();
-    Vector3 result(vectorArray[0] * b, vectorArray[1] * b, vectorArray[2] * b);
+    Vector3T result(vectorArray[0] * b, vectorArray[1] * b, vectorArray[2] * b);
     return result;
 }
 
-Vector3 operator*(double b, const Vector3 &a) {
-    a.throwErrorIfUndefined();
-    return a * b;
-}
-
-double Vector3::operator[](int i) const {
+template <typename T>
+T Vector3T<T>::operator[](int i) const {
     throwErrorIfUndefined();
     return vectorArray[i];
 }
 
-void Vector3::operator()(double a, double b, double c) {
+template <typename T>
+void Vector3T<T>::operator()(T a, T b, T c) {
     vectorArray[0] = a;
     vectorArray[1] = b;
     vectorArray[2] = c;
+#ifdef VECTOR_CHECKS
     undefined = false;
+#endif
 }
 
-bool Vector3::operator!() const{
+template <typename T>
+bool Vector3T<T>::operator!() const{
     return isUndefined();
 }
 
 //- Public Methods -//
-Vector3 Vector3::normalise() const {
+template <typename T>
+Vector3T<T> Vector3T<T>::normalise() const {
     throwErrorIfUndefined();
-    double mag = sqrt((*this) * (*this));
-    Vector3 copy(vectorArray[0] / mag,
-                vectorArray[1] / mag,
-                vectorArray[2] / mag);
+    T mag = sqrt((*this) * (*this));
+    Vector3T copy(vectorArray[0] / mag,
+                  vectorArray[1] / mag,
+                  vectorArray[2] / mag);
     return copy;
 }
 
-bool Vector3::isUndefined() const {
+template <typename T>
+bool Vector3T<T>::isUndefined() const {
+#ifdef VECTOR_CHECKS
     return undefined;
+#else
+    return false;
+#endif
 }
 
-void Vector3::print() const {
+template <typename T>
+void Vector3T<T>::print() const {
     std::cout << "[" << vectorArray[0] << ", " << vectorArray[1] << ", " << vectorArray[2] << "]\n";
 }
 
-Vector3 Vector3::reflectOver(const Vector3 &normal) const {
+template <typename T>
+Vector3T<T> Vector3T<T>::reflectOver(const Vector3T &normal) const {
     throwErrorIfUndefined();
     return 2 * ((*this) * normal) * normal - (*this);
 }
 
-Vector3 Vector3::cross(const Vector3 &b) const {
+template <typename T>
+Vector3T<T> Vector3T<T>::cross(const Vector3T &b) const {
     throwErrorIfUndefined(b);
-    Vector3 result(vectorArray[1] * b[2] - b[1] * vectorArray[2],
-                  (vectorArray[2] * b[0] - vectorArray[0] * b[2]),
-                  vectorArray[0] * b[1] - vectorArray[1] * b[0]);
+    Vector3T result(vectorArray[1] * b[2] - b[1] * vectorArray[2],
+                    (vectorArray[2] * b[0] - vectorArray[0] * b[2]),
+                    vectorArray[0] * b[1] - vectorArray[1] * b[0]);
     return result;
 }
 
-void Vector3::setAt(int i, double value) {
+template <typename T>
+void Vector3T<T>::setAt(int i, T value) {
     vectorArray[i] = value;
 }
 
 //- Static Methods -//
-Vector3 Vector3::rand() {
-    Vector3 randomVector((double) std::rand() / (double) RAND_MAX,
-                        (double) std::rand() / (double) RAND_MAX,
-                        (double) std::rand() / (double) RAND_MAX);
+/* Components in [0, 1) from a counter stream kept per thread, so no
+ * thread waits on another. Every thread draws the same sequence.
+ */
+template <typename T>
+Vector3T<T> Vector3T<T>::rand() {
+    static thread_local uint32_t numberDrawn = 0;
+    RandomSequence random(numberDrawn++, 0, 0);
+    Vector3T randomVector((T) random.get(0, 0),
+                          (T) random.get(0, 1),
+                          (T) random.get(0, 2));
     return randomVector;
 }
 
 //- Private Methods -//
-void Vector3::throwErrorIfUndefined(const Vector3 &b) const {
+//- Both compile to nothing unless VECTOR_CHECKS is on -//
+template <typename T>
+inline void Vector3T<T>::throwErrorIfUndefined(const Vector3T &b) const {
+#ifdef VECTOR_CHECKS
     if (!b) {
         throw std::runtime_error("Vector3 passed as argument is uninitialized.");
     }
@@ -165,12 +225,16 @@ void Vector3::throwErrorIfUndefined(const Vector3 &b) const {
     if (undefined) {
         throw std::runtime_error("Method or operator called on uninitialized Vector3.");
     }
+#endif
 }
 
-void Vector3::throwErrorIfUndefined() const {
+template <typename T>
+inline void Vector3T<T>::throwErrorIfUndefined() const {
+#ifdef VECTOR_CHECKS
     if (undefined) {
         throw std::runtime_error("Method or operator called on uninitialized Vector3.");
     }
+#endif
 }
 
 #endif
@@ -1,76 +1,101 @@
 #include "Vector3.hpp"
 #ifndef VECTOR4_HPP
 #define VECTOR4_HPP
-class Vector4 {
+//- Four scalars aligned to their total size, so one SSE or AVX load reads a whole vector -//
+template <typename T>
+class alignas(4 * sizeof(T)) Vector4T {
 public:
-    Vector4(double a, double b, double c, double d);
-    Vector4();
-    double operator *(const Vector4 &b) const;
-    Vector4 operator +(const Vector4 &b) const;
-    Vector4 operator -(const Vector4 &b) const;
-    double operator[](int i) const;
+    Vector4T(T a, T b, T c, T d);
+    Vector4T();
+    T operator *(const Vector4T &b) const;
+    Vector4T operator +(const Vector4T &b) const;
+    Vector4T operator -(const Vector4T &b) const;
+    T operator[](int i) const;
     void print() const;
-    void setAt(int i, double value);
+    void setAt(int i, T value);
     bool isUndefined() const;
-    static Vector4 vec3ToVec4(Vector3 vector, double last) {
-        Vector4 result(vector[0], vector[1], vector[2], last);
+    static Vector4T vec3ToVec4(Vector3T<T> vector, T last) {
+        Vector4T result(vector[0], vector[1], vector[2], last);
         return result;
     }
 private:
-    double vectorArray[4];
+    T vectorArray[4];
+#ifdef VECTOR_CHECKS
     bool undefined;
-    void throwErrorIfUndefined(const Vector4 &b) const;
+#endif
+    void throwErrorIfUndefined(const Vector4T &b) const;
     void throwErrorIfUndefined() const;
 };
 
-Vector4::Vector4(double a, double b, double c, double d) {
+typedef Vector4T<Real> Vector4;
+
+template <typename T>
+Vector4T<T>::Vector4T(T a, T b, T c, T d) {
     vectorArray[0] = a;
     vectorArray[1] = b;
     vectorArray[2] = c;
     vectorArray[3] = d;
+#ifdef VECTOR_CHECKS
     undefined = false;
+#endif
 }
 
-Vector4::Vector4() {
+template <typename T>
+Vector4T<T>::Vector4T() {
+#ifdef VECTOR_CHECKS
     undefined = true;
+#endif
 }
 
-Vector4 Vector4::operator+(const Vector4 &b) const {
+template <typename T>
+Vector4T<T> Vector4T<T>::operator+(const Vector4T &b) const {
     throwErrorIfUndefined(b);
-    Vector4 result(vectorArray[0] + b[0], vectorArray[1] + b[1], vectorArray[2] + b[2], vectorArray[3] + b[3]);
+    Vector4T result(vectorArray[0] + b[0], vectorArray[1] + b[1], vectorArray[2] + b[2], vectorArray[3] + b[3]);
     return result;
 }
 
-Vector4 Vector4::operator-(const Vector4 &b) const {
+template <typename T>
+Vector4T<T> Vector4T<T>::operator-(const Vector4T &b) const {
     throwErrorIfUndefined(b);
-    Vector4 result(vectorArray[0] - b[0], vectorArray[1] - b[1], vectorArray[2] - b[2], vectorArray[3] - b[3]);
+    Vector4T result(vectorArray[0] - b[0], vectorArray[1] - b[1], vectorArray[2] - b[2], vectorArray[3] - b[3]);
     return result;
 }
 
-double Vector4::operator*(const Vector4 &b) const {
+template <typename T>
+T Vector4T<T>::operator*(const Vector4T &b) const {
     throwErrorIfUndefined(b);
-    double result = vectorArray[0]*b[0] + vectorArray[1]*b[1] + vectorArray[2]*b[2] + vectorArray[3] * b[3];
+    T result = vectorArray[0]*b[0] + vectorArray[1]*b[1] + vectorArray[2]*b[2] + vectorArray[3] * b[3];
     return result;
 }
 
-double Vector4::operator[](int i) const {
+template <typename T>
+T Vector4T<T>::operator[](int i) const {
     throwErrorIfUndefined();
     return vectorArray[i];
 }
 
-bool Vector4::isUndefined() const {
+template <typename T>
+bool Vector4T<T>::isUndefined() const {
+#ifdef VECTOR_CHECKS
     return undefined;
+#else
+    return false;
+#endif
 }
 
-void Vector4::print() const {
+template <typename T>
+void Vector4T<T>::print() const {
     std::cout << "[" << vectorArray[0] << ", " << vectorArray[1] << ", " << vectorArray[2] << ", " << vectorArray[3] << "]\n";
 }
 
-void Vector4::setAt(int i, double value) {
+template <typename T>
+void Vector4T<T>::setAt(int i, T value) {
     vectorArray[i] = value;
 }
 
-void Vector4::throwErrorIfUndefined(const Vector4 &b) const {
+template <typename T>
+inline void Vector4T<T>::throwErrorIfUndefined(const Vector4T &b) const {
+#ifdef VECTOR_CHECKS
     if (b.isUndefined()) {
         throw std::runtime_error("Vector4 passed as argument is uninitialized.");
     }
@@ -78,11 +103,15 @@ void Vector4::throwErrorIfUndefined(const Vector4 &b) const {
     if (undefined) {
         throw std::runtime_error("Method or operator called on uninitialized Vector4.");
     }
+#endif
 }
 
-void Vector4::throwErrorIfUndefined() const {
+template <typename T>
+inline void Vector4T<T>::throwErrorIfUndefined() const {
+#ifdef VECTOR_CHECKS
     if (undefined) {
         throw std::runtime_error("Method or operator called on uninitialized Vector4.");
     }
+#endif
 }
 #endif
\ No newline at end of file
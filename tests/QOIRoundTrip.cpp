@@ -0,0 +1,100 @@
+/* Encodes images with ImageWriter::encodeQOI and decodes them as the QOI
+ * reference decoder does, checking every pixel comes back. Build and run
+ * from the repository's root:
+ *
+ *   g++ -std=c++11 -pthread -I. tests/QOIRoundTrip.cpp -o qoitest && ./qoitest
+ */
+#include "ImageWriter.hpp"
+#include <stdlib.h>
+#include <iostream>
+#include <vector>
+
+/* The reference decoder: the index is RGBA, starts all zero, and every
+ * decoded pixel is stored in it, runs included.
+ */
+bool decodeQOI(const std::vector<unsigned char> &data, unsigned width, unsigned height, std::vector<unsigned char> &rgb) {
+    if (data.size() < 14 + 8 || data[0] != 'q' || data[1] != 'o' || data[2] != 'i' || data[3] != 'f')
+        return false;
+
+    unsigned char index[64][4] = {{0}};
+    unsigned char pixel[4] = {0, 0, 0, 255};
+    size_t position = 14;
+    size_t end = data.size() - 8;
+    unsigned run = 0;
+    rgb.clear();
+    for (size_t i = 0; i < (size_t) width * height; i++) {
+        if (run > 0) {
+            run--;
+        } else {
+            if (position >= end)
+                return false;
+            unsigned char op = data[position++];
+            if (op == 0xfe) {
+                for (int c = 0; c < 3; c++)
+                    pixel[c] = data[position++];
+            } else if (op == 0xff) {
+                for (int c = 0; c < 4; c++)
+                    pixel[c] = data[position++];
+            } else if ((op & 0xc0) == 0x00) {
+                for (int c = 0; c < 4; c++)
+                    pixel[c] = index[op][c];
+            } else if ((op & 0xc0) == 0x40) {
+                pixel[0] += ((op >> 4) & 3) - 2;
+                pixel[1] += ((op >> 2) & 3) - 2;
+                pixel[2] += (op & 3) - 2;
+            } else if ((op & 0xc0) == 0x80) {
+                int green = (op & 0x3f) - 32;
+                unsigned char next = data[position++];
+                pixel[0] += green - 8 + ((next >> 4) & 0x0f);
+                pixel[1] += green;
+                pixel[2] += green - 8 + (next & 0x0f);
+            } else {
+                run = op & 0x3f;
+            }
+            unsigned hash = (pixel[0] * 3 + pixel[1] * 5 + pixel[2] * 7 + pixel[3] * 11) % 64;
+            for (int c = 0; c < 4; c++)
+                index[hash][c] = pixel[c];
+        }
+        if (pixel[3] != 255)
+            return false;
+        rgb.insert(rgb.end(), pixel, pixel + 3);
+    }
+    return true;
+}
+
+bool roundTrip(const char *name, const std::vector<unsigned char> &rgb, unsigned width, unsigned height) {
+    std::vector<unsigned char> encoded, decoded;
+    ImageWriter::encodeQOI(rgb.data(), width, height, encoded);
+    if (!decodeQOI(encoded, width, height, decoded) || decoded != rgb) {
+        std::cerr << name << ": decoded pixels differ\n";
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    bool passed = true;
+
+    //- Opaque black hashes to a slot nothing has been stored in yet -//
+    const unsigned char blackFirst[] = {100, 50, 20,  0, 0, 0,  1, 1, 1,  100, 50, 20,
+                                        1, 1, 1,  50, 60, 70,  0, 0, 0,  50, 60, 70};
+    passed = roundTrip("black before its slot is used", std::vector<unsigned char>(blackFirst, blackFirst + 24), 8, 1)
+             && passed;
+
+    const unsigned char black[] = {0, 0, 0,  0, 0, 0,  10, 20, 30,  0, 0, 0};
+    passed = roundTrip("black image start", std::vector<unsigned char>(black, black + 12), 4, 1) && passed;
+
+    //- Runs, indices and every kind of difference -//
+    std::vector<unsigned char> noise;
+    srand(1);
+    for (unsigned i = 0; i < 64 * 64; i++) {
+        unsigned char value = rand() % 4 == 0 ? rand() : (i / 7) % 5;
+        noise.push_back(value);
+        noise.push_back(value + rand() % 3);
+        noise.push_back(rand() % 8 == 0 ? rand() : value);
+    }
+    passed = roundTrip("noise", noise, 64, 64) && passed;
+
+    std::cout << (passed ? "passed\n" : "failed\n");
+    return passed ? 0 : 1;
+}